@@ -1,7 +1,14 @@
 #!/bin/sh
 
+# usage: ./build.sh [debug|release|native|lto|pgo]   (default: debug)
+
 set -xe
 
-gcc -g main.c -o dolus -lm
+CONFIG=${1:-debug}
+make $CONFIG
 
-./dolus
+if [ "$CONFIG" = debug ]; then
+    ./dolus
+else
+    ./build/dolus_$CONFIG
+fi
@@ -18,29 +18,207 @@ typedef struct
     f32 diffuse;
     f32 specular;
     f32 shininess;
+
+    // NOTE: weight of the mirror ray and of the ray through the surface.
+    // With both set schlick's fresnel splits them by angle.
+    f32 reflective;
+    f32 transparency;
+    f32 refractive_index;
 } Material;
 
+// NOTE: shapes name their material by index into World.materials, so any
+// number of them can share one. Entry 0 is always material(), a shape
+// nobody gave a material uses that.
+#define DEFAULT_MATERIAL 0
+
+// NOTE: the intersection kernels read inverse and center from World.soa,
+// this is the full copy for building, shading and the reference kernel.
+// What a ray test needs comes first, the rest only matters for normals.
 typedef struct
 {
+    // NOTE: inverse and inverse_transpose are cached by set_sphere_transform,
+    // never write transform directly
+    m4x4 inverse;
     v4 center;
     f32 radius;
+    u32 material_index;
     m4x4 transform;
-    Material material;
+    m4x4 inverse_transpose;
 } Sphere;
 
+// NOTE: object space for the shapes that have one (Sphere predates this
+// and keeps its own copy of the three matrices)
+typedef struct
+{
+    m4x4 matrix;
+    m4x4 inverse;
+    m4x4 inverse_transpose;
+} ObjectTransform;
+
+// NOTE: the y = 0 plane in object space
+typedef struct
+{
+    ObjectTransform transform;
+    u32 material_index;
+} Plane;
+
+// NOTE: -1..1 on every axis in object space
+typedef struct
+{
+    ObjectTransform transform;
+    u32 material_index;
+} Cube;
+
+// NOTE: radius 1 around the y axis in object space, between minimum and
+// maximum (both infinite by default), closed = capped at both ends
+typedef struct
+{
+    ObjectTransform transform;
+    f32 minimum;
+    f32 maximum;
+    u32 closed;
+    u32 material_index;
+} Cylinder;
+
+// NOTE: world space, edges and normal precomputed
+typedef struct
+{
+    v4 p1, p2, p3;
+    v4 e1, e2;
+    v4 normal;
+    u32 material_index;
+} Triangle;
+
+typedef enum
+{
+    Shape_Sphere,
+    Shape_Plane,
+    Shape_Cube,
+    Shape_Cylinder,
+    Shape_Triangle,
+    Shape_Mesh,
+
+    Shape_Count,
+} ShapeType;
+
 typedef struct
 {
     bool hit;
     f32 t1, t2;
 } Tvalue;
 
+typedef enum
+{
+    Light_Point,
+    // NOTE: parallelogram centred on position, spanned by edge_u and edge_v
+    Light_Rect,
+    // NOTE: ball of radius around position
+    Light_Sphere,
+} LightType;
+
+#define AREA_LIGHT_SAMPLES 16
+// NOTE: a 32x32 grid, every shade point traces this many rays per light
+#define AREA_LIGHT_MAX_SAMPLES 1024
+
+// NOTE: intensity = color. Area lights are shaded from their centre like a
+// point light and scaled by how much of them the shade point sees, which
+// takes samples shadow rays (rounded up to a square for the strata).
+// Without falloff a light is as bright everywhere, with it the intensity
+// is divided by 1 + distance^2 (see light_intensity_at).
 typedef struct
 {
-    // NOTE: intensity = color
     v3 intensity;
     v4 position;
-} PointLight;
+    u32 type;
+    u32 samples;
+    f32 radius;
+    v4 edge_u;
+    v4 edge_v;
+    u32 falloff;
+} Light;
+
+typedef struct
+{
+    v3 min;
+    v3 max;
+} AABB;
+
+// NOTE: 32 bytes, two nodes per cache line. Interior nodes keep their left
+// child right after themselves, so only the right child index is stored.
+typedef struct
+{
+    v3 min;
+    u32 left_first; // interior: right child index, leaf: first entry in indices
+    v3 max;
+    u32 count;      // 0 for interior nodes
+} BVHNode;
 
+typedef struct
+{
+    u32 node_count;
+    BVHNode *nodes;
+
+    u32 index_count;
+    u32 *indices;
+} BVH;
+
+// NOTE: lights with falloff are cut off where their intensity drops below
+// the cutoff, so each one only reaches a ball around its position. The bvh
+// is over those balls and indices are light indices. Lights without falloff
+// reach everything and are in global instead, in light index order.
+typedef struct
+{
+    BVH bvh;
+    // NOTE: per light index, F32MAX for the global ones
+    f32 *range_squared;
+    u32 global_count;
+    u32 *global;
+} LightTree;
+
+// NOTE: indexed triangle mesh. Its vertices, index triples and bvh nodes
+// live in the shared World.mesh_* arrays, the mesh only records where its
+// range starts. Indices are local to the mesh (0 is its first vertex).
+// Triangles are stored in blas leaf order so a leaf is a contiguous run of
+// triangles, and leaf/child indices in its nodes are local to it as well.
+typedef struct
+{
+    char name[32];
+    u32 first_vertex;
+    u32 vertex_count;
+    u32 first_triangle;
+    u32 triangle_count;
+    u32 first_node;
+    u32 node_count;
+    // NOTE: object space, same as the blas root
+    AABB bounds;
+} Mesh;
+
+// NOTE: a mesh placed in the world. Any number of instances can share one
+// mesh, the triangles are never copied or transformed.
+typedef struct
+{
+    ObjectTransform transform;
+    u32 mesh_index;
+    u32 material_index;
+} MeshInstance;
+
+// NOTE: spheres as structure of arrays for the simd kernels. Slot i is
+// world->spheres[object_index[i]], slots follow bvh leaf order so a leaf is
+// one contiguous span. All 16 inverse entries are kept (not just the affine
+// 3x4) so the kernels reproduce ray_intersect_sphere bit for bit.
+typedef struct
+{
+    u32 count;
+    u32 *object_index;
+    f32 *inverse[16];
+    f32 *center[4];
+    f32 *memory;
+} SphereSoA;
+
+// NOTE: every shape type has its own array and gets intersected as one
+// batch. Object indices (X.object_index) count through the types in
+// ShapeType order: spheres first, then planes, cubes, cylinders, triangles
+// and mesh instances.
 typedef struct
 {
     u32 object_count;
@@ -48,29 +226,67 @@ typedef struct
     u32 sphere_count;
     Sphere *spheres;
 
+    u32 plane_count;
+    Plane *planes;
+    u32 cube_count;
+    Cube *cubes;
+    u32 cylinder_count;
+    Cylinder *cylinders;
+    u32 triangle_count;
+    Triangle *triangles;
+
+    u32 mesh_count;
+    Mesh *meshes;
+    u32 mesh_vertex_count;
+    v3 *mesh_vertices;
+    u32 mesh_triangle_count;
+    u32 *mesh_indices;
+    u32 mesh_node_count;
+    BVHNode *mesh_nodes;
+    u32 instance_count;
+    MeshInstance *instances;
+    // NOTE: top level bvh over the instances, indices are instance indices
+    BVH tlas;
+
+    u32 material_count;
+    Material *materials;
+
     u32 light_count;
-    PointLight *lights;
-    
+    Light *lights;
+    // NOTE: built after loading (see build_light_tree), never cached
+    LightTree light_tree;
+
+    // NOTE: node_count == 0 means no bvh, intersect_world scans every sphere
+    BVH bvh;
+    SphereSoA soa;
+
+    // NOTE: every array above comes from here (scene loading grows its
+    // arrays on the heap and copies them in when done), free_world frees
+    // the lot in one go
+    MemoryArena arena;
+
+    // NOTE: set when the arrays above point into a mapped scene cache
+    // instead, the arena then only holds what was built after mapping
+    void *mapped_memory;
+    u64 mapped_size;
 } World;
 
 typedef struct
 {
     f32 t;
     int object_index;
+    // NOTE: triangle of the mesh for instance hits, unused otherwise
+    u32 primitive;
 } X;
 
-typedef struct
-{
-    X t_values[256];
-    int intersect_count;
-} WorldIntersects;
-
 typedef struct
 {
     f32 t;
     int object_index;
     bool inside;
     v4 point, over_point;
+    // NOTE: just below the surface, where refracted rays start
+    v4 under_point;
     v4 eyev;
     v4 normalv;
 } Computation;
@@ -85,6 +301,22 @@ typedef struct
     m4x4 transform;
 } Camera;
 
+// NOTE: everything about primary rays that is constant for a frame. The
+// pixel plane point of pixel (x, y) is placed directly as top_left +
+// x*step_x + y*step_y, two multiply-adds per ray and no matrix multiply,
+// and never by stepping from a neighbour, so it is the same for every pixel
+// whichever tile or chunk traces it.
+typedef struct
+{
+    u32 h_size;
+    u32 v_size;
+    m4x4 inverse_view;
+    v4 origin;
+    v4 top_left;
+    v4 step_x;
+    v4 step_y;
+} RayGenerator;
+
 extern inline v4 ray_position(Ray ray, f32 t)
 {
     v4 result = {};
@@ -101,17 +333,89 @@ extern inline void transform_ray(m4x4 matrix, Ray *r)
 extern inline void set_sphere_transform(Sphere *s, m4x4 transform)
 {
     s->transform = transform;
+    m4x4_invert(transform, &s->inverse);
+    s->inverse_transpose = m4x4_transpose(s->inverse);
+}
+
+extern inline ObjectTransform object_transform(m4x4 matrix)
+{
+    ObjectTransform result = {};
+    result.matrix = matrix;
+    m4x4_invert(matrix, &result.inverse);
+    result.inverse_transpose = m4x4_transpose(result.inverse);
+    return(result);
+}
+
+extern inline u32 shape_count(World *world, ShapeType shape)
+{
+    u32 counts[Shape_Count] =
+    {
+        world->sphere_count, world->plane_count, world->cube_count,
+        world->cylinder_count, world->triangle_count, world->instance_count,
+    };
+    return(counts[shape]);
+}
+
+extern inline void count_objects(World *world)
+{
+    world->object_count = world->sphere_count + world->plane_count + world->cube_count +
+                          world->cylinder_count + world->triangle_count + world->instance_count;
+}
+
+// NOTE: true when there is anything besides spheres to intersect
+extern inline bool world_has_shapes(World *world)
+{
+    bool result = (world->object_count > world->sphere_count);
+    return(result);
 }
 
-extern inline Tvalue ray_intersect_sphere(Ray ray, Sphere s)
+extern inline u32 object_index_base(World *world, ShapeType shape)
+{
+    u32 result = 0;
+    for(u32 type = 0; type < (u32)shape; ++type)
+    {
+        result += shape_count(world, (ShapeType)type);
+    }
+    return(result);
+}
+
+extern inline ShapeType object_shape(World *world, u32 object_index, u32 *local_index)
+{
+    u32 type = 0;
+    while(type + 1 < Shape_Count && object_index >= shape_count(world, (ShapeType)type))
+    {
+        object_index -= shape_count(world, (ShapeType)type);
+        ++type;
+    }
+    *local_index = object_index;
+    return((ShapeType)type);
+}
+
+extern inline Material *object_material(World *world, u32 object_index)
+{
+    u32 local_index;
+    u32 material_index = DEFAULT_MATERIAL;
+    switch(object_shape(world, object_index, &local_index))
+    {
+        case Shape_Sphere: material_index = world->spheres[local_index].material_index; break;
+        case Shape_Plane: material_index = world->planes[local_index].material_index; break;
+        case Shape_Cube: material_index = world->cubes[local_index].material_index; break;
+        case Shape_Cylinder: material_index = world->cylinders[local_index].material_index; break;
+        case Shape_Triangle: material_index = world->triangles[local_index].material_index; break;
+        case Shape_Mesh: material_index = world->instances[local_index].material_index; break;
+        default: break;
+    }
+    Material *result = world->materials + material_index;
+    return(result);
+}
+
+extern inline Tvalue ray_intersect_sphere(Ray ray, Sphere *s)
 {
     Tvalue result = {};
 
-    m4x4 inverted_transform = {};
-    m4x4_invert(s.transform, &inverted_transform);
-    transform_ray(inverted_transform, &ray);
+    transform_ray(s->inverse, &ray);
     
-    v4 sphere_to_ray = v4_sub(ray.origin, s.center);
+    v4 sphere_to_ray = v4_sub(ray.origin, s->center);
     
     f32 a = v4_dot(ray.direction, ray.direction);
     f32 b = 2 * v4_dot(ray.direction, sphere_to_ray);
@@ -131,15 +435,32 @@ extern inline Tvalue ray_intersect_sphere(Ray ray, Sphere s)
     return(result);
 }
 
-extern inline v4 normal_at_point(Sphere s, v4 Point)
+// NOTE: nearest root in (t_min, t_max), t1 <= t2 always since a > 0
+extern inline bool sphere_nearest_root(Tvalue t, f32 t_min, f32 t_max, f32 *root)
 {
-    m4x4 invert = {};
-    m4x4_invert(s.transform, &invert);
-    v4 object_point = m4x4_mul_v4(invert, Point);
-    v4 object_normal = v4_sub(object_point, s.center);
+    bool result = false;
+    if(t.hit)
+    {
+        if(t.t1 > t_min && t.t1 < t_max)
+        {
+            *root = t.t1;
+            result = true;
+        }
+        else if(t.t2 > t_min && t.t2 < t_max)
+        {
+            *root = t.t2;
+            result = true;
+        }
+    }
+    return(result);
+}
+
+extern inline v4 normal_at_point(Sphere *s, v4 Point)
+{
+    v4 object_point = m4x4_mul_v4(s->inverse, Point);
+    v4 object_normal = v4_sub(object_point, s->center);
     
-    m4x4 transpose = m4x4_transpose(invert);
-    v4 world_normal = m4x4_mul_v4(transpose, object_normal);
+    v4 world_normal = m4x4_mul_v4(s->inverse_transpose, object_normal);
     
     world_normal.w = 0;
     return(v4_normalize(world_normal));
@@ -153,6 +474,82 @@ extern inline Material material()
     result.diffuse = 0.9f;
     result.specular = 0.9f;
     result.shininess = 200.0f;
+    result.reflective = 0.0f;
+    result.transparency = 0.0f;
+    result.refractive_index = 1.0f;
+    return(result);
+}
+
+extern inline Plane plane(m4x4 transform)
+{
+    Plane result = {};
+    result.transform = object_transform(transform);
+    return(result);
+}
+
+extern inline Cube cube(m4x4 transform)
+{
+    Cube result = {};
+    result.transform = object_transform(transform);
+    return(result);
+}
+
+extern inline Cylinder cylinder(m4x4 transform, f32 minimum, f32 maximum, bool closed)
+{
+    Cylinder result = {};
+    result.transform = object_transform(transform);
+    result.minimum = minimum;
+    result.maximum = maximum;
+    result.closed = closed;
+    return(result);
+}
+
+extern inline Triangle triangle(v4 p1, v4 p2, v4 p3)
+{
+    Triangle result = {};
+    result.p1 = p1;
+    result.p2 = p2;
+    result.p3 = p3;
+    result.e1 = v4_sub(p2, p1);
+    result.e2 = v4_sub(p3, p1);
+    result.normal = v4_normalize(v4_cross(result.e2, result.e1));
+    return(result);
+}
+
+extern inline Light point_light(v4 position, v3 intensity)
+{
+    Light result = {};
+    result.type = Light_Point;
+    result.position = position;
+    result.intensity = intensity;
+    result.samples = 1;
+    return(result);
+}
+
+extern inline Light rect_light(v4 center, v4 edge_u, v4 edge_v, v3 intensity)
+{
+    Light result = point_light(center, intensity);
+    result.type = Light_Rect;
+    result.edge_u = edge_u;
+    result.edge_v = edge_v;
+    result.samples = AREA_LIGHT_SAMPLES;
+    return(result);
+}
+
+extern inline Light sphere_light(v4 center, f32 radius, v3 intensity)
+{
+    Light result = point_light(center, intensity);
+    result.type = Light_Sphere;
+    result.radius = radius;
+    result.samples = AREA_LIGHT_SAMPLES;
+    return(result);
+}
+
+extern inline MeshInstance mesh_instance(u32 mesh_index, m4x4 transform)
+{
+    MeshInstance result = {};
+    result.transform = object_transform(transform);
+    result.mesh_index = mesh_index;
     return(result);
 }
 
@@ -162,7 +559,8 @@ extern inline Sphere sphere(v3 center, f32 radius)
     result.center = Point(center.x, center.y, center.z);
     result.radius = 1;
     result.transform = m4x4_identity();
-    result.material = material();
+    result.inverse = m4x4_identity();
+    result.inverse_transpose = m4x4_identity();
     return(result);
 }
 
@@ -195,4 +593,62 @@ extern inline Camera camera(u32 h_size, u32 v_size, f32 field_of_view)
     return(result);
 }
 
+extern inline RayGenerator ray_generator(Camera *cam)
+{
+    RayGenerator result = {};
+    result.h_size = cam->h_size;
+    result.v_size = cam->v_size;
+    m4x4_invert(cam->transform, &result.inverse_view);
+
+    // NOTE: camera space pixel centres are (half_width - (x + 0.5)*pixel_size,
+    // half_height - (y + 0.5)*pixel_size, -1)
+    f32 half_pixel = 0.5f * cam->pixel_size;
+    result.origin = m4x4_mul_v4(result.inverse_view, Point(0.0f, 0.0f, 0.0f));
+    result.top_left = m4x4_mul_v4(result.inverse_view, Point(cam->half_width - half_pixel, cam->half_height - half_pixel, -1));
+    result.step_x = m4x4_mul_v4(result.inverse_view, Vector(-cam->pixel_size, 0.0f, 0.0f));
+    result.step_y = m4x4_mul_v4(result.inverse_view, Vector(0.0f, -cam->pixel_size, 0.0f));
+    return(result);
+}
+
+extern inline v4 pixel_plane_point(RayGenerator *gen, u32 x, u32 y)
+{
+    v4 result = v4_add(gen->top_left, v4_add(v4_scalar_mul(gen->step_x, (f32)x),
+                                             v4_scalar_mul(gen->step_y, (f32)y)));
+    return(result);
+}
+
+extern inline Ray generate_ray(RayGenerator *gen, u32 x, u32 y)
+{
+    Ray result = {};
+    result.origin = gen->origin;
+    result.direction = v4_normalize(v4_sub(pixel_plane_point(gen, x, y), gen->origin));
+    return(result);
+}
+
+// NOTE: a ray through pixel (x, y) moved by (dx, dy) pixels, dx and dy in
+// [-0.5, 0.5) stay inside the pixel
+extern inline Ray generate_ray_offset(RayGenerator *gen, u32 x, u32 y, f32 dx, f32 dy)
+{
+    v4 pixel = v4_add(gen->top_left, v4_add(v4_scalar_mul(gen->step_x, (f32)x + dx),
+                                            v4_scalar_mul(gen->step_y, (f32)y + dy)));
+    Ray result = {};
+    result.origin = gen->origin;
+    result.direction = v4_normalize(v4_sub(pixel, gen->origin));
+    return(result);
+}
+
+// NOTE: count rays starting at pixel (x, y) going right. Every one is
+// placed from the frame's top left like generate_ray, not by step_x adds
+// from the first, so a pixel gets the same ray whatever tile or chunk it is
+// in and the image does not depend on --tile.
+extern inline void generate_ray_row(RayGenerator *gen, u32 x, u32 y, u32 count, Ray *rays)
+{
+    for(u32 i = 0;
+        i < count;
+        ++i)
+    {
+        rays[i] = generate_ray(gen, x + i, y);
+    }
+}
+
 #endif
@@ -0,0 +1,589 @@
+#ifndef _H_DOLUSBENCH
+#define _H_DOLUSBENCH
+
+// NOTE: --bench. Renders a fixed set of reference scenes a few times each
+// through the normal render_image path, writes the numbers as json and, if
+// there is a baseline json, fails when primary rays/sec dropped by more than
+// the tolerance or when tracing allocated anything. A baseline recorded with
+// other settings (bench_setting_values) is refused rather than compared, and
+// with require_baseline so is a missing one. With --threads 1 and hardware counters it also counts L1D
+// and last level cache misses per primary ray and compares those too.
+// Every scene is also rendered once more at each of bench_check_tiles and
+// has to come out byte for byte the same as at --tile, or the bench fails.
+
+typedef struct
+{
+    char *name;
+    u32 stress_count;
+    u32 stress_triangles;
+    u32 stress_lights;
+} BenchScene;
+
+internal BenchScene bench_scenes[] =
+{
+    {"demo", 0, 0, 0},
+    {"stress_10k", 10000, 0, 0},
+    {"mesh_1m", 0, 1 << 20, 0},
+    {"lights_1k", 0, 0, 1024},
+};
+
+// NOTE: not multiples of PACKET_WIDTH, so tiles and packet chunks start
+// at other pixels than with the default
+internal u32 bench_check_tiles[] = {7, 20};
+
+typedef struct
+{
+    u32 iterations;
+    char *json_filename;
+    char *baseline_filename;
+    bool update_baseline;
+    bool require_baseline;
+    f64 tolerance;
+
+    RenderMode mode;
+    bool use_bvh;
+    SphereKernelType kernel;
+    u32 tile_size;
+    u32 width;
+    u32 height;
+} BenchSettings;
+
+typedef struct
+{
+    char *name;
+    u32 sphere_count;
+    u32 triangle_count;
+    u32 light_count;
+    f64 best_seconds;
+    f64 median_seconds;
+    u64 primary_rays;
+    u64 shadow_rays;
+    f64 primary_rays_per_sec;
+    f64 shadow_rays_per_sec;
+    f64 phase_seconds[Phase_Count];
+    f64 output_seconds;
+    // NOTE: over every iteration, anything but 0 fails the benchmark
+    u64 allocations;
+    // NOTE: the first of bench_check_tiles whose image differed, 0 if none
+    u32 differing_tile_size;
+    // NOTE: only with counters, see open_cache_counters
+    bool counted;
+    f64 misses_per_primary[CacheCounter_Count];
+} BenchResult;
+
+internal char *cache_counter_names[CacheCounter_Count] = {"l1d_misses_per_primary", "llc_misses_per_primary"};
+
+internal char *phase_names[Phase_Count] = {"ray_gen", "intersect", "shade"};
+
+internal int compare_f64(const void *a, const void *b)
+{
+    f64 A = *(f64 *)a;
+    f64 B = *(f64 *)b;
+    return((A > B) - (A < B));
+}
+
+// NOTE: counters is 0 when cache misses are not counted
+internal BenchResult bench_scene(ThreadPool *pool, BenchSettings *settings, BenchScene *scene, CacheCounters *counters)
+{
+    BenchResult result = {};
+    result.name = scene->name;
+
+    World world = {};
+    SceneView view;
+    setup_world(&world, &view, 0, scene->stress_count, scene->stress_triangles, scene->stress_lights,
+                settings->use_bvh, settings->kernel, false);
+    result.sphere_count = world.sphere_count;
+    result.triangle_count = world.mesh_triangle_count;
+    result.light_count = world.light_count;
+
+    ImageU32 image = {};
+    image.width = settings->width;
+    image.height = settings->height;
+    image.pixels = (u32 *)heap_alloc(get_pixel_size(image));
+    view.width = image.width;
+    view.height = image.height;
+    Camera cam = view_camera(&view);
+
+    RenderJob job = {};
+    job.world = &world;
+    job.camera = &cam;
+    job.image = &image;
+    job.mode = settings->mode;
+    job.tile_size = settings->tile_size;
+    job.quiet = true;
+
+    f64 *seconds = (f64 *)heap_alloc(settings->iterations * sizeof(f64));
+    u64 cycles[Phase_Count] = {};
+    u64 tsc_total = 0;
+    f64 wall_total = 0.0;
+    u64 misses[CacheCounter_Count] = {};
+
+    for(u32 iteration = 0;
+        iteration < settings->iterations;
+        ++iteration)
+    {
+        if(counters)
+        {
+            start_cache_counters(counters);
+        }
+        f64 start = get_wall_clock();
+        u64 tsc_start = __rdtsc();
+        render_image(pool, &job);
+        tsc_total += __rdtsc() - tsc_start;
+        if(counters)
+        {
+            stop_cache_counters(counters, misses);
+        }
+        seconds[iteration] = get_wall_clock() - start;
+        wall_total += seconds[iteration];
+
+        for(u32 phase = 0; phase < Phase_Count; ++phase)
+        {
+            cycles[phase] += job.stats.cycles[phase];
+        }
+        result.allocations += job.stats.allocations;
+
+        start = get_wall_clock();
+        save_image(image, "bench_output.bmp");
+        result.output_seconds += get_wall_clock() - start;
+    }
+    remove("bench_output.bmp");
+
+    qsort(seconds, settings->iterations, sizeof(f64), compare_f64);
+    result.best_seconds = seconds[0];
+    result.median_seconds = seconds[settings->iterations / 2];
+    result.primary_rays = job.stats.primary_rays;
+    result.shadow_rays = job.stats.shadow_rays;
+    result.primary_rays_per_sec = result.primary_rays / result.best_seconds;
+    result.shadow_rays_per_sec = result.shadow_rays / result.best_seconds;
+    result.output_seconds /= settings->iterations;
+    if(counters)
+    {
+        result.counted = true;
+        for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+        {
+            result.misses_per_primary[counter] = (f64)misses[counter] / ((f64)result.primary_rays * settings->iterations);
+        }
+    }
+
+    // NOTE: phase cycles are summed over all workers; turn them into the
+    // average seconds one thread spent per frame in each phase
+    f64 tsc_per_second = tsc_total / wall_total;
+    for(u32 phase = 0; phase < Phase_Count; ++phase)
+    {
+        result.phase_seconds[phase] = cycles[phase] / tsc_per_second / pool->thread_count / settings->iterations;
+    }
+
+    ImageU32 check_image = image;
+    check_image.pixels = (u32 *)heap_alloc(get_pixel_size(image));
+    job.image = &check_image;
+    for(u32 check = 0;
+        check < sizeof(bench_check_tiles) / sizeof(bench_check_tiles[0]) && !result.differing_tile_size;
+        ++check)
+    {
+        job.tile_size = bench_check_tiles[check];
+        render_image(pool, &job);
+        result.allocations += job.stats.allocations;
+        if(memcmp(image.pixels, check_image.pixels, get_pixel_size(image)) != 0)
+        {
+            result.differing_tile_size = job.tile_size;
+        }
+    }
+
+    heap_free(seconds);
+    heap_free(check_image.pixels);
+    heap_free(image.pixels);
+    free_arena(&job.frame_arena);
+    free_world(&world);
+    return(result);
+}
+
+// NOTE: everything the numbers depend on besides the machine and the
+// build, as the json text write_bench_json writes for each
+typedef struct
+{
+    char *key;
+    char value[32];
+} BenchSettingValue;
+
+#define BENCH_SETTING_COUNT 7
+
+internal void bench_setting_values(BenchSettings *settings, u32 thread_count, BenchSettingValue *values)
+{
+    values[0].key = "threads";
+    snprintf(values[0].value, sizeof(values[0].value), "%u", thread_count);
+    values[1].key = "width";
+    snprintf(values[1].value, sizeof(values[1].value), "%u", settings->width);
+    values[2].key = "height";
+    snprintf(values[2].value, sizeof(values[2].value), "%u", settings->height);
+    values[3].key = "tile";
+    snprintf(values[3].value, sizeof(values[3].value), "%u", settings->tile_size);
+    values[4].key = "mode";
+    snprintf(values[4].value, sizeof(values[4].value), "\"%s\"",
+             (settings->mode == RenderMode_Packet) ? "packet" : "pixel");
+    values[5].key = "kernel";
+    snprintf(values[5].value, sizeof(values[5].value), "\"%s\"", sphere_kernel_name(settings->kernel));
+    values[6].key = "bvh";
+    snprintf(values[6].value, sizeof(values[6].value), "%s", settings->use_bvh ? "true" : "false");
+}
+
+internal void write_bench_json(char *filename, BenchSettings *settings, u32 thread_count, BenchResult *results, u32 result_count)
+{
+    BenchSettingValue values[BENCH_SETTING_COUNT];
+    bench_setting_values(settings, thread_count, values);
+
+    FILE *file = fopen(filename, "w");
+    if(!file)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+        exit(1);
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"version\": 2,\n");
+    for(u32 setting = 0; setting < BENCH_SETTING_COUNT; ++setting)
+    {
+        fprintf(file, "  \"%s\": %s,\n", values[setting].key, values[setting].value);
+    }
+    fprintf(file, "  \"iterations\": %u,\n", settings->iterations);
+    fprintf(file, "  \"scenes\": [\n");
+    for(u32 index = 0;
+        index < result_count;
+        ++index)
+    {
+        BenchResult *r = results + index;
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", r->name);
+        fprintf(file, "      \"spheres\": %u,\n", r->sphere_count);
+        fprintf(file, "      \"mesh_triangles\": %u,\n", r->triangle_count);
+        fprintf(file, "      \"lights\": %u,\n", r->light_count);
+        fprintf(file, "      \"best_seconds\": %.6f,\n", r->best_seconds);
+        fprintf(file, "      \"median_seconds\": %.6f,\n", r->median_seconds);
+        fprintf(file, "      \"primary_rays\": %llu,\n", (unsigned long long)r->primary_rays);
+        fprintf(file, "      \"shadow_rays\": %llu,\n", (unsigned long long)r->shadow_rays);
+        fprintf(file, "      \"primary_rays_per_sec\": %.1f,\n", r->primary_rays_per_sec);
+        fprintf(file, "      \"shadow_rays_per_sec\": %.1f,\n", r->shadow_rays_per_sec);
+        fprintf(file, "      \"allocations\": %llu,\n", (unsigned long long)r->allocations);
+        if(r->counted)
+        {
+            for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+            {
+                fprintf(file, "      \"%s\": %.4f,\n", cache_counter_names[counter], r->misses_per_primary[counter]);
+            }
+        }
+        fprintf(file, "      \"phases\": {");
+        for(u32 phase = 0; phase < Phase_Count; ++phase)
+        {
+            fprintf(file, "\"%s\": %.6f, ", phase_names[phase], r->phase_seconds[phase]);
+        }
+        fprintf(file, "\"output\": %.6f}\n", r->output_seconds);
+        fprintf(file, "    }%s\n", (index + 1 < result_count) ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    fclose(file);
+}
+
+internal char *read_entire_file(char *filename)
+{
+    char *result = 0;
+    FILE *file = fopen(filename, "rb");
+    if(file)
+    {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        result = (char *)heap_alloc(size + 1);
+        size_t read = fread(result, 1, size, file);
+        result[read] = 0;
+        fclose(file);
+    }
+    return(result);
+}
+
+// NOTE: not a json parser, just enough to read back what write_bench_json
+// wrote: find the scene object by name, then the key inside it
+internal bool find_scene_number(char *json, char *scene_name, char *key, f64 *value)
+{
+    char pattern[256];
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", scene_name);
+    char *scene = strstr(json, pattern);
+    if(!scene)
+    {
+        return(false);
+    }
+    char *scene_end = strchr(scene, '}');
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    char *found = strstr(scene, pattern);
+    if(!found || (scene_end && found > scene_end))
+    {
+        return(false);
+    }
+    *value = strtod(found + strlen(pattern), 0);
+    return(true);
+}
+
+// NOTE: true if the baseline was recorded with the same settings as this
+// run, otherwise reports the first that differs
+internal bool bench_settings_match(char *baseline, BenchSettings *settings, u32 thread_count)
+{
+    BenchSettingValue values[BENCH_SETTING_COUNT];
+    bench_setting_values(settings, thread_count, values);
+    char *scenes = strstr(baseline, "\"scenes\":");
+    for(u32 setting = 0; setting < BENCH_SETTING_COUNT; ++setting)
+    {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "\"%s\": ", values[setting].key);
+        char *found = strstr(baseline, pattern);
+        char recorded[32] = "nothing";
+        if(found && (!scenes || found < scenes))
+        {
+            found += strlen(pattern);
+            u32 length = (u32)strcspn(found, ",\n");
+            if(length < sizeof(recorded))
+            {
+                memcpy(recorded, found, length);
+                recorded[length] = 0;
+            }
+        }
+        if(strcmp(recorded, values[setting].value) != 0)
+        {
+            fprintf(stderr, "[Error] %s was recorded with %s %s, this run has %s, not comparing "
+                    "(rerun with those settings or write a new baseline with --bench-update-baseline)\n",
+                    settings->baseline_filename, values[setting].key, recorded, values[setting].value);
+            return(false);
+        }
+    }
+    return(true);
+}
+
+internal int run_benchmark(ThreadPool *pool, BenchSettings *settings)
+{
+    profile_phases = true;
+    if(settings->iterations == 0)
+    {
+        settings->iterations = 1;
+    }
+
+    u32 result_count = sizeof(bench_scenes) / sizeof(bench_scenes[0]);
+    BenchResult results[sizeof(bench_scenes) / sizeof(bench_scenes[0])];
+
+    printf("Benchmark: %ux%u, %u thread(s), %u iteration(s), %s mode\n",
+           settings->width, settings->height, pool->thread_count, settings->iterations,
+           (settings->mode == RenderMode_Packet) ? "packet" : "pixel");
+
+    CacheCounters counters;
+    bool counting = false;
+    if(pool->thread_count > 1)
+    {
+        printf("Cache misses: not counted, the counters only see the calling thread (use --threads 1)\n");
+    }
+    else if(!open_cache_counters(&counters))
+    {
+        printf("Cache misses: not counted, no hardware counters (perf_event_open: %s)\n", strerror(counters.error));
+    }
+    else
+    {
+        counting = true;
+    }
+    printf("%-12s %9s %9s %12s %12s %9s %9s %9s %9s\n",
+           "scene", "best s", "median s", "primary/s", "shadow/s", "raygen s", "isect s", "shade s", "output s");
+    for(u32 index = 0;
+        index < result_count;
+        ++index)
+    {
+        BenchResult *r = results + index;
+        *r = bench_scene(pool, settings, bench_scenes + index, counting ? &counters : 0);
+        printf("%-12s %9.3f %9.3f %11.2fM %11.2fM %9.3f %9.3f %9.3f %9.3f\n",
+               r->name, r->best_seconds, r->median_seconds,
+               r->primary_rays_per_sec * 1e-6, r->shadow_rays_per_sec * 1e-6,
+               r->phase_seconds[Phase_RayGen], r->phase_seconds[Phase_Intersect],
+               r->phase_seconds[Phase_Shade], r->output_seconds);
+    }
+    if(counting)
+    {
+        close_cache_counters(&counters);
+        printf("%-12s %14s %14s\n", "scene", "L1D miss/ray", "LLC miss/ray");
+        for(u32 index = 0;
+            index < result_count;
+            ++index)
+        {
+            BenchResult *r = results + index;
+            printf("%-12s %14.3f %14.3f\n", r->name,
+                   r->misses_per_primary[CacheCounter_L1DMiss], r->misses_per_primary[CacheCounter_LLCMiss]);
+        }
+    }
+
+    write_bench_json(settings->json_filename, settings, pool->thread_count, results, result_count);
+    printf("Results written to %s\n", settings->json_filename);
+
+    int exit_code = 0;
+    for(u32 index = 0;
+        index < result_count;
+        ++index)
+    {
+        BenchResult *r = results + index;
+        if(r->allocations)
+        {
+            fprintf(stderr, "[Error] %s allocated %llu times while tracing\n", r->name, (unsigned long long)r->allocations);
+            exit_code = 1;
+        }
+        if(r->differing_tile_size)
+        {
+            fprintf(stderr, "[Error] %s renders differently with --tile %u than with --tile %u\n",
+                    r->name, r->differing_tile_size, settings->tile_size);
+            exit_code = 1;
+        }
+    }
+
+    if(settings->update_baseline)
+    {
+        write_bench_json(settings->baseline_filename, settings, pool->thread_count, results, result_count);
+        printf("Baseline %s updated\n", settings->baseline_filename);
+    }
+    else
+    {
+        char *baseline = read_entire_file(settings->baseline_filename);
+        if(!baseline)
+        {
+            if(settings->require_baseline)
+            {
+                fprintf(stderr, "[Error] No baseline at %s (--bench-update-baseline writes one)\n",
+                        settings->baseline_filename);
+                exit_code = 1;
+            }
+            else
+            {
+                printf("No baseline at %s, nothing to compare (--bench-update-baseline writes one)\n",
+                       settings->baseline_filename);
+            }
+        }
+        else if(!bench_settings_match(baseline, settings, pool->thread_count))
+        {
+            exit_code = 1;
+            heap_free(baseline);
+        }
+        else
+        {
+            for(u32 index = 0;
+                index < result_count;
+                ++index)
+            {
+                BenchResult *r = results + index;
+                f64 expected;
+                if(!find_scene_number(baseline, r->name, "primary_rays_per_sec", &expected))
+                {
+                    printf("%-12s not in baseline\n", r->name);
+                    continue;
+                }
+                f64 change = (r->primary_rays_per_sec - expected) / expected;
+                bool regressed = change < -settings->tolerance;
+                printf("%-12s %+6.1f%% vs baseline%s\n", r->name, change * 100.0,
+                       regressed ? "   <-- REGRESSION" : "");
+                for(u32 counter = 0; r->counted && counter < CacheCounter_Count; ++counter)
+                {
+                    f64 expected_misses;
+                    if(find_scene_number(baseline, r->name, cache_counter_names[counter], &expected_misses))
+                    {
+                        printf("%-12s %s %.3f, baseline %.3f\n", "", cache_counter_names[counter],
+                               r->misses_per_primary[counter], expected_misses);
+                    }
+                }
+                if(regressed)
+                {
+                    fprintf(stderr, "[Error] %s regressed: %.2fM primary rays/s, baseline %.2fM, tolerance %.0f%%\n",
+                            r->name, r->primary_rays_per_sec * 1e-6, expected * 1e-6, settings->tolerance * 100.0);
+                    exit_code = 2;
+                }
+            }
+            heap_free(baseline);
+        }
+    }
+
+    profile_phases = false;
+    return(exit_code);
+}
+
+// NOTE: --bench-startup. Time from nothing to a World that is ready to
+// render: text scene (parse + bvh + soa) against the same scene converted
+// to a scene cache (mmap). The cache is also timed with every page touched
+// once, since the mapping alone defers all reading to the first frame.
+internal int run_startup_benchmark(char *scene_filename, SphereKernelType kernel, u32 iterations)
+{
+    if(!scene_filename || is_scene_cache(scene_filename))
+    {
+        fprintf(stderr, "[Error] --bench-startup needs a text scene, pass one with --scene\n");
+        return(1);
+    }
+    if(iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    char *cache_filename = "bench_startup.cache";
+    f64 text_best = F32MAX, convert_seconds = 0.0;
+    f64 map_best = F32MAX, touched_best = F32MAX;
+    u32 sphere_count = 0;
+
+    for(u32 iteration = 0;
+        iteration < iterations;
+        ++iteration)
+    {
+        World world = {};
+        SceneView view;
+        f64 start = get_wall_clock();
+        if(!setup_world(&world, &view, scene_filename, 0, 0, 0, true, kernel, false))
+        {
+            return(1);
+        }
+        f64 seconds = get_wall_clock() - start;
+        text_best = (seconds < text_best) ? seconds : text_best;
+        sphere_count = world.sphere_count;
+
+        if(iteration == 0)
+        {
+            start = get_wall_clock();
+            if(!write_scene_cache(cache_filename, &world, &view, sphere_kernel_width(kernel)))
+            {
+                return(1);
+            }
+            convert_seconds = get_wall_clock() - start;
+        }
+        free_world(&world);
+    }
+
+    for(u32 iteration = 0;
+        iteration < iterations;
+        ++iteration)
+    {
+        World world = {};
+        SceneView view;
+        f64 start = get_wall_clock();
+        if(!setup_world(&world, &view, cache_filename, 0, 0, 0, true, kernel, false))
+        {
+            return(1);
+        }
+        f64 seconds = get_wall_clock() - start;
+        map_best = (seconds < map_best) ? seconds : map_best;
+
+        volatile u8 *memory = (volatile u8 *)world.mapped_memory;
+        for(u64 at = 0; at < world.mapped_size; at += 4096)
+        {
+            (void)memory[at];
+        }
+        seconds = get_wall_clock() - start;
+        touched_best = (seconds < touched_best) ? seconds : touched_best;
+        free_world(&world);
+    }
+    remove(cache_filename);
+
+    printf("Startup: %s, %u spheres, best of %u\n", scene_filename, sphere_count, iterations);
+    printf("  text (parse + bvh + soa)  %9.4fs\n", text_best);
+    printf("  convert to cache          %9.4fs (once)\n", convert_seconds);
+    printf("  cache, mapped             %9.4fs  %8.0fx\n", map_best, text_best / map_best);
+    printf("  cache, every page touched %9.4fs  %8.0fx\n", touched_best, text_best / touched_best);
+    return(0);
+}
+
+#endif
@@ -0,0 +1,607 @@
+#ifndef _H_DOLUSBVH
+#define _H_DOLUSBVH
+
+// NOTE: Bounding volume hierarchy over the spheres of a World.
+// Built once with binned SAH, then flattened depth first into a node array.
+// The builder works on plain boxes, meshes use it for their blas and the
+// instance tlas too (see dolus_mesh.h).
+
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+// NOTE: the builder makes a leaf of whatever is left at this depth (root at
+// 0), however many that is. Traversals that push the far child of every node
+// they enter hold at most depth entries, the ones that push both children
+// (packets, the light cursor) depth + 1, so every BVH_STACK_SIZE stack fits
+// whatever a scene file throws at the binned SAH.
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+
+extern inline AABB aabb_empty()
+{
+    AABB result = {};
+    result.min = V3(F32MAX, F32MAX, F32MAX);
+    result.max = V3(F32MIN, F32MIN, F32MIN);
+    return(result);
+}
+
+// NOTE: compare and select, one minss/maxss. fminf/fmaxf stay libm calls
+// without -ffast-math because of their NaN rules, and both the builder and
+// the slab test below spent most of their time in those calls.
+extern inline f32 f32_min(f32 A, f32 B)
+{
+    f32 result = (A < B) ? A : B;
+    return(result);
+}
+
+extern inline f32 f32_max(f32 A, f32 B)
+{
+    f32 result = (A > B) ? A : B;
+    return(result);
+}
+
+extern inline v3 v3_min(v3 A, v3 B)
+{
+    v3 result = V3(f32_min(A.x, B.x), f32_min(A.y, B.y), f32_min(A.z, B.z));
+    return(result);
+}
+
+extern inline v3 v3_max(v3 A, v3 B)
+{
+    v3 result = V3(f32_max(A.x, B.x), f32_max(A.y, B.y), f32_max(A.z, B.z));
+    return(result);
+}
+
+extern inline f32 v3_axis(v3 A, u32 axis)
+{
+    f32 result = (axis == 0) ? A.x : ((axis == 1) ? A.y : A.z);
+    return(result);
+}
+
+extern inline AABB aabb_union(AABB A, AABB B)
+{
+    AABB result = {};
+    result.min = v3_min(A.min, B.min);
+    result.max = v3_max(A.max, B.max);
+    return(result);
+}
+
+extern inline AABB aabb_grow(AABB A, v3 P)
+{
+    AABB result = {};
+    result.min = v3_min(A.min, P);
+    result.max = v3_max(A.max, P);
+    return(result);
+}
+
+extern inline f32 aabb_half_area(AABB A)
+{
+    v3 e = v3_sub(A.max, A.min);
+    f32 result = 0.0f;
+    if(e.x >= 0.0f && e.y >= 0.0f && e.z >= 0.0f)
+    {
+        result = e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+    return(result);
+}
+
+// NOTE: the unit sphere pushed through an affine transform is an ellipsoid,
+// its half extent along world axis i is the length of row i of the 3x3 part
+extern inline AABB sphere_bounds(Sphere *s)
+{
+    m4x4 m = s->transform;
+    v4 center = m4x4_mul_v4(m, s->center);
+    v3 extent = V3(square_root(square(m.rows[0].x) + square(m.rows[0].y) + square(m.rows[0].z)),
+                   square_root(square(m.rows[1].x) + square(m.rows[1].y) + square(m.rows[1].z)),
+                   square_root(square(m.rows[2].x) + square(m.rows[2].y) + square(m.rows[2].z)));
+
+    AABB result = {};
+    result.min = v3_sub(v4_v3(center), extent);
+    result.max = v3_add(v4_v3(center), extent);
+    return(result);
+}
+
+typedef struct
+{
+    AABB *bounds;
+    v3 *centroids;
+    u32 *indices;
+
+    BVHNode *nodes;
+    u32 node_count;
+
+    // NOTE: spheres the leaf kernel tests per step, a leaf costs one step
+    // per group of this many
+    u32 leaf_width;
+} BVHBuilder;
+
+typedef struct
+{
+    AABB bounds;
+    u32 count;
+} BVHBin;
+
+internal u32 bvh_build_node(BVHBuilder *builder, u32 first, u32 count, u32 depth)
+{
+    u32 node_index = builder->node_count++;
+
+    AABB bounds = aabb_empty();
+    AABB centroid_bounds = aabb_empty();
+    for(u32 i = first;
+        i < first + count;
+        ++i)
+    {
+        u32 prim = builder->indices[i];
+        bounds = aabb_union(bounds, builder->bounds[prim]);
+        centroid_bounds = aabb_grow(centroid_bounds, builder->centroids[prim]);
+    }
+
+    // NOTE: find the cheapest binned split over all three axes
+    f32 best_cost = F32MAX;
+    u32 best_axis = 0;
+    u32 best_bin = 0;
+    f32 leaf_cost = (f32)((count + builder->leaf_width - 1) / builder->leaf_width);
+    f32 parent_area = aabb_half_area(bounds);
+
+    if(count > 1 && parent_area > 0.0f && depth < BVH_MAX_DEPTH)
+    {
+        for(u32 axis = 0;
+            axis < 3;
+            ++axis)
+        {
+            f32 axis_min = v3_axis(centroid_bounds.min, axis);
+            f32 axis_max = v3_axis(centroid_bounds.max, axis);
+            if(axis_max <= axis_min)
+            {
+                continue;
+            }
+            f32 scale = BVH_BIN_COUNT / (axis_max - axis_min);
+
+            BVHBin bins[BVH_BIN_COUNT];
+            for(u32 bin = 0; bin < BVH_BIN_COUNT; ++bin)
+            {
+                bins[bin].bounds = aabb_empty();
+                bins[bin].count = 0;
+            }
+            for(u32 i = first;
+                i < first + count;
+                ++i)
+            {
+                u32 prim = builder->indices[i];
+                u32 bin = (u32)((v3_axis(builder->centroids[prim], axis) - axis_min) * scale);
+                if(bin >= BVH_BIN_COUNT)
+                {
+                    bin = BVH_BIN_COUNT - 1;
+                }
+                bins[bin].bounds = aabb_union(bins[bin].bounds, builder->bounds[prim]);
+                ++bins[bin].count;
+            }
+
+            // NOTE: sweep from the right to get the area/count of every right side
+            f32 right_area[BVH_BIN_COUNT];
+            u32 right_count[BVH_BIN_COUNT];
+            AABB right = aabb_empty();
+            u32 right_sum = 0;
+            for(u32 bin = BVH_BIN_COUNT - 1; bin > 0; --bin)
+            {
+                right = aabb_union(right, bins[bin].bounds);
+                right_sum += bins[bin].count;
+                right_area[bin] = aabb_half_area(right);
+                right_count[bin] = right_sum;
+            }
+
+            AABB left = aabb_empty();
+            u32 left_sum = 0;
+            for(u32 bin = 0; bin < BVH_BIN_COUNT - 1; ++bin)
+            {
+                left = aabb_union(left, bins[bin].bounds);
+                left_sum += bins[bin].count;
+                if(left_sum == 0 || right_count[bin + 1] == 0)
+                {
+                    continue;
+                }
+                f32 cost = 1.0f + (aabb_half_area(left) * left_sum + right_area[bin + 1] * right_count[bin + 1]) / parent_area;
+                if(cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = bin;
+                }
+            }
+        }
+    }
+
+    BVHNode *node = builder->nodes + node_index;
+    node->min = bounds.min;
+    node->max = bounds.max;
+
+    bool make_leaf = (best_cost == F32MAX) || (best_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE);
+    if(make_leaf)
+    {
+        node->left_first = first;
+        node->count = count;
+    }
+    else
+    {
+        f32 axis_min = v3_axis(centroid_bounds.min, best_axis);
+        f32 scale = BVH_BIN_COUNT / (v3_axis(centroid_bounds.max, best_axis) - axis_min);
+
+        // NOTE: in place partition of indices around the chosen bin
+        u32 i = first;
+        u32 j = first + count;
+        while(i < j)
+        {
+            u32 prim = builder->indices[i];
+            u32 bin = (u32)((v3_axis(builder->centroids[prim], best_axis) - axis_min) * scale);
+            if(bin >= BVH_BIN_COUNT)
+            {
+                bin = BVH_BIN_COUNT - 1;
+            }
+            if(bin <= best_bin)
+            {
+                ++i;
+            }
+            else
+            {
+                --j;
+                builder->indices[i] = builder->indices[j];
+                builder->indices[j] = prim;
+            }
+        }
+        u32 left_count = i - first;
+
+        bvh_build_node(builder, first, left_count, depth + 1);
+        u32 right_index = bvh_build_node(builder, i, count - left_count, depth + 1);
+
+        node = builder->nodes + node_index;
+        node->left_first = right_index;
+        node->count = 0;
+    }
+
+    return(node_index);
+}
+
+// NOTE: binned SAH over any count boxes (count > 0). The bvh gets the
+// nodes and indices, which maps leaf entries back to box indices. All of it
+// is pushed onto scratch_arena, nodes with room for the worst case, so call
+// it inside a temporary memory and copy_bvh what is worth keeping.
+internal void build_bvh(BVH *bvh, AABB *bounds, u32 count, u32 leaf_width)
+{
+    BVHBuilder builder = {};
+    builder.leaf_width = (leaf_width > 0) ? leaf_width : 1;
+    builder.bounds = bounds;
+    builder.indices = PUSH_ARRAY(&scratch_arena, count, u32);
+    // NOTE: a binary tree with count leaves at most has 2*count - 1 nodes
+    builder.nodes = PUSH_ARRAY(&scratch_arena, 2 * count - 1, BVHNode);
+    builder.centroids = PUSH_ARRAY(&scratch_arena, count, v3);
+
+    for(u32 index = 0;
+        index < count;
+        ++index)
+    {
+        builder.centroids[index] = v3_scalar_mul(v3_add(bounds[index].min, bounds[index].max), 0.5f);
+        builder.indices[index] = index;
+    }
+
+    bvh_build_node(&builder, 0, count, 0);
+
+    bvh->node_count = builder.node_count;
+    bvh->nodes = builder.nodes;
+    bvh->index_count = count;
+    bvh->indices = builder.indices;
+}
+
+internal BVH copy_bvh(MemoryArena *arena, BVH *bvh)
+{
+    BVH result = *bvh;
+    result.nodes = (BVHNode *)push_copy(arena, bvh->nodes, bvh->node_count * sizeof(BVHNode));
+    result.indices = (u32 *)push_copy(arena, bvh->indices, bvh->index_count * sizeof(u32));
+    return(result);
+}
+
+// NOTE: on scratch_arena, for build_bvh
+internal AABB *push_sphere_bounds(World *world)
+{
+    AABB *result = PUSH_ARRAY(&scratch_arena, world->sphere_count, AABB);
+    for(u32 sphere_index = 0;
+        sphere_index < world->sphere_count;
+        ++sphere_index)
+    {
+        result[sphere_index] = sphere_bounds(world->spheres + sphere_index);
+    }
+    return(result);
+}
+
+internal void build_world_bvh(World *world, u32 leaf_width)
+{
+    world->bvh = (BVH){0};
+    u32 count = world->sphere_count;
+    if(count == 0)
+    {
+        return;
+    }
+
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    BVH bvh;
+    build_bvh(&bvh, push_sphere_bounds(world), count, leaf_width);
+    world->bvh = copy_bvh(&world->arena, &bvh);
+    end_temporary_memory(temp);
+}
+
+// NOTE: Animation. Between frames the world bvh is refit: the tree and the
+// leaf order stay, only the boxes move to follow the spheres. That is a
+// fraction of a build, but boxes of spheres that drift apart keep growing
+// and overlapping, so bvh_sah_cost tells the caller when a rebuild pays.
+
+// NOTE: the builder's cost model over the finished tree, one step per
+// interior node and ceil(count / leaf_width) per leaf, each weighted by its
+// area over the root's. Fresh trees and refit trees compare directly.
+internal f32 bvh_sah_cost(BVH *bvh, u32 leaf_width)
+{
+    f64 result = 0.0;
+    if(bvh->node_count > 0)
+    {
+        leaf_width = (leaf_width > 0) ? leaf_width : 1;
+        f32 root_area = aabb_half_area((AABB){bvh->nodes[0].min, bvh->nodes[0].max});
+        if(root_area > 0.0f)
+        {
+            for(u32 node_index = 0;
+                node_index < bvh->node_count;
+                ++node_index)
+            {
+                BVHNode *node = bvh->nodes + node_index;
+                f32 steps = (node->count > 0) ? (f32)((node->count + leaf_width - 1) / leaf_width) : 1.0f;
+                result += steps * aabb_half_area((AABB){node->min, node->max});
+            }
+            result /= root_area;
+        }
+    }
+    return((f32)result);
+}
+
+// NOTE: nodes are in depth first order, both children of a node come after
+// it, so walking the array backwards sees them before their parent
+internal void refit_world_bvh(World *world)
+{
+    BVH *bvh = &world->bvh;
+    for(u32 node_index = bvh->node_count;
+        node_index-- > 0;
+        )
+    {
+        BVHNode *node = bvh->nodes + node_index;
+        AABB bounds = aabb_empty();
+        if(node->count > 0)
+        {
+            for(u32 i = node->left_first;
+                i < node->left_first + node->count;
+                ++i)
+            {
+                bounds = aabb_union(bounds, sphere_bounds(world->spheres + bvh->indices[i]));
+            }
+        }
+        else
+        {
+            BVHNode *left = node + 1;
+            BVHNode *right = bvh->nodes + node->left_first;
+            bounds = aabb_union((AABB){left->min, left->max}, (AABB){right->min, right->max});
+        }
+        node->min = bounds.min;
+        node->max = bounds.max;
+    }
+}
+
+// NOTE: gives the world bvh nodes room for the biggest tree its spheres can
+// make, so rebuild_world_bvh can always write over them in place and a
+// sequence that rebuilds every few frames does not grow the world arena
+internal void reserve_world_bvh(World *world)
+{
+    BVH *bvh = &world->bvh;
+    if(bvh->node_count > 0)
+    {
+        BVHNode *nodes = PUSH_ARRAY(&world->arena, 2 * world->sphere_count - 1, BVHNode);
+        memcpy(nodes, bvh->nodes, bvh->node_count * sizeof(BVHNode));
+        bvh->nodes = nodes;
+    }
+}
+
+// NOTE: build_world_bvh again, over the nodes and indices the world has
+// (call reserve_world_bvh once first). The leaf order changes, so the soa
+// needs fill_world_soa after this.
+internal void rebuild_world_bvh(World *world, u32 leaf_width)
+{
+    u32 count = world->sphere_count;
+    if(world->bvh.node_count == 0)
+    {
+        return;
+    }
+
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    BVH bvh;
+    build_bvh(&bvh, push_sphere_bounds(world), count, leaf_width);
+    memcpy(world->bvh.nodes, bvh.nodes, bvh.node_count * sizeof(BVHNode));
+    memcpy(world->bvh.indices, bvh.indices, count * sizeof(u32));
+    world->bvh.node_count = bvh.node_count;
+    end_temporary_memory(temp);
+}
+
+// NOTE: slab test, returns the entry distance or F32MAX on a miss. The only
+// NaN is 0 * inf, from a ray parallel to a slab and exactly in one of its
+// planes. fminf/fmaxf made that a miss, compare and select either misses or
+// ignores the slab; the ray can only graze the face either way.
+extern inline f32 ray_intersect_node(BVHNode *node, v3 origin, v3 inv_direction, f32 t_max)
+{
+    f32 tx1 = (node->min.x - origin.x) * inv_direction.x;
+    f32 tx2 = (node->max.x - origin.x) * inv_direction.x;
+    f32 t_near = f32_min(tx1, tx2);
+    f32 t_far = f32_max(tx1, tx2);
+
+    f32 ty1 = (node->min.y - origin.y) * inv_direction.y;
+    f32 ty2 = (node->max.y - origin.y) * inv_direction.y;
+    t_near = f32_max(t_near, f32_min(ty1, ty2));
+    t_far = f32_min(t_far, f32_max(ty1, ty2));
+
+    f32 tz1 = (node->min.z - origin.z) * inv_direction.z;
+    f32 tz2 = (node->max.z - origin.z) * inv_direction.z;
+    t_near = f32_max(t_near, f32_min(tz1, tz2));
+    t_far = f32_min(t_far, f32_max(tz1, tz2));
+
+    f32 result = F32MAX;
+    if(t_far >= t_near && t_far > 0.0f && t_near < t_max)
+    {
+        result = t_near;
+    }
+    return(result);
+}
+
+extern inline v3 ray_inv_direction(Ray *ray)
+{
+    v3 result = V3(1.0f / ray->direction.x, 1.0f / ray->direction.y, 1.0f / ray->direction.z);
+    return(result);
+}
+
+// NOTE: any hit query for shadow rays, bails on the first occluder and never
+// descends into nodes that start past max_t
+internal bool bvh_occluded(World *world, Ray *ray, f32 max_t)
+{
+    BVH *bvh = &world->bvh;
+    v3 origin = v4_v3(ray->origin);
+    v3 inv_direction = ray_inv_direction(ray);
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    BVHNode *node = bvh->nodes;
+    if(ray_intersect_node(node, origin, inv_direction, max_t) == F32MAX)
+    {
+        return(false);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            X occluder;
+            if(sphere_span(world, node->left_first, node->count, ray, EPSILON, max_t, &occluder))
+            {
+                return(true);
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - bvh->nodes) + 1;
+            u32 right_index = node->left_first;
+            bool hit_left = ray_intersect_node(bvh->nodes + left_index, origin, inv_direction, max_t) != F32MAX;
+            bool hit_right = ray_intersect_node(bvh->nodes + right_index, origin, inv_direction, max_t) != F32MAX;
+
+            // NOTE: order does not matter for any hit, skip the sort
+            if(hit_left)
+            {
+                if(hit_right)
+                {
+                    stack[stack_count++] = right_index;
+                }
+                node = bvh->nodes + left_index;
+                continue;
+            }
+            else if(hit_right)
+            {
+                node = bvh->nodes + right_index;
+                continue;
+            }
+        }
+
+        if(stack_count == 0)
+        {
+            break;
+        }
+        node = bvh->nodes + stack[--stack_count];
+    }
+    return(false);
+}
+
+// NOTE: closest hit query, visits the nearer child first and keeps
+// shrinking t_max so everything behind the current best hit is culled
+internal bool bvh_closest_hit(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    BVH *bvh = &world->bvh;
+    v3 origin = v4_v3(ray->origin);
+    v3 inv_direction = ray_inv_direction(ray);
+
+    u32 stack[BVH_STACK_SIZE];
+    f32 stack_t[BVH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    bool result = false;
+    BVHNode *node = bvh->nodes;
+    if(ray_intersect_node(node, origin, inv_direction, t_max) == F32MAX)
+    {
+        return(result);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            // NOTE: soa slots follow bvh->indices, a leaf is one span
+            if(sphere_span(world, node->left_first, node->count, ray, t_min, t_max, hit))
+            {
+                t_max = hit->t;
+                result = true;
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - bvh->nodes) + 1;
+            u32 right_index = node->left_first;
+            f32 t_left = ray_intersect_node(bvh->nodes + left_index, origin, inv_direction, t_max);
+            f32 t_right = ray_intersect_node(bvh->nodes + right_index, origin, inv_direction, t_max);
+
+            if(t_left != F32MAX && t_right != F32MAX)
+            {
+                if(t_right < t_left)
+                {
+                    u32 swap_index = left_index;
+                    left_index = right_index;
+                    right_index = swap_index;
+
+                    f32 swap_t = t_left;
+                    t_left = t_right;
+                    t_right = swap_t;
+                }
+                stack[stack_count] = right_index;
+                stack_t[stack_count] = t_right;
+                ++stack_count;
+                node = bvh->nodes + left_index;
+                continue;
+            }
+            else if(t_left != F32MAX)
+            {
+                node = bvh->nodes + left_index;
+                continue;
+            }
+            else if(t_right != F32MAX)
+            {
+                node = bvh->nodes + right_index;
+                continue;
+            }
+        }
+
+        // NOTE: pop, skipping anything that starts behind the best hit so far
+        node = 0;
+        while(stack_count > 0)
+        {
+            --stack_count;
+            if(stack_t[stack_count] < t_max)
+            {
+                node = bvh->nodes + stack[stack_count];
+                break;
+            }
+        }
+        if(!node)
+        {
+            break;
+        }
+    }
+    return(result);
+}
+
+#endif
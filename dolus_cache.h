@@ -0,0 +1,459 @@
+#ifndef _H_DOLUSCACHE
+#define _H_DOLUSCACHE
+
+// NOTE: Binary scene cache. A World after setup (every shape array with the
+// cached inverses, the material table, meshes with their blas, instances
+// and the tlas, lights, bvh, soa streams) written out as-is, so loading is one
+// mmap plus pointer fixups and no parsing, building or copying.
+//
+// Layout: SceneCacheHeader, then every array at a 64 byte aligned offset.
+// The file is native endian and native struct layout; the header records
+// the sizes of everything it stores and a cache written by a build where
+// any of them differ is refused instead of being misread. So is one with an
+// index pointing outside its array, see cache_world_valid. Bump
+// SCENE_CACHE_VERSION whenever the meaning of the data changes.
+
+#define SCENE_CACHE_MAGIC 0x4e494253554c4f44ull // "DOLUSBIN"
+#define SCENE_CACHE_VERSION 8
+#define SCENE_CACHE_ALIGNMENT 64
+
+typedef struct
+{
+    u64 offset;
+    u64 size;
+} CacheSection;
+
+typedef struct
+{
+    u64 magic;
+    u32 version;
+    u32 header_size;
+    u32 sphere_size;
+    u32 light_size;
+    u32 node_size;
+    u32 view_size;
+    u32 plane_size;
+    u32 cube_size;
+    u32 cylinder_size;
+    u32 triangle_size;
+    u32 mesh_size;
+    u32 instance_size;
+    u32 material_size;
+
+    u32 sphere_count;
+    u32 plane_count;
+    u32 cube_count;
+    u32 cylinder_count;
+    u32 triangle_count;
+    u32 mesh_count;
+    u32 mesh_vertex_count;
+    u32 mesh_triangle_count;
+    u32 mesh_node_count;
+    u32 instance_count;
+    u32 tlas_node_count;
+    u32 material_count;
+    u32 light_count;
+    u32 node_count;
+    // NOTE: leaf width the bvh was built for, see build_world_bvh
+    u32 leaf_width;
+    u32 soa_stride;
+    u32 pad;
+
+    SceneView view;
+
+    CacheSection spheres;
+    CacheSection planes;
+    CacheSection cubes;
+    CacheSection cylinders;
+    CacheSection triangles;
+    CacheSection meshes;
+    CacheSection mesh_vertices;
+    CacheSection mesh_indices;
+    CacheSection mesh_nodes;
+    CacheSection instances;
+    CacheSection tlas_nodes;
+    CacheSection tlas_indices;
+    CacheSection materials;
+    CacheSection lights;
+    CacheSection nodes;
+    CacheSection indices;
+    CacheSection soa;
+    CacheSection soa_object_index;
+} SceneCacheHeader;
+
+internal bool is_scene_cache(char *filename)
+{
+    bool result = false;
+    FILE *file = fopen(filename, "rb");
+    if(file)
+    {
+        u64 magic = 0;
+        result = (fread(&magic, sizeof(magic), 1, file) == 1) && (magic == SCENE_CACHE_MAGIC);
+        fclose(file);
+    }
+    return(result);
+}
+
+internal CacheSection write_cache_section(FILE *file, u64 *at, void *data, u64 size)
+{
+    static u8 zeros[SCENE_CACHE_ALIGNMENT];
+    u64 padding = (SCENE_CACHE_ALIGNMENT - (*at % SCENE_CACHE_ALIGNMENT)) % SCENE_CACHE_ALIGNMENT;
+    fwrite(zeros, 1, padding, file);
+    *at += padding;
+
+    CacheSection result = {};
+    result.offset = *at;
+    result.size = size;
+    if(size > 0)
+    {
+        fwrite(data, 1, size, file);
+    }
+    *at += size;
+    return(result);
+}
+
+// NOTE: world has to be fully set up, bvh and soa included
+internal bool write_scene_cache(char *filename, World *world, SceneView *view, u32 leaf_width)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+        return(false);
+    }
+
+    SceneCacheHeader header = {};
+    header.magic = SCENE_CACHE_MAGIC;
+    header.version = SCENE_CACHE_VERSION;
+    header.header_size = sizeof(SceneCacheHeader);
+    header.sphere_size = sizeof(Sphere);
+    header.light_size = sizeof(Light);
+    header.node_size = sizeof(BVHNode);
+    header.view_size = sizeof(SceneView);
+    header.plane_size = sizeof(Plane);
+    header.cube_size = sizeof(Cube);
+    header.cylinder_size = sizeof(Cylinder);
+    header.triangle_size = sizeof(Triangle);
+    header.mesh_size = sizeof(Mesh);
+    header.instance_size = sizeof(MeshInstance);
+    header.material_size = sizeof(Material);
+    header.sphere_count = world->sphere_count;
+    header.plane_count = world->plane_count;
+    header.cube_count = world->cube_count;
+    header.cylinder_count = world->cylinder_count;
+    header.triangle_count = world->triangle_count;
+    header.mesh_count = world->mesh_count;
+    header.mesh_vertex_count = world->mesh_vertex_count;
+    header.mesh_triangle_count = world->mesh_triangle_count;
+    header.mesh_node_count = world->mesh_node_count;
+    header.instance_count = world->instance_count;
+    header.tlas_node_count = world->tlas.node_count;
+    header.material_count = world->material_count;
+    header.light_count = world->light_count;
+    header.node_count = world->bvh.node_count;
+    header.leaf_width = leaf_width;
+    header.soa_stride = soa_stride(world->soa.count);
+    header.view = *view;
+
+    // NOTE: header goes last, once the offsets are known
+    fwrite(&header, sizeof(header), 1, file);
+    u64 at = sizeof(header);
+
+    SphereSoA *soa = &world->soa;
+    u64 stream_size = (u64)header.soa_stride * sizeof(f32);
+    header.spheres = write_cache_section(file, &at, world->spheres, (u64)world->sphere_count * sizeof(Sphere));
+    header.planes = write_cache_section(file, &at, world->planes, (u64)world->plane_count * sizeof(Plane));
+    header.cubes = write_cache_section(file, &at, world->cubes, (u64)world->cube_count * sizeof(Cube));
+    header.cylinders = write_cache_section(file, &at, world->cylinders, (u64)world->cylinder_count * sizeof(Cylinder));
+    header.triangles = write_cache_section(file, &at, world->triangles, (u64)world->triangle_count * sizeof(Triangle));
+    header.meshes = write_cache_section(file, &at, world->meshes, (u64)world->mesh_count * sizeof(Mesh));
+    header.mesh_vertices = write_cache_section(file, &at, world->mesh_vertices, (u64)world->mesh_vertex_count * sizeof(v3));
+    header.mesh_indices = write_cache_section(file, &at, world->mesh_indices, (u64)world->mesh_triangle_count * 3 * sizeof(u32));
+    header.mesh_nodes = write_cache_section(file, &at, world->mesh_nodes, (u64)world->mesh_node_count * sizeof(BVHNode));
+    header.instances = write_cache_section(file, &at, world->instances, (u64)world->instance_count * sizeof(MeshInstance));
+    header.tlas_nodes = write_cache_section(file, &at, world->tlas.nodes, (u64)world->tlas.node_count * sizeof(BVHNode));
+    header.tlas_indices = write_cache_section(file, &at, world->tlas.indices, (u64)world->tlas.index_count * sizeof(u32));
+    header.materials = write_cache_section(file, &at, world->materials, (u64)world->material_count * sizeof(Material));
+    header.lights = write_cache_section(file, &at, world->lights, (u64)world->light_count * sizeof(Light));
+    header.nodes = write_cache_section(file, &at, world->bvh.nodes, (u64)world->bvh.node_count * sizeof(BVHNode));
+    header.indices = write_cache_section(file, &at, world->bvh.indices, (u64)world->bvh.index_count * sizeof(u32));
+    header.soa = write_cache_section(file, &at, soa->memory, soa->memory ? 20 * stream_size : 0);
+    header.soa_object_index = write_cache_section(file, &at, soa->object_index,
+                                                  soa->object_index ? (u64)header.soa_stride * sizeof(u32) : 0);
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    bool result = (ferror(file) == 0);
+    fclose(file);
+    if(!result)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+    }
+    return(result);
+}
+
+internal bool cache_section_valid(CacheSection section, u64 file_size, u64 expected_size)
+{
+    bool result = (section.size == expected_size) &&
+                  (section.offset % SCENE_CACHE_ALIGNMENT == 0) &&
+                  (section.offset <= file_size) &&
+                  (section.size <= file_size - section.offset);
+    return(result);
+}
+
+// NOTE: what every traversal and its stack relies on: both children after
+// their parent and inside the array, leaves inside index_count and no path
+// deeper than BVH_MAX_DEPTH
+internal bool cache_bvh_valid(BVHNode *nodes, u32 node_count, u32 index_count)
+{
+    bool result = true;
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    u8 *depth = PUSH_ARRAY(&scratch_arena, node_count, u8);
+    memset(depth, 0, node_count);
+    for(u32 node_index = 0;
+        result && node_index < node_count;
+        ++node_index)
+    {
+        BVHNode *node = nodes + node_index;
+        if(node->count > 0)
+        {
+            result = (node->left_first <= index_count) && (node->count <= index_count - node->left_first);
+        }
+        else
+        {
+            u32 right_index = node->left_first;
+            result = (depth[node_index] < BVH_MAX_DEPTH) && (right_index > node_index + 1) && (right_index < node_count);
+            if(result)
+            {
+                u8 child_depth = depth[node_index] + 1;
+                if(depth[node_index + 1] < child_depth)
+                {
+                    depth[node_index + 1] = child_depth;
+                }
+                if(depth[right_index] < child_depth)
+                {
+                    depth[right_index] = child_depth;
+                }
+            }
+        }
+    }
+    end_temporary_memory(temp);
+    return(result);
+}
+
+internal bool cache_indices_valid(u32 *indices, u64 count, u32 limit)
+{
+    bool result = true;
+    for(u64 i = 0;
+        result && i < count;
+        ++i)
+    {
+        result = (indices[i] < limit);
+    }
+    return(result);
+}
+
+// NOTE: every index the render follows and every shadow sample count,
+// checked once so a damaged cache is refused instead of read out of
+// bounds or traced forever. Floats (transforms, vertices, boxes) are taken
+// as they are.
+internal bool cache_world_valid(World *world)
+{
+    bool result = true;
+    u32 material_count = world->material_count;
+    for(u32 i = 0; result && i < world->sphere_count; ++i)
+    {
+        result = (world->spheres[i].material_index < material_count);
+    }
+    for(u32 i = 0; result && i < world->plane_count; ++i)
+    {
+        result = (world->planes[i].material_index < material_count);
+    }
+    for(u32 i = 0; result && i < world->cube_count; ++i)
+    {
+        result = (world->cubes[i].material_index < material_count);
+    }
+    for(u32 i = 0; result && i < world->cylinder_count; ++i)
+    {
+        result = (world->cylinders[i].material_index < material_count);
+    }
+    for(u32 i = 0; result && i < world->triangle_count; ++i)
+    {
+        result = (world->triangles[i].material_index < material_count);
+    }
+    for(u32 i = 0; result && i < world->instance_count; ++i)
+    {
+        result = ((world->instances[i].material_index < material_count) &&
+                  (world->instances[i].mesh_index < world->mesh_count));
+    }
+    for(u32 i = 0; result && i < world->light_count; ++i)
+    {
+        Light *light = world->lights + i;
+        result = ((light->type == Light_Point) ||
+                  (light->samples > 0 && light->samples <= AREA_LIGHT_MAX_SAMPLES));
+    }
+
+    for(u32 mesh_index = 0;
+        result && mesh_index < world->mesh_count;
+        ++mesh_index)
+    {
+        Mesh *mesh = world->meshes + mesh_index;
+        result = (((u64)mesh->first_vertex + mesh->vertex_count <= world->mesh_vertex_count) &&
+                  ((u64)mesh->first_triangle + mesh->triangle_count <= world->mesh_triangle_count) &&
+                  ((u64)mesh->first_node + mesh->node_count <= world->mesh_node_count) &&
+                  cache_indices_valid(world->mesh_indices + 3 * (u64)mesh->first_triangle,
+                                      3 * (u64)mesh->triangle_count, mesh->vertex_count) &&
+                  cache_bvh_valid(world->mesh_nodes + mesh->first_node, mesh->node_count, mesh->triangle_count));
+    }
+
+    result = (result &&
+              cache_bvh_valid(world->tlas.nodes, world->tlas.node_count, world->tlas.index_count) &&
+              cache_indices_valid(world->tlas.indices, world->tlas.index_count, world->instance_count) &&
+              cache_bvh_valid(world->bvh.nodes, world->bvh.node_count, world->bvh.index_count) &&
+              cache_indices_valid(world->bvh.indices, world->bvh.index_count, world->sphere_count));
+
+    // NOTE: the kernels read spheres through the soa, it has to be there
+    if(result && world->sphere_count > 0)
+    {
+        result = (world->soa.memory != 0) &&
+                 cache_indices_valid(world->soa.object_index, world->soa.count, world->sphere_count);
+    }
+    return(result);
+}
+
+// NOTE: on success every World array points into the mapping and
+// world->mapped_memory owns it. Beyond the header only the arrays holding
+// indices are read here, by cache_world_valid; the rest faults in as the
+// render touches it.
+internal bool map_scene_cache(char *filename, World *world, SceneView *view, u32 *leaf_width)
+{
+    u64 size = 0;
+    u8 *memory = (u8 *)map_entire_file(filename, &size);
+    if(!memory)
+    {
+        fprintf(stderr, "[Error] Unable to map scene cache %s\n", filename);
+        return(false);
+    }
+
+    SceneCacheHeader *header = (SceneCacheHeader *)memory;
+    bool valid = (size >= sizeof(SceneCacheHeader)) &&
+                 (header->magic == SCENE_CACHE_MAGIC);
+    if(valid && header->version != SCENE_CACHE_VERSION)
+    {
+        fprintf(stderr, "[Error] %s is scene cache version %u, this build reads version %u, reconvert it\n",
+                filename, header->version, SCENE_CACHE_VERSION);
+        unmap_file(memory, size);
+        return(false);
+    }
+
+    if(valid)
+    {
+        u64 stride = header->soa_stride;
+        bool has_soa = header->soa.size > 0;
+        valid = (header->header_size == sizeof(SceneCacheHeader)) &&
+                (header->sphere_size == sizeof(Sphere)) &&
+                (header->light_size == sizeof(Light)) &&
+                (header->node_size == sizeof(BVHNode)) &&
+                (header->view_size == sizeof(SceneView)) &&
+                (header->plane_size == sizeof(Plane)) &&
+                (header->cube_size == sizeof(Cube)) &&
+                (header->cylinder_size == sizeof(Cylinder)) &&
+                (header->triangle_size == sizeof(Triangle)) &&
+                (header->mesh_size == sizeof(Mesh)) &&
+                (header->instance_size == sizeof(MeshInstance)) &&
+                (header->material_size == sizeof(Material)) &&
+                (header->material_count > 0) &&
+                (header->soa_stride == soa_stride(header->sphere_count)) &&
+                cache_section_valid(header->spheres, size, (u64)header->sphere_count * sizeof(Sphere)) &&
+                cache_section_valid(header->planes, size, (u64)header->plane_count * sizeof(Plane)) &&
+                cache_section_valid(header->cubes, size, (u64)header->cube_count * sizeof(Cube)) &&
+                cache_section_valid(header->cylinders, size, (u64)header->cylinder_count * sizeof(Cylinder)) &&
+                cache_section_valid(header->triangles, size, (u64)header->triangle_count * sizeof(Triangle)) &&
+                cache_section_valid(header->meshes, size, (u64)header->mesh_count * sizeof(Mesh)) &&
+                cache_section_valid(header->mesh_vertices, size, (u64)header->mesh_vertex_count * sizeof(v3)) &&
+                cache_section_valid(header->mesh_indices, size, (u64)header->mesh_triangle_count * 3 * sizeof(u32)) &&
+                cache_section_valid(header->mesh_nodes, size, (u64)header->mesh_node_count * sizeof(BVHNode)) &&
+                cache_section_valid(header->instances, size, (u64)header->instance_count * sizeof(MeshInstance)) &&
+                cache_section_valid(header->tlas_nodes, size, (u64)header->tlas_node_count * sizeof(BVHNode)) &&
+                cache_section_valid(header->tlas_indices, size, header->tlas_node_count ? (u64)header->instance_count * sizeof(u32) : 0) &&
+                cache_section_valid(header->materials, size, (u64)header->material_count * sizeof(Material)) &&
+                cache_section_valid(header->lights, size, (u64)header->light_count * sizeof(Light)) &&
+                cache_section_valid(header->nodes, size, (u64)header->node_count * sizeof(BVHNode)) &&
+                cache_section_valid(header->indices, size, header->node_count ? (u64)header->sphere_count * sizeof(u32) : 0) &&
+                cache_section_valid(header->soa, size, has_soa ? 20 * stride * sizeof(f32) : 0) &&
+                cache_section_valid(header->soa_object_index, size, has_soa ? stride * sizeof(u32) : 0);
+    }
+    if(!valid)
+    {
+        fprintf(stderr, "[Error] %s is not a scene cache this build can read\n", filename);
+        unmap_file(memory, size);
+        return(false);
+    }
+
+    *world = (World){0};
+    world->sphere_count = header->sphere_count;
+    world->spheres = (Sphere *)(memory + header->spheres.offset);
+    world->plane_count = header->plane_count;
+    world->planes = (Plane *)(memory + header->planes.offset);
+    world->cube_count = header->cube_count;
+    world->cubes = (Cube *)(memory + header->cubes.offset);
+    world->cylinder_count = header->cylinder_count;
+    world->cylinders = (Cylinder *)(memory + header->cylinders.offset);
+    world->triangle_count = header->triangle_count;
+    world->triangles = (Triangle *)(memory + header->triangles.offset);
+    world->mesh_count = header->mesh_count;
+    world->meshes = (Mesh *)(memory + header->meshes.offset);
+    world->mesh_vertex_count = header->mesh_vertex_count;
+    world->mesh_vertices = (v3 *)(memory + header->mesh_vertices.offset);
+    world->mesh_triangle_count = header->mesh_triangle_count;
+    world->mesh_indices = (u32 *)(memory + header->mesh_indices.offset);
+    world->mesh_node_count = header->mesh_node_count;
+    world->mesh_nodes = (BVHNode *)(memory + header->mesh_nodes.offset);
+    world->instance_count = header->instance_count;
+    world->instances = (MeshInstance *)(memory + header->instances.offset);
+    world->tlas.node_count = header->tlas_node_count;
+    world->tlas.nodes = (BVHNode *)(memory + header->tlas_nodes.offset);
+    world->tlas.index_count = header->tlas_node_count ? header->instance_count : 0;
+    world->tlas.indices = (u32 *)(memory + header->tlas_indices.offset);
+    count_objects(world);
+    world->material_count = header->material_count;
+    world->materials = (Material *)(memory + header->materials.offset);
+    world->light_count = header->light_count;
+    world->lights = (Light *)(memory + header->lights.offset);
+    world->bvh.node_count = header->node_count;
+    world->bvh.nodes = (BVHNode *)(memory + header->nodes.offset);
+    world->bvh.index_count = header->node_count ? header->sphere_count : 0;
+    world->bvh.indices = (u32 *)(memory + header->indices.offset);
+
+    if(header->soa.size > 0)
+    {
+        SphereSoA *soa = &world->soa;
+        soa->count = header->sphere_count;
+        soa->memory = (f32 *)(memory + header->soa.offset);
+        for(u32 stream = 0; stream < 16; ++stream)
+        {
+            soa->inverse[stream] = soa->memory + stream * header->soa_stride;
+        }
+        for(u32 stream = 0; stream < 4; ++stream)
+        {
+            soa->center[stream] = soa->memory + (16 + stream) * header->soa_stride;
+        }
+        soa->object_index = (u32 *)(memory + header->soa_object_index.offset);
+    }
+
+    if(!cache_world_valid(world))
+    {
+        fprintf(stderr, "[Error] %s has indices outside its arrays, reconvert it\n", filename);
+        *world = (World){0};
+        unmap_file(memory, size);
+        return(false);
+    }
+
+    world->mapped_memory = memory;
+    world->mapped_size = size;
+    *view = header->view;
+    *leaf_width = header->leaf_width;
+    return(true);
+}
+
+#endif
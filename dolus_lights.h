@@ -0,0 +1,181 @@
+#ifndef _H_DOLUSLIGHTS
+#define _H_DOLUSLIGHTS
+
+// NOTE: Many lights. A light with falloff stops counting where its
+// brightest channel, divided by 1 + distance^2, drops below the cutoff, so
+// it reaches a ball of
+//
+//   range = sqrt(max_channel / cutoff - 1)
+//
+// around its position. World.light_tree is a bvh over those balls (the
+// sphere bvh builder, one light per leaf entry) and a LightCursor walks the
+// lights whose ball holds a shade point: the global ones first, then the
+// bvh leaves the point is in. The hard edge at range is at most cutoff
+// bright, with the default 1/256 that is below one step of the 8 bit output
+// for one light. The tails of many culled lights still add up: the 1024
+// light stress scene comes out about 17% darker on average than without
+// culling, 8% with a cutoff of 1/1000. A cutoff of 0 turns culling off,
+// every light is global then.
+
+#define LIGHT_CUTOFF (1.0f / 256.0f)
+
+extern inline f32 light_max_channel(Light *light)
+{
+    f32 result = f32_max(light->intensity.x, f32_max(light->intensity.y, light->intensity.z));
+    return(result);
+}
+
+extern inline f32 light_distance_squared(Light *light, v4 point)
+{
+    f32 dx = light->position.x - point.x;
+    f32 dy = light->position.y - point.y;
+    f32 dz = light->position.z - point.z;
+    f32 result = dx * dx + dy * dy + dz * dz;
+    return(result);
+}
+
+// NOTE: intensity of light as seen from point, before shadows
+extern inline v3 light_intensity_at(Light *light, v4 point)
+{
+    v3 result = light->intensity;
+    if(light->falloff)
+    {
+        result = v3_scalar_mul(result, 1.0f / (1.0f + light_distance_squared(light, point)));
+    }
+    return(result);
+}
+
+internal void build_light_tree(World *world, f32 cutoff)
+{
+    LightTree *tree = &world->light_tree;
+    *tree = (LightTree){0};
+    if(world->light_count == 0)
+    {
+        return;
+    }
+
+    tree->range_squared = PUSH_ARRAY(&world->arena, world->light_count, f32);
+    tree->global = PUSH_ARRAY(&world->arena, world->light_count, u32);
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    AABB *bounds = PUSH_ARRAY(&scratch_arena, world->light_count, AABB);
+    u32 *bounded = PUSH_ARRAY(&scratch_arena, world->light_count, u32);
+    u32 bounded_count = 0;
+    for(u32 light_index = 0;
+        light_index < world->light_count;
+        ++light_index)
+    {
+        Light *light = world->lights + light_index;
+        if(!light->falloff || cutoff <= 0.0f)
+        {
+            tree->range_squared[light_index] = F32MAX;
+            tree->global[tree->global_count++] = light_index;
+            continue;
+        }
+
+        // NOTE: a light that never gets above the cutoff is in neither list
+        f32 range_squared = light_max_channel(light) / cutoff - 1.0f;
+        tree->range_squared[light_index] = range_squared;
+        if(range_squared > 0.0f)
+        {
+            f32 range = square_root(range_squared);
+            v3 center = v4_v3(light->position);
+            bounds[bounded_count].min = v3_sub(center, V3(range, range, range));
+            bounds[bounded_count].max = v3_add(center, V3(range, range, range));
+            bounded[bounded_count++] = light_index;
+        }
+    }
+
+    if(bounded_count > 0)
+    {
+        // NOTE: leaf entries index bounds, point them at the lights instead
+        BVH bvh;
+        build_bvh(&bvh, bounds, bounded_count, 1);
+        for(u32 entry = 0;
+            entry < bvh.index_count;
+            ++entry)
+        {
+            bvh.indices[entry] = bounded[bvh.indices[entry]];
+        }
+        tree->bvh = copy_bvh(&world->arena, &bvh);
+    }
+    end_temporary_memory(temp);
+}
+
+// NOTE: walks every light that reaches point, see next_light
+typedef struct
+{
+    v4 point;
+    u32 global_at;
+    u32 leaf_at;
+    u32 leaf_end;
+    u32 stack_count;
+    u32 stack[BVH_STACK_SIZE];
+} LightCursor;
+
+// NOTE: only the counters are set, the stack is garbage until pushed to
+extern inline void begin_lights(World *world, LightCursor *cursor, v4 point)
+{
+    cursor->point = point;
+    cursor->global_at = 0;
+    cursor->leaf_at = 0;
+    cursor->leaf_end = 0;
+    cursor->stack_count = 0;
+    if(world->light_tree.bvh.node_count > 0)
+    {
+        cursor->stack[cursor->stack_count++] = 0;
+    }
+}
+
+extern inline bool point_in_node(BVHNode *node, v4 point)
+{
+    bool result = (point.x >= node->min.x && point.x <= node->max.x &&
+                   point.y >= node->min.y && point.y <= node->max.y &&
+                   point.z >= node->min.z && point.z <= node->max.z);
+    return(result);
+}
+
+internal bool next_light(World *world, LightCursor *cursor, u32 *light_index)
+{
+    LightTree *tree = &world->light_tree;
+    if(cursor->global_at < tree->global_count)
+    {
+        *light_index = tree->global[cursor->global_at++];
+        return(true);
+    }
+
+    for(;;)
+    {
+        while(cursor->leaf_at < cursor->leaf_end)
+        {
+            u32 index = tree->bvh.indices[cursor->leaf_at++];
+            if(light_distance_squared(world->lights + index, cursor->point) < tree->range_squared[index])
+            {
+                *light_index = index;
+                return(true);
+            }
+        }
+        if(cursor->stack_count == 0)
+        {
+            return(false);
+        }
+
+        u32 node_index = cursor->stack[--cursor->stack_count];
+        BVHNode *node = tree->bvh.nodes + node_index;
+        if(!point_in_node(node, cursor->point))
+        {
+            continue;
+        }
+        if(node->count > 0)
+        {
+            cursor->leaf_at = node->left_first;
+            cursor->leaf_end = node->left_first + node->count;
+        }
+        else
+        {
+            cursor->stack[cursor->stack_count++] = node->left_first;
+            cursor->stack[cursor->stack_count++] = node_index + 1;
+        }
+    }
+}
+
+#endif
@@ -24,15 +24,61 @@ typedef struct
     f32 x, y;
 }v2;
 
+// NOTE: pcg32 (O'Neill, pcg-random.org), 64 bit state, 32 bit output.
+// Small enough to keep one per thread or seed one per pixel on the fly.
+typedef struct
+{
+    u64 state;
+    u64 increment;
+} RandomSeries;
+
+extern inline u32 random_next_u32(RandomSeries *series)
+{
+    u64 old = series->state;
+    series->state = old * 6364136223846793005ull + series->increment;
+    u32 xorshifted = (u32)(((old >> 18) ^ old) >> 27);
+    u32 rotation = (u32)(old >> 59);
+    u32 result = (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+    return(result);
+}
+
+// NOTE: different streams never overlap, whatever the seeds
+extern inline RandomSeries random_seed(u64 seed, u64 stream)
+{
+    RandomSeries result = {};
+    result.increment = (stream << 1) | 1;
+    random_next_u32(&result);
+    result.state += seed;
+    random_next_u32(&result);
+    return(result);
+}
+
+// NOTE: [0, 1), top 24 bits so every value is exact in f32
+extern inline f32 random_unilateral(RandomSeries *series)
+{
+    f32 result = (f32)(random_next_u32(series) >> 8) * (1.0f / 16777216.0f);
+    return(result);
+}
+
+extern inline u32 random_choice(RandomSeries *series, u32 count)
+{
+    u32 result = (u32)(((u64)random_next_u32(series) * count) >> 32);
+    return(result);
+}
+
+// NOTE: what FRAND/DRAND draw from, one per thread instead of the global
+// (and locked) rand() state. Reseed with random_seed for repeatable runs.
+internal __thread RandomSeries thread_random = {0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull};
+
 extern inline f32 FRAND()
 {
-    f32 result = (f32)rand()/((f32)RAND_MAX+1.0f);
+    f32 result = random_unilateral(&thread_random);
     return(result);
 }
 
 extern inline f64 DRAND()
 {
-    f64 result = rand()/(RAND_MAX+1.0);
+    f64 result = (f64)random_next_u32(&thread_random) * (1.0 / 4294967296.0);
     return(result);
 }
 
@@ -244,31 +290,6 @@ extern inline v3 v3_random_within(f32 min, f32 max)
     return(V3(f32_random_within(min, max), f32_random_within(min, max), f32_random_within(min, max)));
 }
 
-extern inline v3 random_in_unit_sphere()
-{
-    while(1)
-    {
-        v3 p = v3_random_within(-1.0f, 1.0f);
-        if(length_sq(p) < 1)
-        {
-            return p;
-        }
-    }
-}
-
-extern inline v3 random_on_hemishere(v3 normal)
-{
-    v3 on_unit_sphere = NOZ(random_in_unit_sphere());
-    if(dot(on_unit_sphere, normal) > 0.0f)
-    {
-        return(on_unit_sphere);
-    }
-    else
-    {
-        return(v3_neg(on_unit_sphere));
-    }
-}
-
 typedef struct
 {
     f32 x, y, z, w;
@@ -435,6 +456,73 @@ extern inline f32 TAN(f32 R)
     return((f32)tan(R));
 }
 
+extern inline f32 SIN(f32 R)
+{
+    return(sinf(R));
+}
+
+extern inline f32 COS(f32 R)
+{
+    return(cosf(R));
+}
+
+//
+// NOTE: Direction sampling. Everything maps uniforms straight onto the
+// target distribution, no rejection loops, so every sample costs the same
+// and draws the same number of values from the series.
+//
+
+// NOTE: Duff et al., "Building an Orthonormal Basis, Revisited" (2017).
+// n has to be unit length, no branch on which axis n is closest to.
+extern inline void orthonormal_basis(v3 n, v3 *b1, v3 *b2)
+{
+    f32 sign = copysignf(1.0f, n.z);
+    f32 a = -1.0f / (sign + n.z);
+    f32 b = n.x * n.y * a;
+    *b1 = V3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    *b2 = V3(b, sign + n.y * n.y * a, -n.y);
+}
+
+extern inline v3 random_unit_vector(RandomSeries *series)
+{
+    f32 z = 1.0f - 2.0f * random_unilateral(series);
+    f32 r = square_root(fmaxf(0.0f, 1.0f - z * z));
+    f32 phi = 2.0f * PI32 * random_unilateral(series);
+    v3 result = V3(r * COS(phi), r * SIN(phi), z);
+    return(result);
+}
+
+// NOTE: uniform inside the ball, radius from the cube root of a uniform
+extern inline v3 random_in_unit_sphere(RandomSeries *series)
+{
+    v3 direction = random_unit_vector(series);
+    v3 result = v3_scalar_mul(direction, cbrtf(random_unilateral(series)));
+    return(result);
+}
+
+extern inline v3 random_on_hemishere(RandomSeries *series, v3 normal)
+{
+    v3 direction = random_unit_vector(series);
+    v3 result = (dot(direction, normal) < 0.0f) ? v3_neg(direction) : direction;
+    return(result);
+}
+
+// NOTE: pdf = cos(theta) / pi. Malley's method, a uniform point on the unit
+// disk lifted onto the hemisphere around normal (unit length).
+extern inline v3 random_cosine_hemisphere(RandomSeries *series, v3 normal)
+{
+    f32 u = random_unilateral(series);
+    f32 r = square_root(u);
+    f32 phi = 2.0f * PI32 * random_unilateral(series);
+    f32 z = square_root(1.0f - u);
+
+    v3 b1, b2;
+    orthonormal_basis(normal, &b1, &b2);
+    v3 result = v3_add(v3_add(v3_scalar_mul(b1, r * COS(phi)), v3_scalar_mul(b2, r * SIN(phi))),
+                       v3_scalar_mul(normal, z));
+    return(result);
+}
+
 extern inline f32 clamp(f32 num, f32 min, f32 max)
 {
     if(num > max)
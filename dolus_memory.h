@@ -0,0 +1,315 @@
+#ifndef _H_DOLUSMEMORY
+#define _H_DOLUSMEMORY
+
+// NOTE: Memory. Everything a scene owns is pushed onto its World.arena and
+// goes away with one free_arena, buffers that live for one frame go onto
+// RenderJob.frame_arena, which begin_render resets, and short lived scratch
+// goes onto the calling thread's scratch_arena between a
+// begin_temporary_memory and its end_temporary_memory.
+//
+// Arenas get memory from the os a block at a time with mmap. A push that
+// does not fit the current block maps a new one (at least
+// minimum_block_size), so pushed memory never moves. Blocks of a huge page
+// or more are huge page aligned and madvise'd for transparent huge pages,
+// the big arrays of big scenes (spheres, soa streams, mesh vertices, bvh
+// nodes) get one of those to themselves and far fewer tlb misses.
+//
+// What is still on the heap (arrays that grow while loading, image
+// buffers, the thread pool) goes through heap_alloc and friends. Both heap
+// allocations and block maps are counted, in total and per thread; the
+// render code checks that tiles make none at all (RenderStats.allocations).
+
+#include<sys/mman.h>
+
+#define KILOBYTES(value) ((u64)(value) * 1024)
+#define MEGABYTES(value) (KILOBYTES(value) * 1024)
+
+#define HUGE_PAGE_SIZE MEGABYTES(2)
+#define ARENA_BLOCK_SIZE MEGABYTES(1)
+#define ARENA_ALIGNMENT 16
+
+typedef struct
+{
+    u64 heap_allocations;
+    u64 heap_frees;
+    u64 blocks_mapped;
+    u64 blocks_unmapped;
+    u64 huge_blocks_mapped;
+    u64 mapped_bytes;
+} MemoryStats;
+
+internal MemoryStats memory_stats;
+
+// NOTE: heap allocations and block maps by this thread, never reset. See
+// take_thread_allocations.
+internal __thread u64 thread_allocations;
+internal __thread u64 thread_allocations_taken;
+
+extern inline void count_allocation(u64 *counter)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    ++thread_allocations;
+}
+
+extern inline u64 allocation_count()
+{
+    u64 result = (__atomic_load_n(&memory_stats.heap_allocations, __ATOMIC_RELAXED) +
+                  __atomic_load_n(&memory_stats.blocks_mapped, __ATOMIC_RELAXED));
+    return(result);
+}
+
+// NOTE: allocations this thread made since it last asked
+extern inline u64 take_thread_allocations()
+{
+    u64 result = thread_allocations - thread_allocations_taken;
+    thread_allocations_taken = thread_allocations;
+    return(result);
+}
+
+extern inline void *heap_alloc(u64 size)
+{
+    count_allocation(&memory_stats.heap_allocations);
+    void *result = malloc(size);
+    return(result);
+}
+
+extern inline void *heap_calloc(u64 count, u64 size)
+{
+    count_allocation(&memory_stats.heap_allocations);
+    void *result = calloc(count, size);
+    return(result);
+}
+
+// NOTE: the growing arrays assign the result straight back, so running out
+// of memory ends the program here like it does in map_memory_block
+extern inline void *heap_realloc(void *memory, u64 size)
+{
+    count_allocation(&memory_stats.heap_allocations);
+    void *result = realloc(memory, size);
+    if(!result && size)
+    {
+        fprintf(stderr, "[Error] Out of memory growing an array to %llu bytes\n", (unsigned long long)size);
+        exit(1);
+    }
+    return(result);
+}
+
+extern inline void heap_free(void *memory)
+{
+    if(memory)
+    {
+        __atomic_add_fetch(&memory_stats.heap_frees, 1, __ATOMIC_RELAXED);
+        free(memory);
+    }
+}
+
+//
+// NOTE: Arenas
+//
+
+// NOTE: lives at the start of its own mapping, the memory handed out starts
+// MEMORY_BLOCK_HEADER bytes in
+typedef struct MemoryBlock
+{
+    struct MemoryBlock *previous;
+    u8 *base;
+    u64 size;
+    u64 used;
+    u64 mapped_size;
+    bool huge;
+} MemoryBlock;
+
+#define MEMORY_BLOCK_HEADER 64
+
+typedef struct
+{
+    MemoryBlock *block;
+    // NOTE: 0 means ARENA_BLOCK_SIZE
+    u64 minimum_block_size;
+    u32 temporary_count;
+} MemoryArena;
+
+typedef struct
+{
+    MemoryArena *arena;
+    MemoryBlock *block;
+    u64 used;
+} TemporaryMemory;
+
+internal MemoryBlock *map_memory_block(u64 size)
+{
+    u64 mapped_size = MEMORY_BLOCK_HEADER + size;
+    bool huge = (mapped_size >= HUGE_PAGE_SIZE);
+    u64 map_size = mapped_size;
+    if(huge)
+    {
+        // NOTE: map a huge page more than needed and trim both ends, mmap
+        // only promises 4k alignment
+        mapped_size = (mapped_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        map_size = mapped_size + HUGE_PAGE_SIZE;
+    }
+
+    u8 *memory = (u8 *)mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        fprintf(stderr, "[Error] Out of memory mapping %llu bytes\n", (unsigned long long)map_size);
+        exit(1);
+    }
+    if(huge)
+    {
+        u8 *aligned = (u8 *)(((u64)memory + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if(aligned > memory)
+        {
+            munmap(memory, aligned - memory);
+        }
+        u8 *end = memory + map_size;
+        if(aligned + mapped_size < end)
+        {
+            munmap(aligned + mapped_size, end - (aligned + mapped_size));
+        }
+        memory = aligned;
+        madvise(memory, mapped_size, MADV_HUGEPAGE);
+        __atomic_add_fetch(&memory_stats.huge_blocks_mapped, 1, __ATOMIC_RELAXED);
+    }
+    count_allocation(&memory_stats.blocks_mapped);
+    __atomic_add_fetch(&memory_stats.mapped_bytes, mapped_size, __ATOMIC_RELAXED);
+
+    MemoryBlock *result = (MemoryBlock *)memory;
+    result->previous = 0;
+    result->base = memory + MEMORY_BLOCK_HEADER;
+    result->size = mapped_size - MEMORY_BLOCK_HEADER;
+    result->used = 0;
+    result->mapped_size = mapped_size;
+    result->huge = huge;
+    return(result);
+}
+
+internal void unmap_memory_block(MemoryBlock *block)
+{
+    __atomic_add_fetch(&memory_stats.blocks_unmapped, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory_stats.mapped_bytes, block->mapped_size, __ATOMIC_RELAXED);
+    munmap(block, block->mapped_size);
+}
+
+extern inline u64 arena_alignment_offset(MemoryBlock *block, u64 alignment)
+{
+    u64 at = (u64)(block->base + block->used);
+    u64 result = ((at + alignment - 1) & ~(alignment - 1)) - at;
+    return(result);
+}
+
+// NOTE: alignment is a power of two, at most MEMORY_BLOCK_HEADER
+internal void *push_size(MemoryArena *arena, u64 size, u64 alignment)
+{
+    MemoryBlock *block = arena->block;
+    if(!block || block->used + arena_alignment_offset(block, alignment) + size > block->size)
+    {
+        u64 block_size = arena->minimum_block_size ? arena->minimum_block_size : ARENA_BLOCK_SIZE;
+        if(size > block_size)
+        {
+            block_size = size;
+        }
+        MemoryBlock *new_block = map_memory_block(block_size);
+        new_block->previous = block;
+        arena->block = block = new_block;
+    }
+
+    block->used += arena_alignment_offset(block, alignment);
+    void *result = block->base + block->used;
+    block->used += size;
+    return(result);
+}
+
+#define PUSH_STRUCT(arena, type) (type *)push_size((arena), sizeof(type), ARENA_ALIGNMENT)
+#define PUSH_ARRAY(arena, count, type) (type *)push_size((arena), (u64)(count) * sizeof(type), ARENA_ALIGNMENT)
+
+// NOTE: copying nothing gives 0, like the empty array it copies
+internal void *push_copy(MemoryArena *arena, void *source, u64 size)
+{
+    void *result = 0;
+    if(size > 0)
+    {
+        result = push_size(arena, size, ARENA_ALIGNMENT);
+        memcpy(result, source, size);
+    }
+    return(result);
+}
+
+// NOTE: makes sure size more bytes fit without mapping, for arenas that
+// must not map once rendering started
+internal void reserve_arena(MemoryArena *arena, u64 size)
+{
+    MemoryBlock *block = arena->block;
+    if(!block || block->used + size > block->size)
+    {
+        push_size(arena, size, 1);
+        arena->block->used -= size;
+    }
+}
+
+internal TemporaryMemory begin_temporary_memory(MemoryArena *arena)
+{
+    TemporaryMemory result = {};
+    result.arena = arena;
+    result.block = arena->block;
+    result.used = arena->block ? arena->block->used : 0;
+    ++arena->temporary_count;
+    return(result);
+}
+
+// NOTE: blocks mapped since begin_temporary_memory go back to the os
+internal void end_temporary_memory(TemporaryMemory temp)
+{
+    MemoryArena *arena = temp.arena;
+    while(arena->block != temp.block)
+    {
+        MemoryBlock *block = arena->block;
+        arena->block = block->previous;
+        unmap_memory_block(block);
+    }
+    if(arena->block)
+    {
+        arena->block->used = temp.used;
+    }
+    --arena->temporary_count;
+}
+
+internal void free_arena(MemoryArena *arena)
+{
+    while(arena->block)
+    {
+        MemoryBlock *block = arena->block;
+        arena->block = block->previous;
+        unmap_memory_block(block);
+    }
+    arena->temporary_count = 0;
+}
+
+// NOTE: empties the arena for the next frame. When the last frame needed
+// more than one block they are swapped for a single one that holds all of
+// them, so an arena reset every frame stops mapping after the first.
+internal void reset_arena(MemoryArena *arena)
+{
+    if(arena->block && arena->block->previous)
+    {
+        u64 total = 0;
+        for(MemoryBlock *block = arena->block; block; block = block->previous)
+        {
+            total += block->size;
+        }
+        free_arena(arena);
+        arena->minimum_block_size = total;
+        reserve_arena(arena, total);
+    }
+    else if(arena->block)
+    {
+        arena->block->used = 0;
+    }
+}
+
+// NOTE: per thread scratch, see the top of the file. Worker threads reserve
+// SCRATCH_RESERVE up front so tiles never map, see worker_proc.
+#define SCRATCH_RESERVE MEGABYTES(1)
+internal __thread MemoryArena scratch_arena;
+
+#endif
@@ -0,0 +1,637 @@
+#ifndef _H_DOLUSMESH
+#define _H_DOLUSMESH
+
+// NOTE: Triangle meshes. Two levels of bvh: every Mesh has a blas over its
+// own triangles in object space, and World.tlas is built over the world
+// space boxes of the instances. A ray walks the tlas, and at every
+// instance leaf it goes into object space with the instance inverse and
+// walks that mesh's blas. Directions are not renormalized on the way in, so
+// t means the same thing on both levels and t_max carries straight through.
+//
+// Triangles are tested with the watertight algorithm of Woop, Benthin and
+// Wald (JCGT 2013): vertices are moved into a ray space where the ray is
+// the +z axis, and the three edge functions there are exact about the
+// sign, so a ray through a shared edge or vertex hits at least one of the
+// triangles around it. Möller-Trumbore (triangle_span) can let those
+// through the crack.
+
+// NOTE: blas and tlas come from build_bvh, see BVH_MAX_DEPTH
+#define MESH_STACK_SIZE BVH_STACK_SIZE
+
+// NOTE: growing arrays meshes are assembled in on the heap, they are copied
+// into the World.mesh_* arrays once everything is loaded
+typedef struct
+{
+    u32 mesh_count;
+    u32 mesh_capacity;
+    Mesh *meshes;
+
+    u32 vertex_count;
+    u32 vertex_capacity;
+    v3 *vertices;
+
+    u32 triangle_count;
+    u32 triangle_capacity;
+    u32 *indices;
+
+    u32 node_count;
+    u32 node_capacity;
+    BVHNode *nodes;
+} MeshBuffer;
+
+internal void *grow_mesh_array(void *array, u32 *capacity, u32 needed, u32 element_size)
+{
+    if(needed > *capacity)
+    {
+        u32 new_capacity = *capacity ? *capacity : 64;
+        while(new_capacity < needed)
+        {
+            new_capacity *= 2;
+        }
+        array = heap_realloc(array, (u64)new_capacity * element_size);
+        *capacity = new_capacity;
+    }
+    return(array);
+}
+
+// NOTE: vertices and triangles added after this belong to the new mesh
+// until finish_mesh
+internal Mesh *begin_mesh(MeshBuffer *buffer, char *name, u32 name_length)
+{
+    buffer->meshes = (Mesh *)grow_mesh_array(buffer->meshes, &buffer->mesh_capacity, buffer->mesh_count + 1, sizeof(Mesh));
+    Mesh *result = buffer->meshes + buffer->mesh_count++;
+    *result = (Mesh){0};
+    if(name_length >= sizeof(result->name))
+    {
+        name_length = sizeof(result->name) - 1;
+    }
+    memcpy(result->name, name, name_length);
+    result->first_vertex = buffer->vertex_count;
+    result->first_triangle = buffer->triangle_count;
+    return(result);
+}
+
+extern inline void add_mesh_vertex(MeshBuffer *buffer, v3 vertex)
+{
+    buffer->vertices = (v3 *)grow_mesh_array(buffer->vertices, &buffer->vertex_capacity, buffer->vertex_count + 1, sizeof(v3));
+    buffer->vertices[buffer->vertex_count++] = vertex;
+}
+
+// NOTE: indices are local to the current mesh
+extern inline void add_mesh_triangle(MeshBuffer *buffer, u32 a, u32 b, u32 c)
+{
+    buffer->indices = (u32 *)grow_mesh_array(buffer->indices, &buffer->triangle_capacity, buffer->triangle_count + 1, 3 * sizeof(u32));
+    u32 *triangle = buffer->indices + 3 * buffer->triangle_count++;
+    triangle[0] = a;
+    triangle[1] = b;
+    triangle[2] = c;
+}
+
+// NOTE: builds the blas of the last mesh begun and reorders its triangles
+// into leaf order, so leaves point at triangles directly and the blas keeps
+// no index array of its own
+internal void finish_mesh(MeshBuffer *buffer)
+{
+    Mesh *mesh = buffer->meshes + buffer->mesh_count - 1;
+    mesh->vertex_count = buffer->vertex_count - mesh->first_vertex;
+    mesh->triangle_count = buffer->triangle_count - mesh->first_triangle;
+    mesh->first_node = buffer->node_count;
+    mesh->node_count = 0;
+    mesh->bounds = aabb_empty();
+
+    u32 count = mesh->triangle_count;
+    if(count == 0)
+    {
+        return;
+    }
+
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    v3 *vertices = buffer->vertices + mesh->first_vertex;
+    u32 *indices = buffer->indices + 3 * mesh->first_triangle;
+    AABB *bounds = PUSH_ARRAY(&scratch_arena, count, AABB);
+    for(u32 triangle = 0;
+        triangle < count;
+        ++triangle)
+    {
+        u32 *corner = indices + 3 * triangle;
+        AABB box = aabb_grow(aabb_empty(), vertices[corner[0]]);
+        box = aabb_grow(box, vertices[corner[1]]);
+        bounds[triangle] = aabb_grow(box, vertices[corner[2]]);
+    }
+
+    BVH blas = {};
+    build_bvh(&blas, bounds, count, 1);
+
+    u32 *sorted = PUSH_ARRAY(&scratch_arena, 3 * count, u32);
+    for(u32 leaf_index = 0;
+        leaf_index < count;
+        ++leaf_index)
+    {
+        memcpy(sorted + 3 * leaf_index, indices + 3 * blas.indices[leaf_index], 3 * sizeof(u32));
+    }
+    memcpy(indices, sorted, 3 * count * sizeof(u32));
+
+    buffer->nodes = (BVHNode *)grow_mesh_array(buffer->nodes, &buffer->node_capacity, buffer->node_count + blas.node_count, sizeof(BVHNode));
+    memcpy(buffer->nodes + buffer->node_count, blas.nodes, blas.node_count * sizeof(BVHNode));
+    buffer->node_count += blas.node_count;
+    mesh->node_count = blas.node_count;
+    mesh->bounds.min = blas.nodes[0].min;
+    mesh->bounds.max = blas.nodes[0].max;
+
+    end_temporary_memory(temp);
+}
+
+internal void free_mesh_buffer(MeshBuffer *buffer)
+{
+    heap_free(buffer->meshes);
+    heap_free(buffer->vertices);
+    heap_free(buffer->indices);
+    heap_free(buffer->nodes);
+    *buffer = (MeshBuffer){0};
+}
+
+// NOTE: copies the arrays into the world arena, buffer is empty afterwards
+internal void mesh_buffer_to_world(MeshBuffer *buffer, World *world)
+{
+    world->mesh_count = buffer->mesh_count;
+    world->meshes = (Mesh *)push_copy(&world->arena, buffer->meshes, buffer->mesh_count * sizeof(Mesh));
+    world->mesh_vertex_count = buffer->vertex_count;
+    world->mesh_vertices = (v3 *)push_copy(&world->arena, buffer->vertices, buffer->vertex_count * sizeof(v3));
+    world->mesh_triangle_count = buffer->triangle_count;
+    world->mesh_indices = (u32 *)push_copy(&world->arena, buffer->indices, 3 * buffer->triangle_count * sizeof(u32));
+    world->mesh_node_count = buffer->node_count;
+    world->mesh_nodes = (BVHNode *)push_copy(&world->arena, buffer->nodes, buffer->node_count * sizeof(BVHNode));
+    free_mesh_buffer(buffer);
+}
+
+// NOTE: box around the eight transformed corners
+internal AABB transform_bounds(m4x4 m, AABB box)
+{
+    AABB result = aabb_empty();
+    for(u32 corner = 0;
+        corner < 8;
+        ++corner)
+    {
+        v4 p = Point((corner & 1) ? box.max.x : box.min.x,
+                     (corner & 2) ? box.max.y : box.min.y,
+                     (corner & 4) ? box.max.z : box.min.z);
+        result = aabb_grow(result, v4_v3(m4x4_mul_v4(m, p)));
+    }
+    return(result);
+}
+
+internal void build_instance_bvh(World *world)
+{
+    world->tlas = (BVH){0};
+    u32 count = world->instance_count;
+    if(count == 0)
+    {
+        return;
+    }
+
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    AABB *bounds = PUSH_ARRAY(&scratch_arena, count, AABB);
+    for(u32 instance_index = 0;
+        instance_index < count;
+        ++instance_index)
+    {
+        MeshInstance *instance = world->instances + instance_index;
+        Mesh *mesh = world->meshes + instance->mesh_index;
+        bounds[instance_index] = mesh->triangle_count ? transform_bounds(instance->transform.matrix, mesh->bounds) : aabb_empty();
+    }
+    BVH tlas;
+    build_bvh(&tlas, bounds, count, 1);
+    world->tlas = copy_bvh(&world->arena, &tlas);
+    end_temporary_memory(temp);
+}
+
+// NOTE: per ray (and per instance, since the object space ray differs)
+// part of the watertight test. kz is the dominant axis of the direction,
+// kx and ky swap when it points down kz so the winding does not flip.
+typedef struct
+{
+    v3 origin;
+    v3 inv_direction;
+    u32 kx, ky, kz;
+    f32 sx, sy, sz;
+} WatertightRay;
+
+internal WatertightRay watertight_ray(v4 origin, v4 direction)
+{
+    WatertightRay result = {};
+    result.origin = v4_v3(origin);
+    v3 d = v4_v3(direction);
+    result.inv_direction = V3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+
+    f32 ax = fabsf(d.x);
+    f32 ay = fabsf(d.y);
+    f32 az = fabsf(d.z);
+    u32 kz = (ax > ay) ? ((ax > az) ? 0 : 2) : ((ay > az) ? 1 : 2);
+    u32 kx = (kz + 1) % 3;
+    u32 ky = (kx + 1) % 3;
+    f32 *e = (f32 *)&d;
+    if(e[kz] < 0.0f)
+    {
+        u32 swap = kx;
+        kx = ky;
+        ky = swap;
+    }
+    result.kx = kx;
+    result.ky = ky;
+    result.kz = kz;
+    result.sx = e[kx] / e[kz];
+    result.sy = e[ky] / e[kz];
+    result.sz = 1.0f / e[kz];
+    return(result);
+}
+
+// NOTE: both sides count. The edge functions are redone in f64 when one of
+// them comes out exactly zero in f32, that is the only case f32 can get the
+// sign wrong and open a crack between neighbours.
+extern inline bool watertight_triangle(WatertightRay *ray, v3 p0, v3 p1, v3 p2, f32 t_min, f32 t_max, f32 *t)
+{
+    v3 a = v3_sub(p0, ray->origin);
+    v3 b = v3_sub(p1, ray->origin);
+    v3 c = v3_sub(p2, ray->origin);
+    f32 *A = (f32 *)&a;
+    f32 *B = (f32 *)&b;
+    f32 *C = (f32 *)&c;
+    u32 kx = ray->kx;
+    u32 ky = ray->ky;
+    u32 kz = ray->kz;
+
+    f32 ax = A[kx] - ray->sx * A[kz];
+    f32 ay = A[ky] - ray->sy * A[kz];
+    f32 bx = B[kx] - ray->sx * B[kz];
+    f32 by = B[ky] - ray->sy * B[kz];
+    f32 cx = C[kx] - ray->sx * C[kz];
+    f32 cy = C[ky] - ray->sy * C[kz];
+
+    f32 u = cx * by - cy * bx;
+    f32 v = ax * cy - ay * cx;
+    f32 w = bx * ay - by * ax;
+    if(u == 0.0f || v == 0.0f || w == 0.0f)
+    {
+        u = (f32)((f64)cx * (f64)by - (f64)cy * (f64)bx);
+        v = (f32)((f64)ax * (f64)cy - (f64)ay * (f64)cx);
+        w = (f32)((f64)bx * (f64)ay - (f64)by * (f64)ax);
+    }
+
+    if((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+    {
+        return(false);
+    }
+    f32 det = u + v + w;
+    if(det == 0.0f)
+    {
+        return(false);
+    }
+
+    f32 az = ray->sz * A[kz];
+    f32 bz = ray->sz * B[kz];
+    f32 cz = ray->sz * C[kz];
+    f32 distance = (u * az + v * bz + w * cz) / det;
+    bool result = false;
+    if(distance > t_min && distance < t_max)
+    {
+        *t = distance;
+        result = true;
+    }
+    return(result);
+}
+
+// NOTE: closest hit in one mesh, same traversal as bvh_closest_hit with
+// triangles in the leaves
+internal bool mesh_closest_hit(World *world, Mesh *mesh, WatertightRay *ray, f32 t_min, f32 t_max, f32 *t, u32 *triangle)
+{
+    BVHNode *nodes = world->mesh_nodes + mesh->first_node;
+    v3 *vertices = world->mesh_vertices + mesh->first_vertex;
+    u32 *indices = world->mesh_indices + 3 * mesh->first_triangle;
+
+    u32 stack[MESH_STACK_SIZE];
+    f32 stack_t[MESH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    bool result = false;
+    BVHNode *node = nodes;
+    if(mesh->node_count == 0 || ray_intersect_node(node, ray->origin, ray->inv_direction, t_max) == F32MAX)
+    {
+        return(result);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            for(u32 leaf_triangle = node->left_first;
+                leaf_triangle < node->left_first + node->count;
+                ++leaf_triangle)
+            {
+                u32 *corner = indices + 3 * leaf_triangle;
+                if(watertight_triangle(ray, vertices[corner[0]], vertices[corner[1]], vertices[corner[2]], t_min, t_max, t))
+                {
+                    t_max = *t;
+                    *triangle = leaf_triangle;
+                    result = true;
+                }
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - nodes) + 1;
+            u32 right_index = node->left_first;
+            f32 t_left = ray_intersect_node(nodes + left_index, ray->origin, ray->inv_direction, t_max);
+            f32 t_right = ray_intersect_node(nodes + right_index, ray->origin, ray->inv_direction, t_max);
+
+            if(t_left != F32MAX && t_right != F32MAX)
+            {
+                if(t_right < t_left)
+                {
+                    u32 swap_index = left_index;
+                    left_index = right_index;
+                    right_index = swap_index;
+
+                    f32 swap_t = t_left;
+                    t_left = t_right;
+                    t_right = swap_t;
+                }
+                stack[stack_count] = right_index;
+                stack_t[stack_count] = t_right;
+                ++stack_count;
+                node = nodes + left_index;
+                continue;
+            }
+            else if(t_left != F32MAX)
+            {
+                node = nodes + left_index;
+                continue;
+            }
+            else if(t_right != F32MAX)
+            {
+                node = nodes + right_index;
+                continue;
+            }
+        }
+
+        node = 0;
+        while(stack_count > 0)
+        {
+            --stack_count;
+            if(stack_t[stack_count] < t_max)
+            {
+                node = nodes + stack[stack_count];
+                break;
+            }
+        }
+        if(!node)
+        {
+            break;
+        }
+    }
+    return(result);
+}
+
+internal bool mesh_occluded(World *world, Mesh *mesh, WatertightRay *ray, f32 t_min, f32 max_t)
+{
+    BVHNode *nodes = world->mesh_nodes + mesh->first_node;
+    v3 *vertices = world->mesh_vertices + mesh->first_vertex;
+    u32 *indices = world->mesh_indices + 3 * mesh->first_triangle;
+
+    u32 stack[MESH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    BVHNode *node = nodes;
+    if(mesh->node_count == 0 || ray_intersect_node(node, ray->origin, ray->inv_direction, max_t) == F32MAX)
+    {
+        return(false);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            for(u32 leaf_triangle = node->left_first;
+                leaf_triangle < node->left_first + node->count;
+                ++leaf_triangle)
+            {
+                u32 *corner = indices + 3 * leaf_triangle;
+                f32 t;
+                if(watertight_triangle(ray, vertices[corner[0]], vertices[corner[1]], vertices[corner[2]], t_min, max_t, &t))
+                {
+                    return(true);
+                }
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - nodes) + 1;
+            u32 right_index = node->left_first;
+            bool hit_left = ray_intersect_node(nodes + left_index, ray->origin, ray->inv_direction, max_t) != F32MAX;
+            bool hit_right = ray_intersect_node(nodes + right_index, ray->origin, ray->inv_direction, max_t) != F32MAX;
+            if(hit_left)
+            {
+                if(hit_right)
+                {
+                    stack[stack_count++] = right_index;
+                }
+                node = nodes + left_index;
+                continue;
+            }
+            else if(hit_right)
+            {
+                node = nodes + right_index;
+                continue;
+            }
+        }
+
+        if(stack_count == 0)
+        {
+            break;
+        }
+        node = nodes + stack[--stack_count];
+    }
+    return(false);
+}
+
+extern inline WatertightRay instance_ray(MeshInstance *instance, Ray *ray)
+{
+    v4 origin = m4x4_mul_v4(instance->transform.inverse, ray->origin);
+    v4 direction = m4x4_mul_v4(instance->transform.inverse, ray->direction);
+    return(watertight_ray(origin, direction));
+}
+
+// NOTE: closest hit over all instances, walks the tlas nearest child first
+internal bool instance_span(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    BVH *tlas = &world->tlas;
+    v3 origin = v4_v3(ray->origin);
+    v3 inv_direction = ray_inv_direction(ray);
+    u32 base = object_index_base(world, Shape_Mesh);
+
+    u32 stack[MESH_STACK_SIZE];
+    f32 stack_t[MESH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    bool result = false;
+    BVHNode *node = tlas->nodes;
+    if(tlas->node_count == 0 || ray_intersect_node(node, origin, inv_direction, t_max) == F32MAX)
+    {
+        return(result);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            for(u32 leaf_index = node->left_first;
+                leaf_index < node->left_first + node->count;
+                ++leaf_index)
+            {
+                u32 instance_index = tlas->indices[leaf_index];
+                MeshInstance *instance = world->instances + instance_index;
+                WatertightRay object_ray = instance_ray(instance, ray);
+                f32 t;
+                u32 triangle;
+                if(mesh_closest_hit(world, world->meshes + instance->mesh_index, &object_ray, t_min, t_max, &t, &triangle))
+                {
+                    t_max = t;
+                    hit->t = t;
+                    hit->object_index = base + instance_index;
+                    hit->primitive = triangle;
+                    result = true;
+                }
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - tlas->nodes) + 1;
+            u32 right_index = node->left_first;
+            f32 t_left = ray_intersect_node(tlas->nodes + left_index, origin, inv_direction, t_max);
+            f32 t_right = ray_intersect_node(tlas->nodes + right_index, origin, inv_direction, t_max);
+
+            if(t_left != F32MAX && t_right != F32MAX)
+            {
+                if(t_right < t_left)
+                {
+                    u32 swap_index = left_index;
+                    left_index = right_index;
+                    right_index = swap_index;
+
+                    f32 swap_t = t_left;
+                    t_left = t_right;
+                    t_right = swap_t;
+                }
+                stack[stack_count] = right_index;
+                stack_t[stack_count] = t_right;
+                ++stack_count;
+                node = tlas->nodes + left_index;
+                continue;
+            }
+            else if(t_left != F32MAX)
+            {
+                node = tlas->nodes + left_index;
+                continue;
+            }
+            else if(t_right != F32MAX)
+            {
+                node = tlas->nodes + right_index;
+                continue;
+            }
+        }
+
+        node = 0;
+        while(stack_count > 0)
+        {
+            --stack_count;
+            if(stack_t[stack_count] < t_max)
+            {
+                node = tlas->nodes + stack[stack_count];
+                break;
+            }
+        }
+        if(!node)
+        {
+            break;
+        }
+    }
+    return(result);
+}
+
+internal bool instances_occluded(World *world, Ray *ray, f32 t_min, f32 max_t)
+{
+    BVH *tlas = &world->tlas;
+    v3 origin = v4_v3(ray->origin);
+    v3 inv_direction = ray_inv_direction(ray);
+
+    u32 stack[MESH_STACK_SIZE];
+    u32 stack_count = 0;
+
+    BVHNode *node = tlas->nodes;
+    if(tlas->node_count == 0 || ray_intersect_node(node, origin, inv_direction, max_t) == F32MAX)
+    {
+        return(false);
+    }
+
+    for(;;)
+    {
+        if(node->count > 0)
+        {
+            for(u32 leaf_index = node->left_first;
+                leaf_index < node->left_first + node->count;
+                ++leaf_index)
+            {
+                MeshInstance *instance = world->instances + tlas->indices[leaf_index];
+                WatertightRay object_ray = instance_ray(instance, ray);
+                if(mesh_occluded(world, world->meshes + instance->mesh_index, &object_ray, t_min, max_t))
+                {
+                    return(true);
+                }
+            }
+        }
+        else
+        {
+            u32 left_index = (u32)(node - tlas->nodes) + 1;
+            u32 right_index = node->left_first;
+            bool hit_left = ray_intersect_node(tlas->nodes + left_index, origin, inv_direction, max_t) != F32MAX;
+            bool hit_right = ray_intersect_node(tlas->nodes + right_index, origin, inv_direction, max_t) != F32MAX;
+            if(hit_left)
+            {
+                if(hit_right)
+                {
+                    stack[stack_count++] = right_index;
+                }
+                node = tlas->nodes + left_index;
+                continue;
+            }
+            else if(hit_right)
+            {
+                node = tlas->nodes + right_index;
+                continue;
+            }
+        }
+
+        if(stack_count == 0)
+        {
+            break;
+        }
+        node = tlas->nodes + stack[--stack_count];
+    }
+    return(false);
+}
+
+// NOTE: unit geometric normal in object space, counter clockwise winding
+// faces out like obj files have it. The cross product of a small triangle
+// is far below what v4_normalize lets through, so it is scaled up here.
+internal v4 mesh_triangle_normal(World *world, MeshInstance *instance, u32 triangle)
+{
+    Mesh *mesh = world->meshes + instance->mesh_index;
+    v3 *vertices = world->mesh_vertices + mesh->first_vertex;
+    u32 *corner = world->mesh_indices + 3 * (mesh->first_triangle + triangle);
+    v3 p0 = vertices[corner[0]];
+    v3 n = cross(v3_sub(vertices[corner[1]], p0), v3_sub(vertices[corner[2]], p0));
+    f32 length_sq = n.x * n.x + n.y * n.y + n.z * n.z;
+    f32 scale = (length_sq > 0.0f) ? (1.0f / square_root(length_sq)) : 0.0f;
+    return(Vector(scale * n.x, scale * n.y, scale * n.z));
+}
+
+#endif
@@ -0,0 +1,856 @@
+#ifndef _H_DOLUSOUTPUT
+#define _H_DOLUSOUTPUT
+
+#include<strings.h>
+
+// NOTE: Image output. An ImageWriter takes one row at a time in the order
+// its format stores them (bmp bottom up, ppm and png top down) so whole
+// frames and streamed bands go through the same code. Rows are converted
+// straight into a big buffer that goes out in one fwrite when full, nothing
+// is written per pixel.
+//
+// Pixels are pack_color_little: 0x00RRGGBB, i.e. bytes B G R 0 in memory,
+// which bmp takes as is. ppm/png want R G B, see convert_row_rgb.
+
+#pragma pack(push, 1)
+typedef struct BitMapHeader
+{
+    u16 FileType;
+    u32 FileSize;
+    u16 Reserved1;
+    u16 Reserved2;
+    u32 BitmapOffset;
+    u32 Size;
+    i32 Width;
+    i32 Height;
+    u16 Planes;
+    u16 BitsPerPixel;
+    u32 Compression;
+	u32 SizeOfBitmap;
+	i32 HorzResolution;
+	i32 VertResolution;
+	u32 ColorsUsed;
+	u32 ColorsImportant;
+
+}BitMapHeader;
+#pragma pack(pop)
+
+typedef struct ImageU32
+{
+    u32 width, height;
+    u32 *pixels;
+} ImageU32;
+
+internal u32 get_pixel_size(ImageU32 image)
+{
+    return(sizeof(u32)*image.width*image.height);
+}
+
+internal BitMapHeader bmp_header(u32 width, u32 height)
+{
+    BitMapHeader Header = {};
+
+    u32 OutputPixelSize = sizeof(u32)*width*height;
+    Header.FileType = 0x4D42;
+    Header.FileSize = sizeof(Header) + OutputPixelSize;
+    Header.BitmapOffset = sizeof(Header);
+    Header.Size = sizeof(Header) - 14;
+    Header.Width = width;
+    Header.Height = height;
+    Header.Planes = 1;
+    Header.BitsPerPixel = 32;
+    Header.Compression = 0;
+    Header.SizeOfBitmap = OutputPixelSize;
+    Header.HorzResolution = 0;
+	Header.VertResolution = 0;
+    Header.ColorsUsed = 0;
+    Header.ColorsImportant = 0;
+    return(Header);
+}
+
+//
+// NOTE: Pixel conversion
+//
+
+internal void convert_row_rgb_scalar(u32 *pixels, u32 count, u8 *out)
+{
+    for(u32 i = 0;
+        i < count;
+        ++i)
+    {
+        u32 pixel = pixels[i];
+        out[3*i + 0] = (u8)(pixel >> 16);
+        out[3*i + 1] = (u8)(pixel >> 8);
+        out[3*i + 2] = (u8)(pixel >> 0);
+    }
+}
+
+// NOTE: 4 pixels per shuffle. Every store writes 16 bytes of which 12 are
+// real, the next store covers the rest, so stop while a full store still
+// fits and let the scalar loop do the tail.
+__attribute__((target("ssse3")))
+internal void convert_row_rgb_ssse3(u32 *pixels, u32 count, u8 *out)
+{
+    __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    u32 i = 0;
+    for(;
+        i + 6 <= count;
+        i += 4)
+    {
+        __m128i quad = _mm_loadu_si128((__m128i *)(pixels + i));
+        _mm_storeu_si128((__m128i *)(out + 3*i), _mm_shuffle_epi8(quad, shuffle));
+    }
+    convert_row_rgb_scalar(pixels + i, count - i, out + 3*i);
+}
+
+typedef void convert_row_kernel(u32 *pixels, u32 count, u8 *out);
+internal convert_row_kernel *convert_row_rgb = convert_row_rgb_scalar;
+
+//
+// NOTE: Writers
+//
+
+typedef enum
+{
+    PNGCompression_Store,
+    PNGCompression_Deflate,
+} PNGCompression;
+
+internal PNGCompression png_compression = PNGCompression_Deflate;
+
+#define WRITER_BUFFER_SIZE (256*1024)
+#define PNG_BLOCK_SIZE (256*1024)
+#define PNG_IDAT_SIZE (64*1024)
+#define PNG_HASH_BITS 15
+#define PNG_WINDOW_SIZE 32768
+
+typedef struct
+{
+    PNGCompression compression;
+    u32 adler_a;
+    u32 adler_b;
+    u64 bits;
+    u32 bit_count;
+
+    // NOTE: filtered scanlines waiting to be compressed, deflate matches
+    // only look back inside one block
+    u8 *block;
+    u32 block_used;
+    u32 block_capacity;
+
+    // NOTE: compressed bytes waiting to go out as an IDAT chunk
+    u8 *idat;
+    u32 idat_used;
+
+    u8 *row;
+    u8 *previous_row;
+    u8 *filtered[5];
+    u32 *hash_head;
+} PNGState;
+
+typedef struct ImageWriter ImageWriter;
+typedef void image_writer_begin(ImageWriter *writer);
+typedef void image_writer_row(ImageWriter *writer, u32 *row);
+typedef void image_writer_end(ImageWriter *writer);
+
+typedef struct
+{
+    char *extension;
+    bool bottom_up;
+    image_writer_begin *begin;
+    image_writer_row *row;
+    image_writer_end *end;
+} ImageFormat;
+
+struct ImageWriter
+{
+    FILE *file;
+    u32 width;
+    u32 height;
+    ImageFormat *format;
+
+    u8 *buffer;
+    u32 buffer_used;
+    u32 buffer_capacity;
+
+    PNGState png;
+};
+
+internal void writer_flush(ImageWriter *writer)
+{
+    if(writer->buffer_used)
+    {
+        fwrite(writer->buffer, 1, writer->buffer_used, writer->file);
+        writer->buffer_used = 0;
+    }
+}
+
+// NOTE: room for size bytes at the end of the buffer, size <= capacity
+internal u8 *writer_reserve(ImageWriter *writer, u32 size)
+{
+    if(writer->buffer_used + size > writer->buffer_capacity)
+    {
+        writer_flush(writer);
+    }
+    u8 *result = writer->buffer + writer->buffer_used;
+    writer->buffer_used += size;
+    return(result);
+}
+
+internal void writer_put(ImageWriter *writer, void *data, u32 size)
+{
+    if(size > writer->buffer_capacity)
+    {
+        writer_flush(writer);
+        fwrite(data, 1, size, writer->file);
+    }
+    else
+    {
+        memcpy(writer_reserve(writer, size), data, size);
+    }
+}
+
+internal void writer_put_u32_big(ImageWriter *writer, u32 value)
+{
+    u8 bytes[4] = {(u8)(value >> 24), (u8)(value >> 16), (u8)(value >> 8), (u8)value};
+    writer_put(writer, bytes, 4);
+}
+
+// NOTE: bmp
+
+internal void bmp_begin(ImageWriter *writer)
+{
+    BitMapHeader Header = bmp_header(writer->width, writer->height);
+    writer_put(writer, &Header, sizeof(Header));
+}
+
+internal void bmp_row(ImageWriter *writer, u32 *row)
+{
+    writer_put(writer, row, writer->width * sizeof(u32));
+}
+
+internal void bmp_end(ImageWriter *writer)
+{
+}
+
+// NOTE: ppm (binary P6)
+
+internal void ppm_begin(ImageWriter *writer)
+{
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", writer->width, writer->height);
+    writer_put(writer, header, (u32)length);
+}
+
+internal void ppm_row(ImageWriter *writer, u32 *row)
+{
+    convert_row_rgb(row, writer->width, writer_reserve(writer, 3 * writer->width));
+}
+
+internal void ppm_end(ImageWriter *writer)
+{
+}
+
+// NOTE: png. 8 bit RGB, one zlib stream split over IDAT chunks. Compression
+// is either stored blocks (fast, big) or deflate with the fixed huffman
+// table and a greedy one candidate lz77 match, which is plenty for renders
+// with large flat areas once the rows are filtered.
+
+internal u32 crc_table[256];
+internal u16 fixed_literal_code[288];
+internal u8 fixed_literal_length[288];
+internal pthread_once_t png_tables_once = PTHREAD_ONCE_INIT;
+
+internal u32 reverse_bits(u32 code, u32 length)
+{
+    u32 result = 0;
+    for(u32 bit = 0; bit < length; ++bit)
+    {
+        result = (result << 1) | ((code >> bit) & 1);
+    }
+    return(result);
+}
+
+internal void build_png_tables()
+{
+    for(u32 n = 0; n < 256; ++n)
+    {
+        u32 c = n;
+        for(u32 k = 0; k < 8; ++k)
+        {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        crc_table[n] = c;
+    }
+
+    // NOTE: rfc 1951 3.2.6, huffman codes go out msb first so store them
+    // reversed for the lsb first bit writer
+    for(u32 symbol = 0; symbol < 288; ++symbol)
+    {
+        u32 code, length;
+        if(symbol < 144)      { code = 0x30 + symbol;          length = 8; }
+        else if(symbol < 256) { code = 0x190 + (symbol - 144); length = 9; }
+        else if(symbol < 280) { code = symbol - 256;           length = 7; }
+        else                  { code = 0xC0 + (symbol - 280);  length = 8; }
+        fixed_literal_code[symbol] = (u16)reverse_bits(code, length);
+        fixed_literal_length[symbol] = (u8)length;
+    }
+}
+
+internal u32 crc32_update(u32 crc, u8 *data, u32 size)
+{
+    for(u32 i = 0; i < size; ++i)
+    {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return(crc);
+}
+
+internal void adler32_update(PNGState *png, u8 *data, u32 size)
+{
+    u32 a = png->adler_a;
+    u32 b = png->adler_b;
+    while(size > 0)
+    {
+        // NOTE: 5552 bytes is the most that cannot overflow b before the mod
+        u32 run = (size < 5552) ? size : 5552;
+        for(u32 i = 0; i < run; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        size -= run;
+    }
+    png->adler_a = a;
+    png->adler_b = b;
+}
+
+internal void png_chunk(ImageWriter *writer, char *type, u8 *data, u32 size)
+{
+    writer_put_u32_big(writer, size);
+    writer_put(writer, type, 4);
+    u32 crc = crc32_update(0xFFFFFFFFu, (u8 *)type, 4);
+    if(size > 0)
+    {
+        writer_put(writer, data, size);
+        crc = crc32_update(crc, data, size);
+    }
+    writer_put_u32_big(writer, crc ^ 0xFFFFFFFFu);
+}
+
+internal void png_flush_idat(ImageWriter *writer)
+{
+    PNGState *png = &writer->png;
+    if(png->idat_used)
+    {
+        png_chunk(writer, "IDAT", png->idat, png->idat_used);
+        png->idat_used = 0;
+    }
+}
+
+internal void png_put_byte(ImageWriter *writer, u8 value)
+{
+    PNGState *png = &writer->png;
+    png->idat[png->idat_used++] = value;
+    if(png->idat_used == PNG_IDAT_SIZE)
+    {
+        png_flush_idat(writer);
+    }
+}
+
+internal void png_put_bits(ImageWriter *writer, u32 value, u32 count)
+{
+    PNGState *png = &writer->png;
+    png->bits |= (u64)value << png->bit_count;
+    png->bit_count += count;
+    while(png->bit_count >= 8)
+    {
+        png_put_byte(writer, (u8)png->bits);
+        png->bits >>= 8;
+        png->bit_count -= 8;
+    }
+}
+
+internal void png_align_bits(ImageWriter *writer)
+{
+    PNGState *png = &writer->png;
+    if(png->bit_count > 0)
+    {
+        png_put_bits(writer, 0, 8 - png->bit_count);
+    }
+}
+
+internal void png_stored_block(ImageWriter *writer, u8 *data, u32 size, bool final)
+{
+    do
+    {
+        u32 run = (size < 65535) ? size : 65535;
+        bool last = final && (run == size);
+        png_put_bits(writer, last ? 1 : 0, 1);
+        png_put_bits(writer, 0, 2);
+        png_align_bits(writer);
+        png_put_bits(writer, run, 16);
+        png_put_bits(writer, run ^ 0xFFFF, 16);
+        for(u32 i = 0; i < run; ++i)
+        {
+            png_put_byte(writer, data[i]);
+        }
+        data += run;
+        size -= run;
+    } while(size > 0);
+}
+
+extern inline u32 png_hash(u8 *at)
+{
+    u32 value = ((u32)at[0] << 16) | ((u32)at[1] << 8) | (u32)at[2];
+    return((value * 2654435761u) >> (32 - PNG_HASH_BITS));
+}
+
+extern inline u32 highest_bit(u32 value)
+{
+    return(31 - __builtin_clz(value));
+}
+
+internal void png_put_match(ImageWriter *writer, u32 length, u32 distance)
+{
+    // NOTE: length codes 257..285, 3..10 have no extra bits, 258 is its own
+    // code, everything else is 4 codes per power of two
+    u32 v = length - 3;
+    if(length == 258)
+    {
+        png_put_bits(writer, fixed_literal_code[285], fixed_literal_length[285]);
+    }
+    else if(v < 8)
+    {
+        png_put_bits(writer, fixed_literal_code[257 + v], fixed_literal_length[257 + v]);
+    }
+    else
+    {
+        u32 top = highest_bit(v);
+        u32 extra = top - 2;
+        u32 code = 4 * (top - 1) + ((v >> extra) & 3);
+        png_put_bits(writer, fixed_literal_code[257 + code], fixed_literal_length[257 + code]);
+        png_put_bits(writer, v & ((1u << extra) - 1), extra);
+    }
+
+    // NOTE: distance codes 0..29, always 5 bits, 2 codes per power of two
+    v = distance - 1;
+    if(v < 4)
+    {
+        png_put_bits(writer, reverse_bits(v, 5), 5);
+    }
+    else
+    {
+        u32 top = highest_bit(v);
+        u32 extra = top - 1;
+        u32 code = 2 * top + ((v >> extra) & 1);
+        png_put_bits(writer, reverse_bits(code, 5), 5);
+        png_put_bits(writer, v & ((1u << extra) - 1), extra);
+    }
+}
+
+internal void png_fixed_block(ImageWriter *writer, u8 *data, u32 size, bool final)
+{
+    PNGState *png = &writer->png;
+    png_put_bits(writer, final ? 1 : 0, 1);
+    png_put_bits(writer, 1, 2);
+
+    memset(png->hash_head, 0, (1 << PNG_HASH_BITS) * sizeof(u32));
+    u32 at = 0;
+    while(at < size)
+    {
+        u32 best_length = 0;
+        u32 best_distance = 0;
+        if(at + 3 <= size)
+        {
+            u32 hash = png_hash(data + at);
+            // NOTE: positions are stored + 1 so 0 means empty
+            u32 candidate = png->hash_head[hash];
+            png->hash_head[hash] = at + 1;
+            if(candidate && (at - (candidate - 1)) <= PNG_WINDOW_SIZE)
+            {
+                u8 *match = data + candidate - 1;
+                u32 limit = (size - at < 258) ? (size - at) : 258;
+                u32 length = 0;
+                while(length < limit && match[length] == data[at + length])
+                {
+                    ++length;
+                }
+                if(length >= 3)
+                {
+                    best_length = length;
+                    best_distance = at - (candidate - 1);
+                }
+            }
+        }
+
+        if(best_length)
+        {
+            png_put_match(writer, best_length, best_distance);
+            for(u32 i = 1;
+                i < best_length && at + i + 3 <= size;
+                ++i)
+            {
+                png->hash_head[png_hash(data + at + i)] = at + i + 1;
+            }
+            at += best_length;
+        }
+        else
+        {
+            png_put_bits(writer, fixed_literal_code[data[at]], fixed_literal_length[data[at]]);
+            ++at;
+        }
+    }
+    png_put_bits(writer, fixed_literal_code[256], fixed_literal_length[256]);
+}
+
+internal void png_compress_block(ImageWriter *writer, bool final)
+{
+    PNGState *png = &writer->png;
+    if(png->compression == PNGCompression_Store)
+    {
+        png_stored_block(writer, png->block, png->block_used, final);
+    }
+    else
+    {
+        png_fixed_block(writer, png->block, png->block_used, final);
+    }
+    png->block_used = 0;
+}
+
+internal void png_begin(ImageWriter *writer)
+{
+    pthread_once(&png_tables_once, build_png_tables);
+
+    PNGState *png = &writer->png;
+    u32 row_size = 3 * writer->width;
+    png->compression = png_compression;
+    png->adler_a = 1;
+    png->adler_b = 0;
+    png->block_capacity = PNG_BLOCK_SIZE + 1 + row_size;
+    png->block = (u8 *)heap_alloc(png->block_capacity);
+    png->idat = (u8 *)heap_alloc(PNG_IDAT_SIZE);
+    png->row = (u8 *)heap_alloc(row_size);
+    png->previous_row = (u8 *)heap_calloc(row_size, 1);
+    for(u32 filter = 0; filter < 5; ++filter)
+    {
+        png->filtered[filter] = (u8 *)heap_alloc(1 + row_size);
+    }
+    png->hash_head = (u32 *)heap_alloc((1 << PNG_HASH_BITS) * sizeof(u32));
+
+    u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    writer_put(writer, signature, sizeof(signature));
+
+    u8 ihdr[13] =
+    {
+        (u8)(writer->width >> 24), (u8)(writer->width >> 16), (u8)(writer->width >> 8), (u8)writer->width,
+        (u8)(writer->height >> 24), (u8)(writer->height >> 16), (u8)(writer->height >> 8), (u8)writer->height,
+        8, // bit depth
+        2, // truecolor
+        0, 0, 0,
+    };
+    png_chunk(writer, "IHDR", ihdr, sizeof(ihdr));
+
+    // NOTE: zlib header, deflate with a 32k window, no dictionary
+    png_put_byte(writer, 0x78);
+    png_put_byte(writer, 0x01);
+}
+
+extern inline u8 paeth_predictor(u8 a, u8 b, u8 c)
+{
+    i32 p = (i32)a + (i32)b - (i32)c;
+    i32 pa = abs(p - (i32)a);
+    i32 pb = abs(p - (i32)b);
+    i32 pc = abs(p - (i32)c);
+    u8 result = (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+    return(result);
+}
+
+// NOTE: deflate picks the filter with the smallest sum of absolute
+// (signed) bytes, the usual heuristic; store has nothing to gain, no filter
+internal void png_row(ImageWriter *writer, u32 *pixels)
+{
+    PNGState *png = &writer->png;
+    u32 row_size = 3 * writer->width;
+    u8 *row = png->row;
+    u8 *up = png->previous_row;
+    convert_row_rgb(pixels, writer->width, row);
+
+    u8 *chosen = png->filtered[0];
+    chosen[0] = 0;
+    memcpy(chosen + 1, row, row_size);
+    if(png->compression == PNGCompression_Deflate)
+    {
+        u8 *sub = png->filtered[1];
+        u8 *upf = png->filtered[2];
+        u8 *average = png->filtered[3];
+        u8 *paeth = png->filtered[4];
+        sub[0] = 1; upf[0] = 2; average[0] = 3; paeth[0] = 4;
+        for(u32 i = 0; i < row_size; ++i)
+        {
+            u8 a = (i >= 3) ? row[i - 3] : 0;
+            u8 b = up[i];
+            u8 c = (i >= 3) ? up[i - 3] : 0;
+            sub[1 + i] = row[i] - a;
+            upf[1 + i] = row[i] - b;
+            average[1 + i] = row[i] - (u8)(((u32)a + (u32)b) / 2);
+            paeth[1 + i] = row[i] - paeth_predictor(a, b, c);
+        }
+
+        u32 best_sum = 0xFFFFFFFFu;
+        for(u32 filter = 0; filter < 5; ++filter)
+        {
+            u8 *candidate = png->filtered[filter];
+            u32 sum = 0;
+            for(u32 i = 1; i <= row_size; ++i)
+            {
+                sum += (candidate[i] < 128) ? candidate[i] : (256 - candidate[i]);
+            }
+            if(sum < best_sum)
+            {
+                best_sum = sum;
+                chosen = candidate;
+            }
+        }
+    }
+
+    if(png->block_used + 1 + row_size > png->block_capacity)
+    {
+        png_compress_block(writer, false);
+    }
+    memcpy(png->block + png->block_used, chosen, 1 + row_size);
+    png->block_used += 1 + row_size;
+    adler32_update(png, chosen, 1 + row_size);
+
+    png->previous_row = row;
+    png->row = up;
+}
+
+internal void png_end(ImageWriter *writer)
+{
+    PNGState *png = &writer->png;
+    png_compress_block(writer, true);
+    png_align_bits(writer);
+    u32 adler = (png->adler_b << 16) | png->adler_a;
+    png_put_byte(writer, (u8)(adler >> 24));
+    png_put_byte(writer, (u8)(adler >> 16));
+    png_put_byte(writer, (u8)(adler >> 8));
+    png_put_byte(writer, (u8)adler);
+    png_flush_idat(writer);
+    png_chunk(writer, "IEND", 0, 0);
+
+    heap_free(png->block);
+    heap_free(png->idat);
+    heap_free(png->row);
+    heap_free(png->previous_row);
+    for(u32 filter = 0; filter < 5; ++filter)
+    {
+        heap_free(png->filtered[filter]);
+    }
+    heap_free(png->hash_head);
+}
+
+internal ImageFormat image_formats[] =
+{
+    {"bmp", true, bmp_begin, bmp_row, bmp_end},
+    {"ppm", false, ppm_begin, ppm_row, ppm_end},
+    {"png", false, png_begin, png_row, png_end},
+};
+
+// NOTE: by extension, 0 if there is no writer for it
+internal ImageFormat *image_format_for(char *filename)
+{
+    char *dot = strrchr(filename, '.');
+    if(dot)
+    {
+        for(u32 index = 0;
+            index < sizeof(image_formats) / sizeof(image_formats[0]);
+            ++index)
+        {
+            if(strcasecmp(dot + 1, image_formats[index].extension) == 0)
+            {
+                return(image_formats + index);
+            }
+        }
+    }
+    return(0);
+}
+
+internal void select_output_kernels()
+{
+    if(get_cpu_features().ssse3)
+    {
+        convert_row_rgb = convert_row_rgb_ssse3;
+    }
+}
+
+internal bool begin_image(ImageWriter *writer, char *filename, u32 width, u32 height)
+{
+    *writer = (ImageWriter){0};
+    writer->format = image_format_for(filename);
+    if(!writer->format)
+    {
+        fprintf(stderr, "[Error] No image writer for %s, use .bmp, .ppm or .png\n", filename);
+        return(false);
+    }
+    writer->file = fopen(filename, "wb");
+    if(!writer->file)
+    {
+        fprintf(stderr, "[Error] Unable to wirte to file %s\n", filename);
+        return(false);
+    }
+    writer->width = width;
+    writer->height = height;
+    writer->buffer_capacity = WRITER_BUFFER_SIZE;
+    if(writer->buffer_capacity < 4 * width)
+    {
+        writer->buffer_capacity = 4 * width;
+    }
+    writer->buffer = (u8 *)heap_alloc(writer->buffer_capacity);
+    writer->format->begin(writer);
+    return(true);
+}
+
+// NOTE: rows in file order, writer->format->bottom_up says which that is
+internal void write_image_row(ImageWriter *writer, u32 *row)
+{
+    writer->format->row(writer, row);
+}
+
+internal bool end_image(ImageWriter *writer)
+{
+    writer->format->end(writer);
+    writer_flush(writer);
+    bool result = (ferror(writer->file) == 0);
+    result = (fclose(writer->file) == 0) && result;
+    heap_free(writer->buffer);
+    *writer = (ImageWriter){0};
+    return(result);
+}
+
+internal void save_image(ImageU32 image, char *filename)
+{
+    ImageWriter writer;
+    if(!begin_image(&writer, filename, image.width, image.height))
+    {
+        exit(1);
+    }
+    bool bottom_up = writer.format->bottom_up;
+    for(u32 index = 0;
+        index < image.height;
+        ++index)
+    {
+        u32 row = bottom_up ? index : (image.height - 1 - index);
+        write_image_row(&writer, image.pixels + row * image.width);
+    }
+    if(!end_image(&writer))
+    {
+        fprintf(stderr, "[Error] Unable to wirte to file %s\n", filename);
+        exit(1);
+    }
+}
+
+//
+// NOTE: Async writer
+//
+// One frame in flight: submit waits for the previous frame to be on disk,
+// copies the new one into the writer's own buffer and returns, the encode
+// then runs on the writer thread while the caller renders on.
+//
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    bool pending;
+    bool quit;
+
+    ImageU32 image;
+    char filename[1024];
+} AsyncImageWriter;
+
+internal void *async_writer_proc(void *param)
+{
+    AsyncImageWriter *writer = (AsyncImageWriter *)param;
+    pthread_mutex_lock(&writer->mutex);
+    for(;;)
+    {
+        while(!writer->pending && !writer->quit)
+        {
+            pthread_cond_wait(&writer->changed, &writer->mutex);
+        }
+        if(!writer->pending && writer->quit)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&writer->mutex);
+
+        save_image(writer->image, writer->filename);
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->pending = false;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return(0);
+}
+
+internal void async_writer_start(AsyncImageWriter *writer)
+{
+    *writer = (AsyncImageWriter){0};
+    pthread_mutex_init(&writer->mutex, 0);
+    pthread_cond_init(&writer->changed, 0);
+    if(pthread_create(&writer->thread, 0, async_writer_proc, writer) != 0)
+    {
+        fprintf(stderr, "[Error] Unable to create the image writer thread\n");
+        exit(1);
+    }
+}
+
+// NOTE: blocks until the frame before this one is written
+internal void async_writer_wait(AsyncImageWriter *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    while(writer->pending)
+    {
+        pthread_cond_wait(&writer->changed, &writer->mutex);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+internal void async_writer_submit(AsyncImageWriter *writer, ImageU32 *image, char *filename)
+{
+    async_writer_wait(writer);
+
+    if(writer->image.width != image->width || writer->image.height != image->height)
+    {
+        heap_free(writer->image.pixels);
+        writer->image = *image;
+        writer->image.pixels = (u32 *)heap_alloc(get_pixel_size(*image));
+    }
+    memcpy(writer->image.pixels, image->pixels, get_pixel_size(*image));
+    snprintf(writer->filename, sizeof(writer->filename), "%s", filename);
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->pending = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+// NOTE: finishes whatever is still pending
+internal void async_writer_stop(AsyncImageWriter *writer)
+{
+    pthread_mutex_lock(&writer->mutex);
+    writer->quit = true;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, 0);
+    heap_free(writer->image.pixels);
+    writer->image = (ImageU32){0};
+}
+
+#endif
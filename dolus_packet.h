@@ -0,0 +1,227 @@
+#ifndef _H_DOLUSPACKET
+#define _H_DOLUSPACKET
+
+// NOTE: 8 wide ray packets for coherent primary rays. One ray per avx lane,
+// the packet walks the bvh together and a node is entered when any active
+// lane hits it. Sphere tests are the same math as ray_intersect_sphere, just
+// across rays instead of across spheres, so every lane ends up with the hit
+// the single ray path would have found.
+
+#define PACKET_WIDTH 8
+
+typedef struct
+{
+    __attribute__((aligned(32))) f32 origin[4][PACKET_WIDTH];
+    __attribute__((aligned(32))) f32 direction[4][PACKET_WIDTH];
+    __attribute__((aligned(32))) f32 inv_direction[3][PACKET_WIDTH];
+    __attribute__((aligned(32))) f32 t_max[PACKET_WIDTH];
+    i32 object_index[PACKET_WIDTH];
+
+    // NOTE: bit i set = lane i carries a ray
+    u32 active;
+} RayPacket;
+
+internal void packet_set_ray(RayPacket *packet, u32 lane, Ray *ray)
+{
+    packet->origin[0][lane] = ray->origin.x;
+    packet->origin[1][lane] = ray->origin.y;
+    packet->origin[2][lane] = ray->origin.z;
+    packet->origin[3][lane] = ray->origin.w;
+    packet->direction[0][lane] = ray->direction.x;
+    packet->direction[1][lane] = ray->direction.y;
+    packet->direction[2][lane] = ray->direction.z;
+    packet->direction[3][lane] = ray->direction.w;
+    packet->inv_direction[0][lane] = 1.0f / ray->direction.x;
+    packet->inv_direction[1][lane] = 1.0f / ray->direction.y;
+    packet->inv_direction[2][lane] = 1.0f / ray->direction.z;
+    packet->t_max[lane] = F32MAX;
+    packet->object_index[lane] = -1;
+    packet->active |= (1u << lane);
+}
+
+// NOTE: slab test for all lanes, returns the mask of active lanes that enter
+// the node before their current t_max, and the nearest entry among them
+__attribute__((target("avx2")))
+internal u32 packet_intersect_node(BVHNode *node, RayPacket *packet, f32 *nearest_entry)
+{
+    __m256 t_near = _mm256_set1_ps(F32MIN);
+    __m256 t_far = _mm256_set1_ps(F32MAX);
+    f32 *node_min = &node->min.x;
+    f32 *node_max = &node->max.x;
+    for(u32 axis = 0; axis < 3; ++axis)
+    {
+        __m256 origin = _mm256_load_ps(packet->origin[axis]);
+        __m256 inv_direction = _mm256_load_ps(packet->inv_direction[axis]);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node_min[axis]), origin), inv_direction);
+        __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node_max[axis]), origin), inv_direction);
+        t_near = _mm256_max_ps(t_near, _mm256_min_ps(t1, t2));
+        t_far = _mm256_min_ps(t_far, _mm256_max_ps(t1, t2));
+    }
+
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(t_far, t_near, _CMP_GE_OQ),
+                               _mm256_cmp_ps(t_far, _mm256_setzero_ps(), _CMP_GT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(t_near, _mm256_load_ps(packet->t_max), _CMP_LT_OQ));
+    u32 result = (u32)_mm256_movemask_ps(hit) & packet->active;
+
+    if(result)
+    {
+        f32 entries[PACKET_WIDTH];
+        _mm256_storeu_ps(entries, t_near);
+        f32 nearest = F32MAX;
+        for(u32 lane = 0; lane < PACKET_WIDTH; ++lane)
+        {
+            if((result & (1u << lane)) && entries[lane] < nearest)
+            {
+                nearest = entries[lane];
+            }
+        }
+        *nearest_entry = nearest;
+    }
+    return(result);
+}
+
+#define PACKET_ROW(m, x, y, z, w) \
+    _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps((m)[0], x), _mm256_mul_ps((m)[1], y)), \
+                                _mm256_mul_ps((m)[2], z)), \
+                  _mm256_mul_ps((m)[3], w))
+
+// NOTE: every sphere in [first, first + count) against every lane
+__attribute__((target("avx2")))
+internal void packet_intersect_span(World *world, u32 first, u32 count, RayPacket *packet)
+{
+    SphereSoA *soa = &world->soa;
+    __m256 ox = _mm256_load_ps(packet->origin[0]);
+    __m256 oy = _mm256_load_ps(packet->origin[1]);
+    __m256 oz = _mm256_load_ps(packet->origin[2]);
+    __m256 ow = _mm256_load_ps(packet->origin[3]);
+    __m256 dx = _mm256_load_ps(packet->direction[0]);
+    __m256 dy = _mm256_load_ps(packet->direction[1]);
+    __m256 dz = _mm256_load_ps(packet->direction[2]);
+    __m256 dw = _mm256_load_ps(packet->direction[3]);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 two = _mm256_set1_ps(2.0f);
+    __m256 four = _mm256_set1_ps(4.0f);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 t_min = _mm256_set1_ps(EPSILON);
+    __m256 t_max = _mm256_load_ps(packet->t_max);
+
+    for(u32 slot = first;
+        slot < first + count;
+        ++slot)
+    {
+        __m256 m[16];
+        for(u32 i = 0; i < 16; ++i)
+        {
+            m[i] = _mm256_set1_ps(soa->inverse[i][slot]);
+        }
+
+        __m256 rox = PACKET_ROW(m + 0, ox, oy, oz, ow);
+        __m256 roy = PACKET_ROW(m + 4, ox, oy, oz, ow);
+        __m256 roz = PACKET_ROW(m + 8, ox, oy, oz, ow);
+        __m256 row = PACKET_ROW(m + 12, ox, oy, oz, ow);
+        __m256 rdx = PACKET_ROW(m + 0, dx, dy, dz, dw);
+        __m256 rdy = PACKET_ROW(m + 4, dx, dy, dz, dw);
+        __m256 rdz = PACKET_ROW(m + 8, dx, dy, dz, dw);
+        __m256 rdw = PACKET_ROW(m + 12, dx, dy, dz, dw);
+
+        __m256 sx = _mm256_sub_ps(rox, _mm256_set1_ps(soa->center[0][slot]));
+        __m256 sy = _mm256_sub_ps(roy, _mm256_set1_ps(soa->center[1][slot]));
+        __m256 sz = _mm256_sub_ps(roz, _mm256_set1_ps(soa->center[2][slot]));
+        __m256 sw = _mm256_sub_ps(row, _mm256_set1_ps(soa->center[3][slot]));
+
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rdx, rdx), _mm256_mul_ps(rdy, rdy)), _mm256_mul_ps(rdz, rdz)), _mm256_mul_ps(rdw, rdw));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rdx, sx), _mm256_mul_ps(rdy, sy)), _mm256_mul_ps(rdz, sz)), _mm256_mul_ps(rdw, sw)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)), _mm256_mul_ps(sw, sw)), one);
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), c));
+
+        __m256 root = _mm256_sqrt_ps(discriminant);
+        __m256 neg_b = _mm256_xor_ps(b, sign);
+        __m256 two_a = _mm256_mul_ps(two, a);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(neg_b, root), two_a);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(neg_b, root), two_a);
+
+        __m256 valid1 = _mm256_and_ps(_mm256_cmp_ps(t1, t_min, _CMP_GT_OQ), _mm256_cmp_ps(t1, t_max, _CMP_LT_OQ));
+        __m256 valid2 = _mm256_and_ps(_mm256_cmp_ps(t2, t_min, _CMP_GT_OQ), _mm256_cmp_ps(t2, t_max, _CMP_LT_OQ));
+        __m256 valid = _mm256_or_ps(valid1, valid2);
+        u32 hit_mask = (u32)_mm256_movemask_ps(valid) & packet->active;
+
+        if(hit_mask)
+        {
+            __m256 nearest = _mm256_blendv_ps(t2, t1, valid1);
+            t_max = _mm256_blendv_ps(t_max, nearest, valid);
+            for(u32 lane = 0; lane < PACKET_WIDTH; ++lane)
+            {
+                if(hit_mask & (1u << lane))
+                {
+                    packet->object_index[lane] = (i32)soa->object_index[slot];
+                }
+            }
+        }
+    }
+    _mm256_store_ps(packet->t_max, t_max);
+}
+
+// NOTE: closest hit for every active lane, results land in t_max and
+// object_index (-1 = miss)
+__attribute__((target("avx2")))
+internal void packet_closest_hit(World *world, RayPacket *packet)
+{
+    BVH *bvh = &world->bvh;
+    if(bvh->node_count == 0)
+    {
+        packet_intersect_span(world, 0, world->soa.count, packet);
+        return;
+    }
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stack_count = 0;
+    stack[stack_count++] = 0;
+
+    while(stack_count > 0)
+    {
+        BVHNode *node = bvh->nodes + stack[--stack_count];
+        f32 entry;
+        if(!packet_intersect_node(node, packet, &entry))
+        {
+            continue;
+        }
+
+        if(node->count > 0)
+        {
+            packet_intersect_span(world, node->left_first, node->count, packet);
+        }
+        else
+        {
+            u32 left_index = (u32)(node - bvh->nodes) + 1;
+            u32 right_index = node->left_first;
+            f32 t_left = F32MAX, t_right = F32MAX;
+            u32 hit_left = packet_intersect_node(bvh->nodes + left_index, packet, &t_left);
+            u32 hit_right = packet_intersect_node(bvh->nodes + right_index, packet, &t_right);
+
+            // NOTE: push the far child first so the near one pops next
+            if(hit_left && hit_right)
+            {
+                if(t_left <= t_right)
+                {
+                    stack[stack_count++] = right_index;
+                    stack[stack_count++] = left_index;
+                }
+                else
+                {
+                    stack[stack_count++] = left_index;
+                    stack[stack_count++] = right_index;
+                }
+            }
+            else if(hit_left)
+            {
+                stack[stack_count++] = left_index;
+            }
+            else if(hit_right)
+            {
+                stack[stack_count++] = right_index;
+            }
+        }
+    }
+}
+
+#endif
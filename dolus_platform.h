@@ -0,0 +1,476 @@
+#ifndef _H_DOLUSPLATFORM
+#define _H_DOLUSPLATFORM
+
+// NOTE: Everything that talks to the OS lives here: threads, clocks, cpu info.
+// Only posix for now.
+
+#include<pthread.h>
+#include<time.h>
+#include<unistd.h>
+#include<stdlib.h>
+#include<cpuid.h>
+#include<x86intrin.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/resource.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
+#include<errno.h>
+
+extern inline f64 get_wall_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    f64 result = (f64)ts.tv_sec + (f64)ts.tv_nsec * 1e-9;
+    return(result);
+}
+
+extern inline u32 get_cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 result = (count > 0) ? (u32)count : 1;
+    return(result);
+}
+
+// NOTE: high water mark of resident memory for the whole process so far
+extern inline u64 get_peak_resident_bytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // NOTE: linux reports kilobytes
+    u64 result = (u64)usage.ru_maxrss * 1024;
+    return(result);
+}
+
+// NOTE: private writable mapping, pages come in on first touch and writes
+// stay in this process (copy on write), the file never changes
+internal void *map_entire_file(char *filename, u64 *size)
+{
+    void *result = 0;
+    int fd = open(filename, O_RDONLY);
+    if(fd >= 0)
+    {
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            result = mmap(0, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if(result == MAP_FAILED)
+            {
+                result = 0;
+            }
+            else
+            {
+                *size = (u64)info.st_size;
+            }
+        }
+        close(fd);
+    }
+    return(result);
+}
+
+internal void unmap_file(void *memory, u64 size)
+{
+    munmap(memory, (size_t)size);
+}
+
+//
+// NOTE: Hardware cache miss counters through linux perf_event_open. They count
+// user space events of the calling thread only, so they are only the whole
+// story when the render runs on it (--threads 1). Most virtual machines have
+// no pmu to count with and perf_event_paranoid can forbid it, open then
+// fails and error says why.
+//
+
+typedef enum
+{
+    CacheCounter_L1DMiss,
+    CacheCounter_LLCMiss,
+
+    CacheCounter_Count,
+} CacheCounterType;
+
+typedef struct
+{
+    int fd[CacheCounter_Count];
+    int error;
+} CacheCounters;
+
+internal bool open_cache_counters(CacheCounters *counters)
+{
+    u64 configs[CacheCounter_Count][2] =
+    {
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    bool result = true;
+    counters->error = 0;
+    for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+    {
+        counters->fd[counter] = -1;
+    }
+    for(u32 counter = 0; result && counter < CacheCounter_Count; ++counter)
+    {
+        struct perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = (u32)configs[counter][0];
+        attr.config = configs[counter][1];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fd[counter] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(counters->fd[counter] < 0)
+        {
+            counters->error = errno;
+            result = false;
+        }
+    }
+    if(!result)
+    {
+        for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+        {
+            if(counters->fd[counter] >= 0)
+            {
+                close(counters->fd[counter]);
+            }
+            counters->fd[counter] = -1;
+        }
+    }
+    return(result);
+}
+
+internal void start_cache_counters(CacheCounters *counters)
+{
+    for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+    {
+        ioctl(counters->fd[counter], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fd[counter], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// NOTE: adds the events since start_cache_counters to counts
+internal void stop_cache_counters(CacheCounters *counters, u64 *counts)
+{
+    for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+    {
+        ioctl(counters->fd[counter], PERF_EVENT_IOC_DISABLE, 0);
+        u64 value = 0;
+        if(read(counters->fd[counter], &value, sizeof(value)) == sizeof(value))
+        {
+            counts[counter] += value;
+        }
+    }
+}
+
+internal void close_cache_counters(CacheCounters *counters)
+{
+    for(u32 counter = 0; counter < CacheCounter_Count; ++counter)
+    {
+        if(counters->fd[counter] >= 0)
+        {
+            close(counters->fd[counter]);
+        }
+        counters->fd[counter] = -1;
+    }
+}
+
+typedef struct
+{
+    bool sse2;
+    bool ssse3;
+    bool sse41;
+    bool avx;
+    bool avx2;
+    bool fma;
+} CPUFeatures;
+
+// NOTE: avx is only usable if the OS saves the ymm registers on a context
+// switch, which is what the OSXSAVE/XCR0 dance checks
+internal CPUFeatures get_cpu_features()
+{
+    CPUFeatures result = {};
+    u32 eax, ebx, ecx, edx;
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        result.sse2 = (edx & bit_SSE2) != 0;
+        result.ssse3 = (ecx & bit_SSSE3) != 0;
+        result.sse41 = (ecx & bit_SSE4_1) != 0;
+
+        bool os_saves_ymm = false;
+        if(ecx & bit_OSXSAVE)
+        {
+            u32 xcr0_lo, xcr0_hi;
+            __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            os_saves_ymm = (xcr0_lo & 0x6) == 0x6;
+        }
+        result.avx = os_saves_ymm && (ecx & bit_AVX);
+        result.fma = result.avx && (ecx & bit_FMA);
+
+        if(result.avx && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        {
+            result.avx2 = (ebx & bit_AVX2) != 0;
+        }
+    }
+    return(result);
+}
+
+//
+// NOTE: Thread pool with work stealing
+//
+// Every dispatch hands each worker a contiguous run of task indices. A worker
+// pops from the front of its own run and, once it is empty, steals the back
+// half of somebody else's run. Cheap tasks (background) and expensive tasks
+// (objects) therefore even out without a shared queue everybody fights over.
+//
+
+typedef void thread_task(void *data, u32 task_index, u32 thread_index);
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    u32 next;
+    u32 end;
+
+    // NOTE: pad so two workers never share a cache line
+    u8 pad[64];
+} TaskRange;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct
+{
+    ThreadPool *pool;
+    u32 thread_index;
+} WorkerInfo;
+
+struct ThreadPool
+{
+    u32 thread_count;
+    pthread_t *threads;
+    WorkerInfo *workers;
+    TaskRange *ranges;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    u32 generation;
+    u32 busy_count;
+    bool quit;
+
+    thread_task *task;
+    void *task_data;
+};
+
+internal bool pop_task(TaskRange *range, u32 *task_index)
+{
+    bool result = false;
+    pthread_mutex_lock(&range->mutex);
+    if(range->next < range->end)
+    {
+        *task_index = range->next++;
+        result = true;
+    }
+    pthread_mutex_unlock(&range->mutex);
+    return(result);
+}
+
+internal bool steal_tasks(ThreadPool *pool, u32 thief_index)
+{
+    bool result = false;
+    for(u32 offset = 1;
+        offset < pool->thread_count;
+        ++offset)
+    {
+        TaskRange *victim = pool->ranges + ((thief_index + offset) % pool->thread_count);
+
+        u32 begin = 0, end = 0;
+        pthread_mutex_lock(&victim->mutex);
+        u32 remaining = victim->end - victim->next;
+        if(remaining > 0)
+        {
+            // NOTE: take the back half, the victim keeps working on the front
+            u32 half = (remaining + 1) / 2;
+            end = victim->end;
+            begin = end - half;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+
+        if(begin < end)
+        {
+            TaskRange *own = pool->ranges + thief_index;
+            pthread_mutex_lock(&own->mutex);
+            own->next = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->mutex);
+            result = true;
+            break;
+        }
+    }
+    return(result);
+}
+
+internal void run_tasks(ThreadPool *pool, u32 thread_index)
+{
+    TaskRange *own = pool->ranges + thread_index;
+    for(;;)
+    {
+        u32 task_index;
+        if(pop_task(own, &task_index))
+        {
+            pool->task(pool->task_data, task_index, thread_index);
+        }
+        else if(!steal_tasks(pool, thread_index))
+        {
+            break;
+        }
+    }
+}
+
+internal void *worker_proc(void *param)
+{
+    WorkerInfo *info = (WorkerInfo *)param;
+    ThreadPool *pool = info->pool;
+
+    // NOTE: map the scratch before the first task, so tasks never have to
+    // and the mapping is not counted against them
+    reserve_arena(&scratch_arena, SCRATCH_RESERVE);
+    take_thread_allocations();
+
+    u32 seen_generation = 0;
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while(!pool->quit && pool->generation == seen_generation)
+        {
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        }
+        if(pool->quit)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            free_arena(&scratch_arena);
+            break;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_tasks(pool, info->thread_index);
+
+        pthread_mutex_lock(&pool->mutex);
+        if(--pool->busy_count == 0)
+        {
+            pthread_cond_signal(&pool->work_done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return(0);
+}
+
+// NOTE: thread_count <= 1 never spawns anything, tasks run in order on the
+// calling thread. That is the serial reference path.
+internal void thread_pool_init(ThreadPool *pool, u32 thread_count)
+{
+    *pool = (ThreadPool){0};
+    pool->thread_count = (thread_count > 0) ? thread_count : 1;
+    if(pool->thread_count == 1)
+    {
+        reserve_arena(&scratch_arena, SCRATCH_RESERVE);
+    }
+    else
+    {
+        pool->threads = (pthread_t *)heap_calloc(pool->thread_count, sizeof(pthread_t));
+        pool->workers = (WorkerInfo *)heap_calloc(pool->thread_count, sizeof(WorkerInfo));
+        pool->ranges = (TaskRange *)heap_calloc(pool->thread_count, sizeof(TaskRange));
+        pthread_mutex_init(&pool->mutex, 0);
+        pthread_cond_init(&pool->work_ready, 0);
+        pthread_cond_init(&pool->work_done, 0);
+
+        for(u32 thread_index = 0;
+            thread_index < pool->thread_count;
+            ++thread_index)
+        {
+            pthread_mutex_init(&pool->ranges[thread_index].mutex, 0);
+            pool->workers[thread_index].pool = pool;
+            pool->workers[thread_index].thread_index = thread_index;
+            if(pthread_create(pool->threads + thread_index, 0, worker_proc, pool->workers + thread_index) != 0)
+            {
+                fprintf(stderr, "[Error] Unable to create worker thread %u\n", thread_index);
+                exit(1);
+            }
+        }
+    }
+}
+
+// NOTE: blocks until every task in [0, task_count) has run
+internal void thread_pool_dispatch(ThreadPool *pool, u32 task_count, thread_task *task, void *data)
+{
+    if(pool->thread_count <= 1)
+    {
+        for(u32 task_index = 0;
+            task_index < task_count;
+            ++task_index)
+        {
+            task(data, task_index, 0);
+        }
+        return;
+    }
+
+    u32 per_thread = task_count / pool->thread_count;
+    u32 extra = task_count % pool->thread_count;
+    u32 next = 0;
+    for(u32 thread_index = 0;
+        thread_index < pool->thread_count;
+        ++thread_index)
+    {
+        TaskRange *range = pool->ranges + thread_index;
+        range->next = next;
+        next += per_thread + ((thread_index < extra) ? 1 : 0);
+        range->end = next;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->task_data = data;
+    pool->busy_count = pool->thread_count;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->work_ready);
+    while(pool->busy_count > 0)
+    {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+internal void thread_pool_shutdown(ThreadPool *pool)
+{
+    if(pool->thread_count > 1)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        pool->quit = true;
+        pthread_cond_broadcast(&pool->work_ready);
+        pthread_mutex_unlock(&pool->mutex);
+
+        for(u32 thread_index = 0;
+            thread_index < pool->thread_count;
+            ++thread_index)
+        {
+            pthread_join(pool->threads[thread_index], 0);
+        }
+        heap_free(pool->threads);
+        heap_free(pool->workers);
+        heap_free(pool->ranges);
+    }
+    else
+    {
+        // NOTE: the calling thread ran the tasks, its scratch arena is the
+        // one thread_pool_init reserved (workers free their own on quit)
+        free_arena(&scratch_arena);
+    }
+    *pool = (ThreadPool){0};
+}
+
+#endif
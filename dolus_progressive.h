@@ -0,0 +1,228 @@
+#ifndef _H_DOLUSPROGRESSIVE
+#define _H_DOLUSPROGRESSIVE
+
+// NOTE: --progressive. The frame is traced in passes over a shrinking grid.
+// The first pass traces one pixel per coarse_step x coarse_step block and
+// fills the whole block with it, every following pass halves the step and
+// only traces the grid points the previous passes did not have, down to
+// step 1. The grid starts at each tile's corner so passes nest inside tiles.
+//
+// Every pixel gets traced exactly once with the same ray render_tile gives
+// it (or the same samples and paths render_tile_sampled gives it without
+// adaptive sampling), so after the last pass the image is the one render_image makes.
+//
+// A pass is dispatched a few tiles at a time. Between batches the callback
+// gets the framebuffer once per interval, and the tiles that showed the most
+// contrast in the previous pass are refined first, so edges sharpen before
+// the flat parts.
+
+typedef void progress_callback(ImageU32 *image, u32 step, f32 done, void *data);
+
+typedef struct
+{
+    RenderJob *job;
+    u32 step;
+    // NOTE: 0 on the first pass, nothing is traced yet
+    u32 previous_step;
+
+    u32 first_task;
+    u32 *tile_order;
+    u32 *tile_contrast;
+} ProgressiveJob;
+
+internal void render_progressive_tile(void *data, u32 task_index, u32 thread_index)
+{
+    ProgressiveJob *progressive = (ProgressiveJob *)data;
+    RenderJob *job = progressive->job;
+    ImageU32 *image = job->image;
+    u32 step = progressive->step;
+    u32 previous_step = progressive->previous_step;
+
+    u32 tile_index = progressive->tile_order[progressive->first_task + task_index];
+    u32 min_x = (tile_index % job->tile_count_x) * job->tile_size;
+    u32 min_row = (tile_index / job->tile_count_x) * job->tile_size;
+    u32 max_x = min_x + job->tile_size;
+    u32 max_row = min_row + job->tile_size;
+    if(max_x > image->width)
+    {
+        max_x = image->width;
+    }
+    if(max_row > image->height)
+    {
+        max_row = image->height;
+    }
+
+    for(u32 row = min_row;
+        row < max_row;
+        row += step)
+    {
+        u32 y = image->height - 1 - row;
+        u32 block_max_row = (row + step < max_row) ? (row + step) : max_row;
+        for(u32 x = min_x;
+            x < max_x;
+            x += step)
+        {
+            u32 local_x = x - min_x;
+            u32 local_row = row - min_row;
+            if(previous_step && (local_x % previous_step) == 0 && (local_row % previous_step) == 0)
+            {
+                continue;
+            }
+
+            u32 color;
+            if(uses_sample_pixel(job))
+            {
+                v3 sum = sample_pixel(job, x, y, 0, job->samples_per_pixel);
+                color = pack_color_little(v3_scalar_mul(sum, 1.0f / (f32)job->samples_per_pixel));
+            }
+            else
+            {
+                // NOTE: the same ray render_tile's generate_ray_row gives it
+                BEGIN_PHASE(ray_gen);
+                Ray ray = generate_ray(&job->rays, x, y);
+                END_PHASE(ray_gen, Phase_RayGen);
+                ++thread_stats.primary_rays;
+                color = trace_pixel(job, &ray);
+            }
+
+            // NOTE: the block never covers an earlier grid point, those only
+            // sit on multiples of 2*step
+            u32 block_max_x = (x + step < max_x) ? (x + step) : max_x;
+            for(u32 fill_row = row;
+                fill_row < block_max_row;
+                ++fill_row)
+            {
+                u32 *Out = image->pixels + fill_row * image->width;
+                for(u32 fill_x = x;
+                    fill_x < block_max_x;
+                    ++fill_x)
+                {
+                    Out[fill_x] = color;
+                }
+            }
+        }
+    }
+
+    // NOTE: contrast = summed per channel range over every grid point traced
+    // so far, decides the order of the next pass
+    u32 low[3] = {255, 255, 255};
+    u32 high[3] = {0, 0, 0};
+    for(u32 row = min_row;
+        row < max_row;
+        row += step)
+    {
+        for(u32 x = min_x;
+            x < max_x;
+            x += step)
+        {
+            u32 pixel = image->pixels[row * image->width + x];
+            for(u32 channel = 0; channel < 3; ++channel)
+            {
+                u32 value = (pixel >> (8 * channel)) & 0xFF;
+                low[channel] = (value < low[channel]) ? value : low[channel];
+                high[channel] = (value > high[channel]) ? value : high[channel];
+            }
+        }
+    }
+    progressive->tile_contrast[tile_index] = (high[0] - low[0]) + (high[1] - low[1]) + (high[2] - low[2]);
+
+    fold_thread_stats(&job->stats);
+}
+
+internal int compare_u64(const void *a, const void *b)
+{
+    u64 A = *(u64 *)a;
+    u64 B = *(u64 *)b;
+    return((A > B) - (A < B));
+}
+
+// NOTE: highest contrast first, ties by tile index so the order (and with it
+// the batches) does not depend on qsort
+internal void order_tiles_by_contrast(u32 tile_count, u32 *contrast, u32 *order)
+{
+    TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+    u64 *keys = PUSH_ARRAY(&scratch_arena, tile_count, u64);
+    for(u32 tile_index = 0;
+        tile_index < tile_count;
+        ++tile_index)
+    {
+        keys[tile_index] = ((u64)(0xFFFFFFFFu - contrast[tile_index]) << 32) | tile_index;
+    }
+    qsort(keys, tile_count, sizeof(u64), compare_u64);
+    for(u32 index = 0;
+        index < tile_count;
+        ++index)
+    {
+        order[index] = (u32)keys[index];
+    }
+    end_temporary_memory(temp);
+}
+
+// NOTE: coarse_step is rounded down to a power of two. The callback always
+// sees the finished first pass, after that at most once per interval; the
+// final image is left in job->image for the caller.
+internal void render_progressive(ThreadPool *pool, RenderJob *job, u32 coarse_step, f64 interval,
+                                 progress_callback *callback, void *callback_data)
+{
+    begin_render(job, job->image->width, job->image->height);
+
+    u32 step = 1;
+    while(step * 2 <= coarse_step)
+    {
+        step *= 2;
+    }
+
+    u32 tile_count = job->tile_count_x * job->tile_count_y;
+    ProgressiveJob progressive = {};
+    progressive.job = job;
+    progressive.tile_order = PUSH_ARRAY(&job->frame_arena, tile_count, u32);
+    progressive.tile_contrast = PUSH_ARRAY(&job->frame_arena, tile_count, u32);
+    memset(progressive.tile_contrast, 0, tile_count * sizeof(u32));
+    for(u32 tile_index = 0;
+        tile_index < tile_count;
+        ++tile_index)
+    {
+        progressive.tile_order[tile_index] = tile_index;
+    }
+
+    // NOTE: small batches so the interval is kept reasonably well, big
+    // enough that every worker has something to steal
+    u32 batch_size = pool->thread_count * 4;
+    f32 pixel_count = (f32)job->image->width * (f32)job->image->height * (f32)job->samples_per_pixel;
+    f64 last_callback = get_wall_clock();
+
+    for(u32 previous_step = 0;
+        step >= 1;
+        previous_step = step, step /= 2)
+    {
+        progressive.step = step;
+        progressive.previous_step = previous_step;
+        bool first_pass = (previous_step == 0);
+
+        for(u32 first_task = 0;
+            first_task < tile_count;
+            first_task += batch_size)
+        {
+            u32 task_count = (tile_count - first_task < batch_size) ? (tile_count - first_task) : batch_size;
+            progressive.first_task = first_task;
+            dispatch_tiles(pool, task_count, render_progressive_tile, &progressive);
+
+            bool finished = (step == 1) && (first_task + task_count == tile_count);
+            if(callback && !finished && !first_pass && (get_wall_clock() - last_callback) >= interval)
+            {
+                callback(job->image, step, job->stats.primary_rays / pixel_count, callback_data);
+                last_callback = get_wall_clock();
+            }
+        }
+
+        if(callback && first_pass && step > 1)
+        {
+            callback(job->image, step, job->stats.primary_rays / pixel_count, callback_data);
+            last_callback = get_wall_clock();
+        }
+
+        order_tiles_by_contrast(tile_count, progressive.tile_contrast, progressive.tile_order);
+    }
+}
+
+#endif
@@ -0,0 +1,1322 @@
+#ifndef _H_DOLUSSCENE
+#define _H_DOLUSSCENE
+
+// NOTE: Text scene files. One statement per line, '#' starts a comment.
+//
+//   image <width> <height>
+//   background <r> <g> <b>
+//   camera fov <degrees> from <x y z> to <x y z> up <x y z>
+//   material <name> [material fields]
+//   light [point] position <x y z> intensity <r g b> [falloff]
+//   light rect position <x y z> edge_u <x y z> edge_v <x y z> intensity <r g b> [samples n] [falloff]
+//   light sphere position <x y z> radius <f> intensity <r g b> [samples n] [falloff]
+//   sphere [material <name>] [material fields] [transforms]
+//   plane [material <name>] [material fields] [transforms]
+//   cube [material <name>] [material fields] [transforms]
+//   cylinder [minimum f] [maximum f] [closed] [material <name>] [material fields] [transforms]
+//   triangle <x y z> <x y z> <x y z> [material <name>] [material fields] [transforms]
+//   mesh <name> <file.obj>
+//   instance <mesh name> [material <name>] [material fields] [transforms]
+//
+// material fields:  color r g b | ambient f | diffuse f | specular f | shininess f |
+//                   reflective f | transparency f | refractive_index f
+// transforms:       translate x y z | scale x y z | rotate_x deg | rotate_y deg |
+//                   rotate_z deg | matrix m00 m01 ... m33 (row major)
+//
+// Transforms multiply left to right, so "translate ... scale ..." is
+// translation * scale like the code would write it (scale happens first).
+// A shape starts from the named material (or material()) and any fields on
+// its own line override that. Shapes that only name a material share it,
+// World.materials gets one entry per named material in use plus one per
+// shape with fields of its own. Spheres, cubes and cylinders are the unit
+// shape in object space (see dolus.h), a plane is y = 0 and a triangle's
+// transforms move its vertices. A mesh statement loads an obj file (path
+// relative to the scene file) once, every instance of it places the same
+// triangles with its own transforms and material.
+//
+// Area lights are centred on position: a rect spans edge_u by edge_v
+// (default 1 by 1, horizontal), a sphere has radius (default 0.5). Both
+// take 16 shadow samples unless samples says otherwise, from 1 up to
+// AREA_LIGHT_MAX_SAMPLES; the count is rounded up to a square grid, so
+// samples 5 traces 9 rays. With falloff the intensity is what the light
+// gives at distance 0 and drops with 1 / (1 + distance^2), so it can be
+// culled where it is too dim to matter.
+//
+// The parser is a single pass over the file in memory: no tokens are copied,
+// numbers are parsed in place and spheres/lights go straight into growing
+// contiguous arrays that become World.spheres / World.lights.
+
+typedef struct
+{
+    u32 width;
+    u32 height;
+    f32 field_of_view;
+    v4 from;
+    v4 to;
+    v4 up;
+    v3 background;
+} SceneView;
+
+internal SceneView default_view()
+{
+    SceneView result = {};
+    result.width = 1280;
+    result.height = 750;
+    result.field_of_view = PI32/3;
+    result.from = Point(0.0f, 1.5f, -5.0f);
+    result.to = Point(0.0f, 1.0f, 0.0f);
+    result.up = Vector(0.0f, 1.0f, 0.0f);
+    result.background = V3(0.0f, 0.0f, 0.0f);
+    return(result);
+}
+
+internal Camera view_camera(SceneView *view)
+{
+    Camera result = camera(view->width, view->height, view->field_of_view);
+    result.transform = view_transform(view->from, view->to, view->up);
+    return(result);
+}
+
+// NOTE: table_index is where this material went in the world's table the
+// first time a shape used it as is, -1 until then and again after a later
+// material statement changes it
+typedef struct
+{
+    char name[32];
+    Material material;
+    i32 table_index;
+} NamedMaterial;
+
+typedef struct
+{
+    char *at;
+    char *end;
+    char *filename;
+    u32 line;
+    bool error;
+
+    u32 material_count;
+    u32 material_capacity;
+    NamedMaterial *materials;
+
+    u32 table_count;
+    u32 table_capacity;
+    Material *table;
+
+    u32 sphere_count;
+    u32 sphere_capacity;
+    Sphere *spheres;
+
+    u32 plane_count;
+    u32 plane_capacity;
+    Plane *planes;
+
+    u32 cube_count;
+    u32 cube_capacity;
+    Cube *cubes;
+
+    u32 cylinder_count;
+    u32 cylinder_capacity;
+    Cylinder *cylinders;
+
+    u32 triangle_count;
+    u32 triangle_capacity;
+    Triangle *triangles;
+
+    MeshBuffer meshes;
+    u32 instance_count;
+    u32 instance_capacity;
+    MeshInstance *instances;
+
+    u32 light_count;
+    u32 light_capacity;
+    Light *lights;
+} SceneParser;
+
+typedef struct
+{
+    char *at;
+    u32 length;
+} Token;
+
+internal void scene_error(SceneParser *parser, char *message, Token token)
+{
+    if(!parser->error)
+    {
+        fprintf(stderr, "[Error] %s:%u: %s '%.*s'\n", parser->filename, parser->line, message,
+                (int)token.length, token.at ? token.at : "");
+    }
+    parser->error = true;
+}
+
+internal void skip_blanks(SceneParser *parser)
+{
+    char *at = parser->at;
+    while(at < parser->end)
+    {
+        if(*at == ' ' || *at == '\t' || *at == '\r')
+        {
+            ++at;
+        }
+        else if(*at == '#')
+        {
+            while(at < parser->end && *at != '\n')
+            {
+                ++at;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    parser->at = at;
+}
+
+internal bool at_line_end(SceneParser *parser)
+{
+    skip_blanks(parser);
+    bool result = (parser->at >= parser->end) || (*parser->at == '\n');
+    return(result);
+}
+
+internal Token next_token(SceneParser *parser)
+{
+    skip_blanks(parser);
+    Token result = {};
+    result.at = parser->at;
+    char *at = parser->at;
+    while(at < parser->end && *at != ' ' && *at != '\t' && *at != '\r' && *at != '\n' && *at != '#')
+    {
+        ++at;
+    }
+    result.length = (u32)(at - parser->at);
+    parser->at = at;
+    return(result);
+}
+
+extern inline bool token_is(Token token, char *word)
+{
+    u32 length = (u32)strlen(word);
+    bool result = (token.length == length) && (memcmp(token.at, word, length) == 0);
+    return(result);
+}
+
+// NOTE: no f32 comes anywhere near this, bigger exponents only have to
+// stay inf or 0 and not overflow the i32 they are collected in
+#define PARSE_MAX_EXPONENT 100000
+
+// NOTE: decimal/exponent notation. Digits accumulate into a u64 and the
+// power of ten is applied once in f64, which is exact for anything a human
+// or %.9g writes. Numbers too big for an f32 come out as inf, see
+// expect_f32.
+internal bool parse_f32(Token token, f32 *value)
+{
+    static f64 powers_of_ten[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    char *at = token.at;
+    char *end = token.at + token.length;
+    bool negative = false;
+    if(at < end && (*at == '-' || *at == '+'))
+    {
+        negative = (*at == '-');
+        ++at;
+    }
+
+    u64 mantissa = 0;
+    i32 exponent = 0;
+    u32 digits = 0;
+    while(at < end && *at >= '0' && *at <= '9')
+    {
+        if(mantissa < 100000000000000000ull)
+        {
+            mantissa = mantissa * 10 + (*at - '0');
+        }
+        else if(exponent < PARSE_MAX_EXPONENT)
+        {
+            ++exponent;
+        }
+        ++digits;
+        ++at;
+    }
+    if(at < end && *at == '.')
+    {
+        ++at;
+        while(at < end && *at >= '0' && *at <= '9')
+        {
+            if(mantissa < 100000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (*at - '0');
+                --exponent;
+            }
+            ++digits;
+            ++at;
+        }
+    }
+    if(digits == 0)
+    {
+        return(false);
+    }
+    if(at < end && (*at == 'e' || *at == 'E'))
+    {
+        ++at;
+        bool negative_exponent = false;
+        if(at < end && (*at == '-' || *at == '+'))
+        {
+            negative_exponent = (*at == '-');
+            ++at;
+        }
+        i32 e = 0;
+        u32 exponent_digits = 0;
+        while(at < end && *at >= '0' && *at <= '9')
+        {
+            if(e < PARSE_MAX_EXPONENT)
+            {
+                e = e * 10 + (*at - '0');
+            }
+            ++exponent_digits;
+            ++at;
+        }
+        if(exponent_digits == 0)
+        {
+            return(false);
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+    if(at != end)
+    {
+        return(false);
+    }
+
+    f64 result = (f64)mantissa;
+    if(exponent < 0)
+    {
+        result = (-exponent <= 22) ? (result / powers_of_ten[-exponent]) : (result * pow(10.0, exponent));
+    }
+    else if(exponent > 0)
+    {
+        result = (exponent <= 22) ? (result * powers_of_ten[exponent]) : (result * pow(10.0, exponent));
+    }
+    *value = (f32)(negative ? -result : result);
+    return(true);
+}
+
+internal f32 expect_f32(SceneParser *parser)
+{
+    f32 result = 0.0f;
+    Token token = next_token(parser);
+    if(!parse_f32(token, &result))
+    {
+        scene_error(parser, "expected a number, got", token);
+    }
+    else if(isinf(result))
+    {
+        scene_error(parser, "number out of range", token);
+        result = 0.0f;
+    }
+    return(result);
+}
+
+internal v3 expect_v3(SceneParser *parser)
+{
+    v3 result = {};
+    result.x = expect_f32(parser);
+    result.y = expect_f32(parser);
+    result.z = expect_f32(parser);
+    return(result);
+}
+
+// NOTE: a whole number from 0 to 2^32 - 1, written any way expect_f32 takes
+internal u32 expect_u32(SceneParser *parser)
+{
+    u32 result = 0;
+    f32 value;
+    Token token = next_token(parser);
+    if(!parse_f32(token, &value))
+    {
+        scene_error(parser, "expected a number, got", token);
+    }
+    else if(!(value >= 0.0f && value < 4294967296.0f) || value != floorf(value))
+    {
+        scene_error(parser, "expected an integer from 0 to 4294967295, got", token);
+    }
+    else
+    {
+        result = (u32)value;
+    }
+    return(result);
+}
+
+internal f32 degrees_to_radians(f32 degrees)
+{
+    return(degrees * (PI32 / 180.0f));
+}
+
+// NOTE: index into parser->meshes, or -1
+internal i32 find_mesh(SceneParser *parser, Token name)
+{
+    for(u32 index = 0;
+        index < parser->meshes.mesh_count;
+        ++index)
+    {
+        Mesh *mesh = parser->meshes.meshes + index;
+        if(strlen(mesh->name) == name.length && memcmp(mesh->name, name.at, name.length) == 0)
+        {
+            return((i32)index);
+        }
+    }
+    return(-1);
+}
+
+internal NamedMaterial *find_material(SceneParser *parser, Token name)
+{
+    for(u32 index = 0;
+        index < parser->material_count;
+        ++index)
+    {
+        NamedMaterial *entry = parser->materials + index;
+        if(strlen(entry->name) == name.length && memcmp(entry->name, name.at, name.length) == 0)
+        {
+            return(entry);
+        }
+    }
+    return(0);
+}
+
+
+// NOTE: returns false if the token is not a material field
+internal bool parse_material_field(SceneParser *parser, Token field, Material *material)
+{
+    bool result = true;
+    if(token_is(field, "color"))
+    {
+        material->color = expect_v3(parser);
+    }
+    else if(token_is(field, "ambient"))
+    {
+        material->ambient = expect_f32(parser);
+    }
+    else if(token_is(field, "diffuse"))
+    {
+        material->diffuse = expect_f32(parser);
+    }
+    else if(token_is(field, "specular"))
+    {
+        material->specular = expect_f32(parser);
+    }
+    else if(token_is(field, "shininess"))
+    {
+        material->shininess = expect_f32(parser);
+    }
+    else if(token_is(field, "reflective"))
+    {
+        material->reflective = expect_f32(parser);
+    }
+    else if(token_is(field, "transparency"))
+    {
+        material->transparency = expect_f32(parser);
+    }
+    else if(token_is(field, "refractive_index"))
+    {
+        material->refractive_index = expect_f32(parser);
+    }
+    else
+    {
+        result = false;
+    }
+    return(result);
+}
+
+// NOTE: returns false if the token is not a transform
+internal bool parse_transform(SceneParser *parser, Token op, m4x4 *transform)
+{
+    m4x4 next = {};
+    if(token_is(op, "translate"))
+    {
+        next = m4x4_translation_matrix(expect_v3(parser));
+    }
+    else if(token_is(op, "scale"))
+    {
+        next = m4x4_scale_matrix(expect_v3(parser));
+    }
+    else if(token_is(op, "rotate_x"))
+    {
+        next = m4x4_rotateX_matrix(degrees_to_radians(expect_f32(parser)));
+    }
+    else if(token_is(op, "rotate_y"))
+    {
+        next = m4x4_rotateY_matrix(degrees_to_radians(expect_f32(parser)));
+    }
+    else if(token_is(op, "rotate_z"))
+    {
+        next = m4x4_rotateZ_matrix(degrees_to_radians(expect_f32(parser)));
+    }
+    else if(token_is(op, "matrix"))
+    {
+        for(u32 row = 0; row < 4; ++row)
+        {
+            next.rows[row].x = expect_f32(parser);
+            next.rows[row].y = expect_f32(parser);
+            next.rows[row].z = expect_f32(parser);
+            next.rows[row].w = expect_f32(parser);
+        }
+    }
+    else
+    {
+        return(false);
+    }
+    *transform = m4x4_mul(*transform, next);
+    return(true);
+}
+
+// NOTE: heap_realloc exits when out of memory, array is never left 0
+#define GROW_ARRAY(array, count, capacity, type) \
+    if((count) == (capacity)) \
+    { \
+        (capacity) = (capacity) ? 2 * (capacity) : 64; \
+        (array) = (type *)heap_realloc((array), (capacity) * sizeof(type)); \
+    }
+
+internal u32 add_table_material(SceneParser *parser, Material material)
+{
+    GROW_ARRAY(parser->table, parser->table_count, parser->table_capacity, Material);
+    u32 result = parser->table_count++;
+    parser->table[result] = material;
+    return(result);
+}
+
+// NOTE: optional sign and decimal digits, nothing else
+internal bool parse_i32(Token token, i32 *value)
+{
+    char *at = token.at;
+    char *end = token.at + token.length;
+    bool negative = false;
+    if(at < end && (*at == '-' || *at == '+'))
+    {
+        negative = (*at == '-');
+        ++at;
+    }
+    if(at == end)
+    {
+        return(false);
+    }
+    i64 result = 0;
+    while(at < end && *at >= '0' && *at <= '9' && result <= 0x7fffffff)
+    {
+        result = result * 10 + (*at - '0');
+        ++at;
+    }
+    if(at != end || result > 0x7fffffff)
+    {
+        return(false);
+    }
+    *value = (i32)(negative ? -result : result);
+    return(true);
+}
+
+internal void skip_line(SceneParser *parser)
+{
+    while(parser->at < parser->end && *parser->at != '\n')
+    {
+        ++parser->at;
+    }
+}
+
+internal char *read_text_file(char *filename, u64 *length)
+{
+    FILE *file = fopen(filename, "rb");
+    if(!file)
+    {
+        return(0);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = (char *)heap_alloc(size + 1);
+    size_t read = fread(text, 1, size, file);
+    fclose(file);
+    text[read] = 0;
+    *length = read;
+    return(text);
+}
+
+// NOTE: Wavefront obj, positions and faces only. Faces with more than three
+// corners are fanned from their first corner, the texture and normal parts
+// of a corner (v/t/n) and every other statement are skipped. Indices are
+// 1 based, negative ones count back from the last vertex read. The mesh is
+// added to buffer with its blas built.
+internal bool load_obj(char *filename, MeshBuffer *buffer, Token name)
+{
+    u64 length = 0;
+    char *text = read_text_file(filename, &length);
+    if(!text)
+    {
+        fprintf(stderr, "[Error] Unable to open mesh %s\n", filename);
+        return(false);
+    }
+
+    SceneParser parser = {};
+    parser.at = text;
+    parser.end = text + length;
+    parser.filename = filename;
+    parser.line = 1;
+
+    u32 first_vertex = begin_mesh(buffer, name.at, name.length)->first_vertex;
+    while(!parser.error && parser.at < parser.end)
+    {
+        Token keyword = next_token(&parser);
+        if(token_is(keyword, "v"))
+        {
+            add_mesh_vertex(buffer, expect_v3(&parser));
+            // NOTE: w or vertex colors may follow
+            skip_line(&parser);
+        }
+        else if(token_is(keyword, "f"))
+        {
+            u32 corners[2] = {};
+            u32 corner_count = 0;
+            while(!parser.error && !at_line_end(&parser))
+            {
+                Token corner = next_token(&parser);
+                Token position = corner;
+                position.length = 0;
+                while(position.length < corner.length && corner.at[position.length] != '/')
+                {
+                    ++position.length;
+                }
+
+                i32 index = 0;
+                i32 vertex_count = (i32)(buffer->vertex_count - first_vertex);
+                if(!parse_i32(position, &index) || index == 0)
+                {
+                    scene_error(&parser, "bad face corner", corner);
+                    break;
+                }
+                index = (index > 0) ? (index - 1) : (vertex_count + index);
+                if(index < 0 || index >= vertex_count)
+                {
+                    scene_error(&parser, "vertex index out of range", corner);
+                    break;
+                }
+
+                if(corner_count < 2)
+                {
+                    corners[corner_count] = (u32)index;
+                }
+                else
+                {
+                    add_mesh_triangle(buffer, corners[0], corners[1], (u32)index);
+                    corners[1] = (u32)index;
+                }
+                ++corner_count;
+            }
+            if(!parser.error && corner_count < 3)
+            {
+                scene_error(&parser, "face needs at least three corners", keyword);
+            }
+        }
+        else
+        {
+            skip_line(&parser);
+        }
+
+        if(parser.at < parser.end && *parser.at == '\n')
+        {
+            ++parser.at;
+            ++parser.line;
+        }
+    }
+    heap_free(text);
+
+    if(!parser.error)
+    {
+        finish_mesh(buffer);
+    }
+    return(!parser.error);
+}
+
+// NOTE: paths inside a scene are relative to the scene file
+internal void scene_relative_path(char *scene_filename, Token path, char *result, u32 result_size)
+{
+    char *slash = strrchr(scene_filename, '/');
+    if(path.length > 0 && path.at[0] != '/' && slash)
+    {
+        snprintf(result, result_size, "%.*s/%.*s", (int)(slash - scene_filename), scene_filename, (int)path.length, path.at);
+    }
+    else
+    {
+        snprintf(result, result_size, "%.*s", (int)path.length, path.at);
+    }
+}
+
+internal void parse_statement(SceneParser *parser, SceneView *view)
+{
+    Token keyword = next_token(parser);
+    if(keyword.length == 0)
+    {
+        return;
+    }
+
+    bool is_sphere = token_is(keyword, "sphere");
+    bool is_plane = token_is(keyword, "plane");
+    bool is_cube = token_is(keyword, "cube");
+    bool is_cylinder = token_is(keyword, "cylinder");
+    bool is_triangle = token_is(keyword, "triangle");
+    bool is_instance = token_is(keyword, "instance");
+    if(is_sphere || is_plane || is_cube || is_cylinder || is_triangle || is_instance)
+    {
+        v3 vertices[3] = {};
+        if(is_triangle)
+        {
+            for(u32 vertex = 0; vertex < 3; ++vertex)
+            {
+                vertices[vertex] = expect_v3(parser);
+            }
+        }
+        i32 mesh_index = 0;
+        if(is_instance)
+        {
+            Token name = next_token(parser);
+            mesh_index = find_mesh(parser, name);
+            if(mesh_index < 0)
+            {
+                scene_error(parser, "unknown mesh", name);
+                return;
+            }
+        }
+
+        // NOTE: a shape that only names a material shares its table entry,
+        // one with fields of its own gets a new entry
+        NamedMaterial *named = 0;
+        bool own_fields = false;
+        Material material_value = material();
+        m4x4 transform = m4x4_identity();
+        f32 minimum = -INFINITY;
+        f32 maximum = INFINITY;
+        bool closed = false;
+        while(!parser->error && !at_line_end(parser))
+        {
+            Token field = next_token(parser);
+            if(token_is(field, "material"))
+            {
+                Token name = next_token(parser);
+                named = find_material(parser, name);
+                if(!named)
+                {
+                    scene_error(parser, "unknown material", name);
+                    break;
+                }
+                material_value = named->material;
+            }
+            else if(is_cylinder && token_is(field, "minimum"))
+            {
+                minimum = expect_f32(parser);
+            }
+            else if(is_cylinder && token_is(field, "maximum"))
+            {
+                maximum = expect_f32(parser);
+            }
+            else if(is_cylinder && token_is(field, "closed"))
+            {
+                closed = true;
+            }
+            else if(parse_material_field(parser, field, &material_value))
+            {
+                own_fields = true;
+            }
+            else if(!parse_transform(parser, field, &transform))
+            {
+                scene_error(parser, "unknown shape field", field);
+            }
+        }
+
+        u32 material_index = DEFAULT_MATERIAL;
+        if(own_fields)
+        {
+            material_index = add_table_material(parser, material_value);
+        }
+        else if(named)
+        {
+            if(named->table_index < 0)
+            {
+                named->table_index = (i32)add_table_material(parser, named->material);
+            }
+            material_index = (u32)named->table_index;
+        }
+
+        if(is_sphere)
+        {
+            GROW_ARRAY(parser->spheres, parser->sphere_count, parser->sphere_capacity, Sphere);
+            Sphere *s = parser->spheres + parser->sphere_count++;
+            *s = sphere(origin(), 1.0f);
+            s->material_index = material_index;
+            set_sphere_transform(s, transform);
+        }
+        else if(is_plane)
+        {
+            GROW_ARRAY(parser->planes, parser->plane_count, parser->plane_capacity, Plane);
+            Plane *p = parser->planes + parser->plane_count++;
+            *p = plane(transform);
+            p->material_index = material_index;
+        }
+        else if(is_cube)
+        {
+            GROW_ARRAY(parser->cubes, parser->cube_count, parser->cube_capacity, Cube);
+            Cube *c = parser->cubes + parser->cube_count++;
+            *c = cube(transform);
+            c->material_index = material_index;
+        }
+        else if(is_cylinder)
+        {
+            GROW_ARRAY(parser->cylinders, parser->cylinder_count, parser->cylinder_capacity, Cylinder);
+            Cylinder *c = parser->cylinders + parser->cylinder_count++;
+            *c = cylinder(transform, minimum, maximum, closed);
+            c->material_index = material_index;
+        }
+        else if(is_instance)
+        {
+            GROW_ARRAY(parser->instances, parser->instance_count, parser->instance_capacity, MeshInstance);
+            MeshInstance *instance = parser->instances + parser->instance_count++;
+            *instance = mesh_instance((u32)mesh_index, transform);
+            instance->material_index = material_index;
+        }
+        else
+        {
+            v4 points[3];
+            for(u32 vertex = 0; vertex < 3; ++vertex)
+            {
+                points[vertex] = m4x4_mul_v4(transform, Point(vertices[vertex].x, vertices[vertex].y, vertices[vertex].z));
+            }
+            GROW_ARRAY(parser->triangles, parser->triangle_count, parser->triangle_capacity, Triangle);
+            Triangle *t = parser->triangles + parser->triangle_count++;
+            *t = triangle(points[0], points[1], points[2]);
+            t->material_index = material_index;
+        }
+    }
+    else if(token_is(keyword, "mesh"))
+    {
+        Token name = next_token(parser);
+        Token path = next_token(parser);
+        if(name.length == 0 || name.length >= sizeof(parser->meshes.meshes[0].name))
+        {
+            scene_error(parser, "bad mesh name", name);
+            return;
+        }
+        if(find_mesh(parser, name) >= 0)
+        {
+            scene_error(parser, "mesh defined twice", name);
+            return;
+        }
+        if(path.length == 0)
+        {
+            scene_error(parser, "mesh needs an obj file", name);
+            return;
+        }
+        char obj_filename[1024];
+        scene_relative_path(parser->filename, path, obj_filename, sizeof(obj_filename));
+        if(!load_obj(obj_filename, &parser->meshes, name))
+        {
+            parser->error = true;
+            return;
+        }
+    }
+    else if(token_is(keyword, "material"))
+    {
+        Token name = next_token(parser);
+        if(name.length == 0 || name.length >= sizeof(parser->materials[0].name))
+        {
+            scene_error(parser, "bad material name", name);
+            return;
+        }
+        NamedMaterial *entry = find_material(parser, name);
+        if(!entry)
+        {
+            GROW_ARRAY(parser->materials, parser->material_count, parser->material_capacity, NamedMaterial);
+            entry = parser->materials + parser->material_count++;
+            memcpy(entry->name, name.at, name.length);
+            entry->name[name.length] = 0;
+            entry->material = material();
+        }
+        // NOTE: shapes before this line keep the old values
+        entry->table_index = -1;
+        while(!parser->error && !at_line_end(parser))
+        {
+            Token field = next_token(parser);
+            if(!parse_material_field(parser, field, &entry->material))
+            {
+                scene_error(parser, "unknown material field", field);
+            }
+        }
+    }
+    else if(token_is(keyword, "light"))
+    {
+        Light light = point_light(Point(0.0f, 0.0f, 0.0f), V3(1.0f, 1.0f, 1.0f));
+        char *type_at = parser->at;
+        Token type = next_token(parser);
+        if(token_is(type, "rect"))
+        {
+            light = rect_light(light.position, Vector(1.0f, 0.0f, 0.0f), Vector(0.0f, 0.0f, 1.0f), light.intensity);
+        }
+        else if(token_is(type, "sphere"))
+        {
+            light = sphere_light(light.position, 0.5f, light.intensity);
+        }
+        else if(!token_is(type, "point"))
+        {
+            // NOTE: no type, a point light like before there were others
+            parser->at = type_at;
+        }
+
+        while(!parser->error && !at_line_end(parser))
+        {
+            Token field = next_token(parser);
+            if(token_is(field, "position"))
+            {
+                v3 p = expect_v3(parser);
+                light.position = Point(p.x, p.y, p.z);
+            }
+            else if(token_is(field, "intensity"))
+            {
+                light.intensity = expect_v3(parser);
+            }
+            else if(light.type == Light_Rect && token_is(field, "edge_u"))
+            {
+                v3 v = expect_v3(parser);
+                light.edge_u = Vector(v.x, v.y, v.z);
+            }
+            else if(light.type == Light_Rect && token_is(field, "edge_v"))
+            {
+                v3 v = expect_v3(parser);
+                light.edge_v = Vector(v.x, v.y, v.z);
+            }
+            else if(light.type == Light_Sphere && token_is(field, "radius"))
+            {
+                light.radius = expect_f32(parser);
+            }
+            else if(light.type != Light_Point && token_is(field, "samples"))
+            {
+                light.samples = expect_u32(parser);
+                if(!parser->error && (light.samples == 0 || light.samples > AREA_LIGHT_MAX_SAMPLES))
+                {
+                    scene_error(parser, "light samples must be from 1 to 1024", field);
+                }
+            }
+            else if(token_is(field, "falloff"))
+            {
+                light.falloff = 1;
+            }
+            else
+            {
+                scene_error(parser, "unknown light field", field);
+            }
+        }
+        GROW_ARRAY(parser->lights, parser->light_count, parser->light_capacity, Light);
+        parser->lights[parser->light_count++] = light;
+    }
+    else if(token_is(keyword, "camera"))
+    {
+        while(!parser->error && !at_line_end(parser))
+        {
+            Token field = next_token(parser);
+            if(token_is(field, "fov"))
+            {
+                view->field_of_view = degrees_to_radians(expect_f32(parser));
+            }
+            else if(token_is(field, "from"))
+            {
+                v3 p = expect_v3(parser);
+                view->from = Point(p.x, p.y, p.z);
+            }
+            else if(token_is(field, "to"))
+            {
+                v3 p = expect_v3(parser);
+                view->to = Point(p.x, p.y, p.z);
+            }
+            else if(token_is(field, "up"))
+            {
+                v3 v = expect_v3(parser);
+                view->up = Vector(v.x, v.y, v.z);
+            }
+            else
+            {
+                scene_error(parser, "unknown camera field", field);
+            }
+        }
+    }
+    else if(token_is(keyword, "image"))
+    {
+        view->width = expect_u32(parser);
+        view->height = expect_u32(parser);
+        if(!parser->error && (view->width == 0 || view->height == 0))
+        {
+            scene_error(parser, "image size must not be zero", keyword);
+        }
+    }
+    else if(token_is(keyword, "background"))
+    {
+        view->background = expect_v3(parser);
+    }
+    else
+    {
+        scene_error(parser, "unknown statement", keyword);
+    }
+
+    if(!parser->error && !at_line_end(parser))
+    {
+        Token extra = next_token(parser);
+        scene_error(parser, "unexpected", extra);
+    }
+}
+
+// NOTE: on success world is a new world with the shape/light arrays in its
+// arena (meshes come with their blas, there is no sphere bvh or tlas yet)
+// and view the image/camera/background. On failure nothing is touched.
+internal bool load_scene(char *filename, World *world, SceneView *view)
+{
+    u64 read = 0;
+    char *text = read_text_file(filename, &read);
+    if(!text)
+    {
+        fprintf(stderr, "[Error] Unable to open scene %s\n", filename);
+        return(false);
+    }
+
+    SceneParser parser = {};
+    parser.at = text;
+    parser.end = text + read;
+    parser.filename = filename;
+    parser.line = 1;
+    add_table_material(&parser, material());
+
+    SceneView parsed_view = default_view();
+    while(!parser.error && parser.at < parser.end)
+    {
+        parse_statement(&parser, &parsed_view);
+        if(parser.at < parser.end && *parser.at == '\n')
+        {
+            ++parser.at;
+            ++parser.line;
+        }
+    }
+    heap_free(text);
+    heap_free(parser.materials);
+
+    // NOTE: the world gets exact copies, without the slack from doubling
+    bool result = !parser.error;
+    if(result)
+    {
+        *world = (World){0};
+        MemoryArena *arena = &world->arena;
+        world->sphere_count = parser.sphere_count;
+        world->spheres = (Sphere *)push_copy(arena, parser.spheres, parser.sphere_count * sizeof(Sphere));
+        world->plane_count = parser.plane_count;
+        world->planes = (Plane *)push_copy(arena, parser.planes, parser.plane_count * sizeof(Plane));
+        world->cube_count = parser.cube_count;
+        world->cubes = (Cube *)push_copy(arena, parser.cubes, parser.cube_count * sizeof(Cube));
+        world->cylinder_count = parser.cylinder_count;
+        world->cylinders = (Cylinder *)push_copy(arena, parser.cylinders, parser.cylinder_count * sizeof(Cylinder));
+        world->triangle_count = parser.triangle_count;
+        world->triangles = (Triangle *)push_copy(arena, parser.triangles, parser.triangle_count * sizeof(Triangle));
+        mesh_buffer_to_world(&parser.meshes, world);
+        world->instance_count = parser.instance_count;
+        world->instances = (MeshInstance *)push_copy(arena, parser.instances, parser.instance_count * sizeof(MeshInstance));
+        world->material_count = parser.table_count;
+        world->materials = (Material *)push_copy(arena, parser.table, parser.table_count * sizeof(Material));
+        world->light_count = parser.light_count;
+        world->lights = (Light *)push_copy(arena, parser.lights, parser.light_count * sizeof(Light));
+        count_objects(world);
+        *view = parsed_view;
+    }
+
+    heap_free(parser.spheres);
+    heap_free(parser.planes);
+    heap_free(parser.cubes);
+    heap_free(parser.cylinders);
+    heap_free(parser.triangles);
+    free_mesh_buffer(&parser.meshes);
+    heap_free(parser.instances);
+    heap_free(parser.table);
+    heap_free(parser.lights);
+    return(result);
+}
+
+internal void write_material_fields(FILE *file, Material *m)
+{
+    Material defaults = material();
+    if(m->color.x != defaults.color.x || m->color.y != defaults.color.y || m->color.z != defaults.color.z)
+    {
+        fprintf(file, " color %.9g %.9g %.9g", m->color.x, m->color.y, m->color.z);
+    }
+    if(m->ambient != defaults.ambient)
+    {
+        fprintf(file, " ambient %.9g", m->ambient);
+    }
+    if(m->diffuse != defaults.diffuse)
+    {
+        fprintf(file, " diffuse %.9g", m->diffuse);
+    }
+    if(m->specular != defaults.specular)
+    {
+        fprintf(file, " specular %.9g", m->specular);
+    }
+    if(m->shininess != defaults.shininess)
+    {
+        fprintf(file, " shininess %.9g", m->shininess);
+    }
+    if(m->reflective != defaults.reflective)
+    {
+        fprintf(file, " reflective %.9g", m->reflective);
+    }
+    if(m->transparency != defaults.transparency)
+    {
+        fprintf(file, " transparency %.9g", m->transparency);
+    }
+    if(m->refractive_index != defaults.refractive_index)
+    {
+        fprintf(file, " refractive_index %.9g", m->refractive_index);
+    }
+}
+
+// NOTE: transforms without rotation as translate/scale, everything else as
+// the full matrix
+internal void write_transform(FILE *file, m4x4 m)
+{
+    bool axis_aligned = (m.rows[0].y == 0 && m.rows[0].z == 0 &&
+                         m.rows[1].x == 0 && m.rows[1].z == 0 &&
+                         m.rows[2].x == 0 && m.rows[2].y == 0 &&
+                         m.rows[3].x == 0 && m.rows[3].y == 0 && m.rows[3].z == 0 && m.rows[3].w == 1);
+    if(axis_aligned)
+    {
+        if(m.rows[0].w != 0 || m.rows[1].w != 0 || m.rows[2].w != 0)
+        {
+            fprintf(file, " translate %.9g %.9g %.9g", m.rows[0].w, m.rows[1].w, m.rows[2].w);
+        }
+        if(m.rows[0].x != 1 || m.rows[1].y != 1 || m.rows[2].z != 1)
+        {
+            fprintf(file, " scale %.9g %.9g %.9g", m.rows[0].x, m.rows[1].y, m.rows[2].z);
+        }
+    }
+    else
+    {
+        fprintf(file, " matrix");
+        for(u32 row = 0; row < 4; ++row)
+        {
+            fprintf(file, " %.9g %.9g %.9g %.9g", m.rows[row].x, m.rows[row].y, m.rows[row].z, m.rows[row].w);
+        }
+    }
+}
+
+internal bool write_obj(char *filename, World *world, Mesh *mesh)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+        return(false);
+    }
+
+    fprintf(file, "# dolus mesh %s, %u vertices, %u triangles\n", mesh->name, mesh->vertex_count, mesh->triangle_count);
+    v3 *vertices = world->mesh_vertices + mesh->first_vertex;
+    for(u32 vertex = 0;
+        vertex < mesh->vertex_count;
+        ++vertex)
+    {
+        fprintf(file, "v %.9g %.9g %.9g\n", vertices[vertex].x, vertices[vertex].y, vertices[vertex].z);
+    }
+    u32 *indices = world->mesh_indices + 3 * mesh->first_triangle;
+    for(u32 triangle = 0;
+        triangle < mesh->triangle_count;
+        ++triangle)
+    {
+        u32 *corner = indices + 3 * triangle;
+        fprintf(file, "f %u %u %u\n", corner[0] + 1, corner[1] + 1, corner[2] + 1);
+    }
+
+    bool result = (ferror(file) == 0);
+    fclose(file);
+    if(!result)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+    }
+    return(result);
+}
+
+// NOTE: shapes name table entries as m<index>, the default needs no name
+internal void write_material_name(FILE *file, u32 material_index)
+{
+    if(material_index != DEFAULT_MATERIAL)
+    {
+        fprintf(file, " material m%u", material_index);
+    }
+}
+
+// NOTE: dumps any World as a scene file. Every material table entry is
+// written as a named material and shapes refer to it, so shared materials
+// stay shared. %.9g round trips every f32.
+// Every mesh is written next to it as <scene>_<mesh name>.obj.
+internal bool write_scene(char *filename, World *world, SceneView *view)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "[Error] Unable to write to file %s\n", filename);
+        return(false);
+    }
+
+    fprintf(file, "# dolus scene, %u objects (%u spheres), %u lights\n",
+            world->object_count, world->sphere_count, world->light_count);
+    fprintf(file, "image %u %u\n", view->width, view->height);
+    fprintf(file, "background %.9g %.9g %.9g\n", view->background.x, view->background.y, view->background.z);
+    fprintf(file, "camera fov %.9g from %.9g %.9g %.9g to %.9g %.9g %.9g up %.9g %.9g %.9g\n",
+            view->field_of_view * (180.0f / PI32),
+            view->from.x, view->from.y, view->from.z,
+            view->to.x, view->to.y, view->to.z,
+            view->up.x, view->up.y, view->up.z);
+
+    for(u32 light_index = 0;
+        light_index < world->light_count;
+        ++light_index)
+    {
+        Light *light = world->lights + light_index;
+        fprintf(file, "light");
+        if(light->type == Light_Rect)
+        {
+            fprintf(file, " rect edge_u %.9g %.9g %.9g edge_v %.9g %.9g %.9g samples %u",
+                    light->edge_u.x, light->edge_u.y, light->edge_u.z,
+                    light->edge_v.x, light->edge_v.y, light->edge_v.z, light->samples);
+        }
+        else if(light->type == Light_Sphere)
+        {
+            fprintf(file, " sphere radius %.9g samples %u", light->radius, light->samples);
+        }
+        fprintf(file, " position %.9g %.9g %.9g intensity %.9g %.9g %.9g",
+                light->position.x, light->position.y, light->position.z,
+                light->intensity.x, light->intensity.y, light->intensity.z);
+        if(light->falloff)
+        {
+            fprintf(file, " falloff");
+        }
+        fprintf(file, "\n");
+    }
+
+    for(u32 material_index = DEFAULT_MATERIAL + 1;
+        material_index < world->material_count;
+        ++material_index)
+    {
+        fprintf(file, "material m%u", material_index);
+        write_material_fields(file, world->materials + material_index);
+        fprintf(file, "\n");
+    }
+
+    for(u32 sphere_index = 0;
+        sphere_index < world->sphere_count;
+        ++sphere_index)
+    {
+        Sphere *s = world->spheres + sphere_index;
+        fprintf(file, "sphere");
+        write_material_name(file, s->material_index);
+        write_transform(file, s->transform);
+        fprintf(file, "\n");
+    }
+
+    for(u32 plane_index = 0;
+        plane_index < world->plane_count;
+        ++plane_index)
+    {
+        Plane *p = world->planes + plane_index;
+        fprintf(file, "plane");
+        write_material_name(file, p->material_index);
+        write_transform(file, p->transform.matrix);
+        fprintf(file, "\n");
+    }
+
+    for(u32 cube_index = 0;
+        cube_index < world->cube_count;
+        ++cube_index)
+    {
+        Cube *c = world->cubes + cube_index;
+        fprintf(file, "cube");
+        write_material_name(file, c->material_index);
+        write_transform(file, c->transform.matrix);
+        fprintf(file, "\n");
+    }
+
+    for(u32 cylinder_index = 0;
+        cylinder_index < world->cylinder_count;
+        ++cylinder_index)
+    {
+        Cylinder *c = world->cylinders + cylinder_index;
+        fprintf(file, "cylinder");
+        if(isfinite(c->minimum))
+        {
+            fprintf(file, " minimum %.9g", c->minimum);
+        }
+        if(isfinite(c->maximum))
+        {
+            fprintf(file, " maximum %.9g", c->maximum);
+        }
+        if(c->closed)
+        {
+            fprintf(file, " closed");
+        }
+        write_material_name(file, c->material_index);
+        write_transform(file, c->transform.matrix);
+        fprintf(file, "\n");
+    }
+
+    for(u32 triangle_index = 0;
+        triangle_index < world->triangle_count;
+        ++triangle_index)
+    {
+        Triangle *t = world->triangles + triangle_index;
+        fprintf(file, "triangle %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g",
+                t->p1.x, t->p1.y, t->p1.z, t->p2.x, t->p2.y, t->p2.z, t->p3.x, t->p3.y, t->p3.z);
+        write_material_name(file, t->material_index);
+        fprintf(file, "\n");
+    }
+
+    // NOTE: the obj goes next to the scene file, the mesh statement names it
+    // relative to the scene like load_scene expects
+    u32 stem_length = (u32)strlen(filename);
+    char *extension = strrchr(filename, '.');
+    if(extension && !strchr(extension, '/'))
+    {
+        stem_length = (u32)(extension - filename);
+    }
+    char *slash = strrchr(filename, '/');
+    u32 directory_length = slash ? (u32)(slash + 1 - filename) : 0;
+    bool result = true;
+    for(u32 mesh_index = 0;
+        mesh_index < world->mesh_count;
+        ++mesh_index)
+    {
+        Mesh *mesh = world->meshes + mesh_index;
+        char obj_filename[1024];
+        snprintf(obj_filename, sizeof(obj_filename), "%.*s_%s.obj", (int)stem_length, filename, mesh->name);
+        if(!write_obj(obj_filename, world, mesh))
+        {
+            result = false;
+        }
+        fprintf(file, "mesh %s %s\n", mesh->name, obj_filename + directory_length);
+    }
+
+    for(u32 instance_index = 0;
+        instance_index < world->instance_count;
+        ++instance_index)
+    {
+        MeshInstance *instance = world->instances + instance_index;
+        fprintf(file, "instance %s", world->meshes[instance->mesh_index].name);
+        write_material_name(file, instance->material_index);
+        write_transform(file, instance->transform.matrix);
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    return(result);
+}
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef _H_DOLUSSEQUENCE
+#define _H_DOLUSSEQUENCE
+
+// NOTE: --frames. Renders an animation from one setup. The scene is loaded
+// and its bvh built once, the thread pool, the frame buffer, the job (with
+// its frame arena) and an async image writer stay for the whole sequence,
+// and each frame is written while the next one traces. Frame i of n is at
+// time t = i / (n - 1), the first frame is exactly the still image.
+//
+// The camera turns by orbit around its look at point (about +y) and moves
+// by fly, from and to together. Spheres move by translating their starting
+// transform; with sphere_motion each one drifts that far over the sequence
+// in a direction of its own, random but the same every run.
+//
+// When spheres moved the bvh is refit (see refit_world_bvh) and the soa
+// slots rewritten in place. Once refitting has let the sah cost of the tree
+// grow past rebuild_ratio times what the last build gave, the frame gets a
+// fresh build instead, written over the old tree.
+
+typedef struct
+{
+    u32 frame_count;
+    // NOTE: radians over the whole sequence
+    f32 orbit;
+    v3 fly;
+    f32 sphere_motion;
+
+    f32 rebuild_ratio;
+    // NOTE: false rebuilds the bvh every frame, to compare against
+    bool refit;
+    u32 leaf_width;
+} SequenceSettings;
+
+#define SEQUENCE_REBUILD_RATIO 1.5f
+
+// NOTE: output.bmp gives output_0000.bmp, output_0001.bmp, ...
+internal void sequence_filename(char *buffer, u32 size, char *filename, u32 frame)
+{
+    char *extension = strrchr(filename, '.');
+    char *slash = strrchr(filename, '/');
+    if(!extension || (slash && extension < slash))
+    {
+        extension = filename + strlen(filename);
+    }
+    snprintf(buffer, size, "%.*s_%04u%s", (int)(extension - filename), filename, frame, extension);
+}
+
+internal SceneView sequence_view(SceneView *view, SequenceSettings *settings, f32 t)
+{
+    SceneView result = *view;
+    if(settings->orbit != 0.0f)
+    {
+        m4x4 turn = m4x4_rotateY_matrix(settings->orbit * t);
+        result.from = v4_add(view->to, m4x4_mul_v4(turn, v4_sub(view->from, view->to)));
+    }
+    v4 fly = Vector(settings->fly.x * t, settings->fly.y * t, settings->fly.z * t);
+    result.from = v4_add(result.from, fly);
+    result.to = v4_add(result.to, fly);
+    return(result);
+}
+
+internal void run_sequence(ThreadPool *pool, RenderJob *job, SceneView *view, SequenceSettings *settings,
+                           char *output_filename)
+{
+    World *world = job->world;
+    MemoryArena arena = {};
+
+    // NOTE: where every sphere starts and how far it gets by the last frame
+    bool moving = (settings->sphere_motion > 0.0f && world->sphere_count > 0);
+    m4x4 *start = 0;
+    v3 *motion = 0;
+    f32 built_cost = 0.0f;
+    if(moving)
+    {
+        start = PUSH_ARRAY(&arena, world->sphere_count, m4x4);
+        motion = PUSH_ARRAY(&arena, world->sphere_count, v3);
+        RandomSeries series = random_seed(1234, 25);
+        for(u32 sphere_index = 0;
+            sphere_index < world->sphere_count;
+            ++sphere_index)
+        {
+            start[sphere_index] = world->spheres[sphere_index].transform;
+            motion[sphere_index] = v3_scalar_mul(random_unit_vector(&series), settings->sphere_motion);
+        }
+        reserve_world_bvh(world);
+        built_cost = bvh_sah_cost(&world->bvh, settings->leaf_width);
+    }
+
+    AsyncImageWriter writer;
+    async_writer_start(&writer);
+
+    // NOTE: one line per frame instead of the tile counter
+    Camera cam;
+    job->camera = &cam;
+    job->quiet = true;
+    u32 refits = 0;
+    u32 rebuilds = 0;
+    f64 update_seconds = 0.0;
+    f64 render_seconds = 0.0;
+    u64 primary_rays = 0;
+    u64 allocations = 0;
+    f64 sequence_start = get_wall_clock();
+    for(u32 frame = 0;
+        frame < settings->frame_count;
+        ++frame)
+    {
+        f32 t = (settings->frame_count > 1) ? (f32)frame / (f32)(settings->frame_count - 1) : 0.0f;
+
+        char *update = "";
+        f32 cost = built_cost;
+        f64 update_start = get_wall_clock();
+        if(moving && frame > 0)
+        {
+            for(u32 sphere_index = 0;
+                sphere_index < world->sphere_count;
+                ++sphere_index)
+            {
+                m4x4 translation = m4x4_translation_matrix(v3_scalar_mul(motion[sphere_index], t));
+                set_sphere_transform(world->spheres + sphere_index, m4x4_mul(translation, start[sphere_index]));
+            }
+
+            if(world->bvh.node_count > 0)
+            {
+                bool rebuild = !settings->refit;
+                if(!rebuild)
+                {
+                    refit_world_bvh(world);
+                    cost = bvh_sah_cost(&world->bvh, settings->leaf_width);
+                    rebuild = (cost > settings->rebuild_ratio * built_cost);
+                }
+                if(rebuild)
+                {
+                    rebuild_world_bvh(world, settings->leaf_width);
+                    cost = built_cost = bvh_sah_cost(&world->bvh, settings->leaf_width);
+                    ++rebuilds;
+                    update = ", bvh rebuilt";
+                }
+                else
+                {
+                    ++refits;
+                    update = ", bvh refit";
+                }
+            }
+            fill_world_soa(world);
+        }
+        f64 update_elapsed = get_wall_clock() - update_start;
+        update_seconds += update_elapsed;
+
+        SceneView frame_view = sequence_view(view, settings, t);
+        cam = view_camera(&frame_view);
+
+        f64 render_start = get_wall_clock();
+        render_image(pool, job);
+        f64 render_elapsed = get_wall_clock() - render_start;
+        render_seconds += render_elapsed;
+        primary_rays += job->stats.primary_rays;
+        allocations += job->stats.allocations;
+
+        char filename[1024];
+        sequence_filename(filename, sizeof(filename), output_filename, frame);
+        async_writer_submit(&writer, job->image, filename);
+
+        printf("Frame %u/%u: %s, traced in %.3fs", frame + 1, settings->frame_count, filename, render_elapsed);
+        if(moving && frame > 0)
+        {
+            printf(", updated in %.3fs", update_elapsed);
+            if(world->bvh.node_count > 0)
+            {
+                printf("%s (sah %.2fx the last build)", update, cost / built_cost);
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    async_writer_stop(&writer);
+    f64 elapsed = get_wall_clock() - sequence_start;
+
+    printf("Sequence: %u frames in %.3fs (%.3fs per frame), %.2f Mrays/s primary while tracing\n",
+           settings->frame_count, elapsed, elapsed / settings->frame_count, primary_rays / render_seconds * 1e-6);
+    if(moving)
+    {
+        printf("Scene updates: %.3fs, %u bvh refits, %u rebuilds (rebuild ratio %g)\n",
+               update_seconds, refits, rebuilds, settings->rebuild_ratio);
+    }
+    printf("Allocations while tracing: %llu\n", (unsigned long long)allocations);
+
+    free_arena(&arena);
+}
+
+#endif
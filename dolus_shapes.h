@@ -0,0 +1,311 @@
+#ifndef _H_DOLUSSHAPES
+#define _H_DOLUSSHAPES
+
+// NOTE: Everything that is not a sphere. Each type is one contiguous array
+// in World and gets intersected by its own loop over the whole array, so
+// there is no per object switch. The loops are plain scalar code over the
+// structs, transforming the ray into each object's space with its inverse;
+// scenes have a handful of these shapes, so they get no soa streams, bvh or
+// simd kernels like the spheres do. They run after the spheres with t_max
+// already shrunk to the sphere hit. Big triangle counts belong in meshes.
+//
+// Every span function returns the nearest hit in (t_min, t_max) and keeps
+// the lowest index on ties, like the sphere kernels do.
+
+// NOTE: only row 1 of the inverse matters, the plane is y = 0
+internal bool plane_span(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    u32 base = object_index_base(world, Shape_Plane);
+    for(u32 plane_index = 0;
+        plane_index < world->plane_count;
+        ++plane_index)
+    {
+        v4 row = world->planes[plane_index].transform.inverse.rows[1];
+        f32 origin_y = v4_dot(row, ray->origin);
+        f32 direction_y = v4_dot(row, ray->direction);
+        if(fabsf(direction_y) > 1e-7f)
+        {
+            f32 t = -origin_y / direction_y;
+            if(t > t_min && t < t_max)
+            {
+                t_max = t;
+                hit->t = t;
+                hit->object_index = base + plane_index;
+                result = true;
+            }
+        }
+    }
+    return(result);
+}
+
+// NOTE: slab test against the -1..1 box in object space, the exit distance
+// counts when the ray starts inside. f32_min/f32_max like ray_intersect_node:
+// the only NaN is 0/0 from a ray parallel to a face and exactly in its
+// plane, which then either misses or ignores that slab.
+internal bool cube_span(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    u32 base = object_index_base(world, Shape_Cube);
+    for(u32 cube_index = 0;
+        cube_index < world->cube_count;
+        ++cube_index)
+    {
+        m4x4 *inverse = &world->cubes[cube_index].transform.inverse;
+        v4 origin = m4x4_mul_v4(*inverse, ray->origin);
+        v4 direction = m4x4_mul_v4(*inverse, ray->direction);
+
+        f32 tx1 = (-1.0f - origin.x) / direction.x;
+        f32 tx2 = (1.0f - origin.x) / direction.x;
+        f32 ty1 = (-1.0f - origin.y) / direction.y;
+        f32 ty2 = (1.0f - origin.y) / direction.y;
+        f32 tz1 = (-1.0f - origin.z) / direction.z;
+        f32 tz2 = (1.0f - origin.z) / direction.z;
+        f32 t_near = f32_max(f32_min(tx1, tx2), f32_max(f32_min(ty1, ty2), f32_min(tz1, tz2)));
+        f32 t_far = f32_min(f32_max(tx1, tx2), f32_min(f32_max(ty1, ty2), f32_max(tz1, tz2)));
+
+        if(t_near <= t_far)
+        {
+            f32 t = (t_near > t_min) ? t_near : t_far;
+            if(t > t_min && t < t_max)
+            {
+                t_max = t;
+                hit->t = t;
+                hit->object_index = base + cube_index;
+                result = true;
+            }
+        }
+    }
+    return(result);
+}
+
+extern inline bool cylinder_cap_hit(v4 origin, v4 direction, f32 t)
+{
+    f32 x = origin.x + t * direction.x;
+    f32 z = origin.z + t * direction.z;
+    bool result = (x * x + z * z) <= 1.0f;
+    return(result);
+}
+
+internal bool cylinder_span(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    u32 base = object_index_base(world, Shape_Cylinder);
+    for(u32 cylinder_index = 0;
+        cylinder_index < world->cylinder_count;
+        ++cylinder_index)
+    {
+        Cylinder *c = world->cylinders + cylinder_index;
+        v4 origin = m4x4_mul_v4(c->transform.inverse, ray->origin);
+        v4 direction = m4x4_mul_v4(c->transform.inverse, ray->direction);
+
+        // NOTE: up to two wall hits and two cap hits, keep the nearest valid
+        f32 best = t_max;
+        f32 a = direction.x * direction.x + direction.z * direction.z;
+        if(a > 1e-9f)
+        {
+            f32 b = 2.0f * (origin.x * direction.x + origin.z * direction.z);
+            f32 cc = origin.x * origin.x + origin.z * origin.z - 1.0f;
+            f32 discriminant = b * b - 4.0f * a * cc;
+            if(discriminant >= 0.0f)
+            {
+                f32 root = square_root(discriminant);
+                f32 t0 = (-b - root) / (2.0f * a);
+                f32 t1 = (-b + root) / (2.0f * a);
+                f32 y0 = origin.y + t0 * direction.y;
+                f32 y1 = origin.y + t1 * direction.y;
+                if(t0 > t_min && t0 < best && y0 > c->minimum && y0 < c->maximum)
+                {
+                    best = t0;
+                }
+                if(t1 > t_min && t1 < best && y1 > c->minimum && y1 < c->maximum)
+                {
+                    best = t1;
+                }
+            }
+        }
+        if(c->closed && fabsf(direction.y) > 1e-9f)
+        {
+            f32 t_low = (c->minimum - origin.y) / direction.y;
+            f32 t_high = (c->maximum - origin.y) / direction.y;
+            if(t_low > t_min && t_low < best && cylinder_cap_hit(origin, direction, t_low))
+            {
+                best = t_low;
+            }
+            if(t_high > t_min && t_high < best && cylinder_cap_hit(origin, direction, t_high))
+            {
+                best = t_high;
+            }
+        }
+
+        if(best < t_max)
+        {
+            t_max = best;
+            hit->t = best;
+            hit->object_index = base + cylinder_index;
+            result = true;
+        }
+    }
+    return(result);
+}
+
+// NOTE: moller-trumbore, both sides count
+internal bool triangle_span(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    u32 base = object_index_base(world, Shape_Triangle);
+    v3 origin = v4_v3(ray->origin);
+    v3 direction = v4_v3(ray->direction);
+    for(u32 triangle_index = 0;
+        triangle_index < world->triangle_count;
+        ++triangle_index)
+    {
+        Triangle *tri = world->triangles + triangle_index;
+        v3 e1 = v4_v3(tri->e1);
+        v3 e2 = v4_v3(tri->e2);
+        v3 dir_cross_e2 = cross(direction, e2);
+        f32 det = dot(e1, dir_cross_e2);
+        if(fabsf(det) < 1e-9f)
+        {
+            continue;
+        }
+
+        f32 f = 1.0f / det;
+        v3 p1_to_origin = v3_sub(origin, v4_v3(tri->p1));
+        f32 u = f * dot(p1_to_origin, dir_cross_e2);
+        v3 origin_cross_e1 = cross(p1_to_origin, e1);
+        f32 v = f * dot(direction, origin_cross_e1);
+        f32 t = f * dot(e2, origin_cross_e1);
+        if(u >= 0.0f && v >= 0.0f && (u + v) <= 1.0f && t > t_min && t < t_max)
+        {
+            t_max = t;
+            hit->t = t;
+            hit->object_index = base + triangle_index;
+            result = true;
+        }
+    }
+    return(result);
+}
+
+// NOTE: every non sphere batch in ShapeType order
+internal bool intersect_shapes(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    if(world->plane_count && plane_span(world, ray, t_min, t_max, hit))
+    {
+        t_max = hit->t;
+        result = true;
+    }
+    if(world->cube_count && cube_span(world, ray, t_min, t_max, hit))
+    {
+        t_max = hit->t;
+        result = true;
+    }
+    if(world->cylinder_count && cylinder_span(world, ray, t_min, t_max, hit))
+    {
+        t_max = hit->t;
+        result = true;
+    }
+    if(world->triangle_count && triangle_span(world, ray, t_min, t_max, hit))
+    {
+        t_max = hit->t;
+        result = true;
+    }
+    if(world->instance_count && instance_span(world, ray, t_min, t_max, hit))
+    {
+        result = true;
+    }
+    return(result);
+}
+
+// NOTE: any hit version for shadow rays. The analytic shapes are cheap
+// enough to just run to the closest hit, meshes stop at the first triangle.
+internal bool shapes_occluded(World *world, Ray *ray, f32 max_distance)
+{
+    X occluder;
+    bool result = (world->plane_count && plane_span(world, ray, EPSILON, max_distance, &occluder)) ||
+                  (world->cube_count && cube_span(world, ray, EPSILON, max_distance, &occluder)) ||
+                  (world->cylinder_count && cylinder_span(world, ray, EPSILON, max_distance, &occluder)) ||
+                  (world->triangle_count && triangle_span(world, ray, EPSILON, max_distance, &occluder)) ||
+                  (world->instance_count && instances_occluded(world, ray, EPSILON, max_distance));
+    return(result);
+}
+
+extern inline v4 object_to_world_normal(ObjectTransform *transform, v4 object_normal)
+{
+    v4 world_normal = m4x4_mul_v4(transform->inverse_transpose, object_normal);
+    world_normal.w = 0;
+    return(v4_normalize(world_normal));
+}
+
+// NOTE: outward normal of the object hit at a world space point on it
+internal v4 object_normal_at(World *world, X *hit, v4 point)
+{
+    u32 local_index;
+    ShapeType shape = object_shape(world, hit->object_index, &local_index);
+    v4 result = {};
+    switch(shape)
+    {
+        case Shape_Sphere:
+        {
+            result = normal_at_point(world->spheres + local_index, point);
+        } break;
+
+        case Shape_Plane:
+        {
+            result = object_to_world_normal(&world->planes[local_index].transform, Vector(0.0f, 1.0f, 0.0f));
+        } break;
+
+        case Shape_Cube:
+        {
+            ObjectTransform *transform = &world->cubes[local_index].transform;
+            v4 p = m4x4_mul_v4(transform->inverse, point);
+            f32 ax = fabsf(p.x);
+            f32 ay = fabsf(p.y);
+            f32 az = fabsf(p.z);
+            v4 object_normal = Vector(0.0f, 0.0f, p.z);
+            if(ax >= ay && ax >= az)
+            {
+                object_normal = Vector(p.x, 0.0f, 0.0f);
+            }
+            else if(ay >= az)
+            {
+                object_normal = Vector(0.0f, p.y, 0.0f);
+            }
+            result = object_to_world_normal(transform, object_normal);
+        } break;
+
+        case Shape_Cylinder:
+        {
+            Cylinder *c = world->cylinders + local_index;
+            v4 p = m4x4_mul_v4(c->transform.inverse, point);
+            f32 distance = p.x * p.x + p.z * p.z;
+            v4 object_normal = Vector(p.x, 0.0f, p.z);
+            if(c->closed && distance < 1.0f && p.y >= c->maximum - EPSILON)
+            {
+                object_normal = Vector(0.0f, 1.0f, 0.0f);
+            }
+            else if(c->closed && distance < 1.0f && p.y <= c->minimum + EPSILON)
+            {
+                object_normal = Vector(0.0f, -1.0f, 0.0f);
+            }
+            result = object_to_world_normal(&c->transform, object_normal);
+        } break;
+
+        case Shape_Triangle:
+        {
+            result = world->triangles[local_index].normal;
+        } break;
+
+        case Shape_Mesh:
+        {
+            MeshInstance *instance = world->instances + local_index;
+            result = object_to_world_normal(&instance->transform, mesh_triangle_normal(world, instance, hit->primitive));
+        } break;
+
+        default: break;
+    }
+    return(result);
+}
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef _H_DOLUSSIMD
+#define _H_DOLUSSIMD
+
+// NOTE: One ray against a span of spheres, 4 (sse) or 8 (avx2) at a time.
+// The span is a run of SphereSoA slots, which is exactly a bvh leaf.
+// Every kernel returns the closest root in (t_min, t_max) and on ties keeps
+// the lowest slot, same as walking the spheres one by one. The lane math
+// follows ray_intersect_sphere operation for operation (no fma), so all
+// kernels agree bit for bit with the scalar one.
+
+#include<emmintrin.h>
+#include<immintrin.h>
+
+typedef bool sphere_span_kernel(World *world, u32 first, u32 count, Ray *ray, f32 t_min, f32 t_max, X *hit);
+
+typedef enum
+{
+    SphereKernel_Auto,
+    SphereKernel_Scalar,
+    SphereKernel_SSE,
+    SphereKernel_AVX2,
+} SphereKernelType;
+
+// NOTE: pad every stream by a full avx register, the kernels load 8
+// lanes at a time and mask off whatever is past the span. Strides are a
+// multiple of 16 floats so every stream starts on its own cache line.
+extern inline u32 soa_stride(u32 count)
+{
+    u32 result = (count + 8 + 15) & ~15;
+    return(result);
+}
+
+// NOTE: (re)writes every slot from the spheres in bvh leaf order, after the
+// spheres moved or the bvh was rebuilt
+internal void fill_world_soa(World *world)
+{
+    SphereSoA *soa = &world->soa;
+    for(u32 slot = 0;
+        slot < soa->count;
+        ++slot)
+    {
+        u32 sphere_index = (world->bvh.node_count > 0) ? world->bvh.indices[slot] : slot;
+        Sphere *s = world->spheres + sphere_index;
+        soa->object_index[slot] = sphere_index;
+
+        for(u32 row = 0; row < 4; ++row)
+        {
+            v4 r = s->inverse.rows[row];
+            soa->inverse[row*4 + 0][slot] = r.x;
+            soa->inverse[row*4 + 1][slot] = r.y;
+            soa->inverse[row*4 + 2][slot] = r.z;
+            soa->inverse[row*4 + 3][slot] = r.w;
+        }
+        soa->center[0][slot] = s->center.x;
+        soa->center[1][slot] = s->center.y;
+        soa->center[2][slot] = s->center.z;
+        soa->center[3][slot] = s->center.w;
+    }
+}
+
+// NOTE: call after build_world_bvh so slots come out in leaf order
+internal void build_world_soa(World *world)
+{
+    SphereSoA *soa = &world->soa;
+    *soa = (SphereSoA){0};
+    soa->count = world->sphere_count;
+
+    u32 stride = soa_stride(soa->count);
+    soa->memory = (f32 *)push_size(&world->arena, 20 * stride * sizeof(f32), 64);
+    memset(soa->memory, 0, 20 * stride * sizeof(f32));
+    for(u32 stream = 0; stream < 16; ++stream)
+    {
+        soa->inverse[stream] = soa->memory + stream * stride;
+    }
+    for(u32 stream = 0; stream < 4; ++stream)
+    {
+        soa->center[stream] = soa->memory + (16 + stream) * stride;
+    }
+
+    soa->object_index = PUSH_ARRAY(&world->arena, stride, u32);
+    fill_world_soa(world);
+}
+
+// NOTE: reference kernel, the plain ray_intersect_sphere on each Sphere
+internal bool sphere_span_scalar(World *world, u32 first, u32 count, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    bool result = false;
+    for(u32 slot = first;
+        slot < first + count;
+        ++slot)
+    {
+        u32 sphere_index = world->soa.object_index[slot];
+        Tvalue t = ray_intersect_sphere(*ray, world->spheres + sphere_index);
+        f32 root;
+        if(sphere_nearest_root(t, t_min, t_max, &root))
+        {
+            t_max = root;
+            hit->t = root;
+            hit->object_index = sphere_index;
+            result = true;
+        }
+    }
+    return(result);
+}
+
+// NOTE: lanes come back as (root, valid mask) pairs; pick the nearest, first
+// lane wins ties
+extern inline bool pick_nearest_lane(World *world, u32 base, u32 lane_count, f32 *roots, u32 valid_mask, f32 *t_max, X *hit)
+{
+    bool result = false;
+    for(u32 lane = 0;
+        lane < lane_count;
+        ++lane)
+    {
+        if((valid_mask & (1u << lane)) && roots[lane] < *t_max)
+        {
+            *t_max = roots[lane];
+            hit->t = roots[lane];
+            hit->object_index = world->soa.object_index[base + lane];
+            result = true;
+        }
+    }
+    return(result);
+}
+
+#define SSE_ROW(m, r, x, y, z, w) \
+    _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps((m)[r*4 + 0] + base), x), \
+                                     _mm_mul_ps(_mm_loadu_ps((m)[r*4 + 1] + base), y)), \
+                          _mm_mul_ps(_mm_loadu_ps((m)[r*4 + 2] + base), z)), \
+               _mm_mul_ps(_mm_loadu_ps((m)[r*4 + 3] + base), w))
+
+internal bool sphere_span_sse(World *world, u32 first, u32 count, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    SphereSoA *soa = &world->soa;
+    __m128 ox = _mm_set1_ps(ray->origin.x);
+    __m128 oy = _mm_set1_ps(ray->origin.y);
+    __m128 oz = _mm_set1_ps(ray->origin.z);
+    __m128 ow = _mm_set1_ps(ray->origin.w);
+    __m128 dx = _mm_set1_ps(ray->direction.x);
+    __m128 dy = _mm_set1_ps(ray->direction.y);
+    __m128 dz = _mm_set1_ps(ray->direction.z);
+    __m128 dw = _mm_set1_ps(ray->direction.w);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 two = _mm_set1_ps(2.0f);
+    __m128 four = _mm_set1_ps(4.0f);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 t_min_4 = _mm_set1_ps(t_min);
+
+    bool result = false;
+    u32 end = first + count;
+    for(u32 base = first;
+        base < end;
+        base += 4)
+    {
+        __m128 t_max_4 = _mm_set1_ps(t_max);
+
+        __m128 rox = SSE_ROW(soa->inverse, 0, ox, oy, oz, ow);
+        __m128 roy = SSE_ROW(soa->inverse, 1, ox, oy, oz, ow);
+        __m128 roz = SSE_ROW(soa->inverse, 2, ox, oy, oz, ow);
+        __m128 row = SSE_ROW(soa->inverse, 3, ox, oy, oz, ow);
+        __m128 rdx = SSE_ROW(soa->inverse, 0, dx, dy, dz, dw);
+        __m128 rdy = SSE_ROW(soa->inverse, 1, dx, dy, dz, dw);
+        __m128 rdz = SSE_ROW(soa->inverse, 2, dx, dy, dz, dw);
+        __m128 rdw = SSE_ROW(soa->inverse, 3, dx, dy, dz, dw);
+
+        __m128 sx = _mm_sub_ps(rox, _mm_loadu_ps(soa->center[0] + base));
+        __m128 sy = _mm_sub_ps(roy, _mm_loadu_ps(soa->center[1] + base));
+        __m128 sz = _mm_sub_ps(roz, _mm_loadu_ps(soa->center[2] + base));
+        __m128 sw = _mm_sub_ps(row, _mm_loadu_ps(soa->center[3] + base));
+
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rdx, rdx), _mm_mul_ps(rdy, rdy)), _mm_mul_ps(rdz, rdz)), _mm_mul_ps(rdw, rdw));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rdx, sx), _mm_mul_ps(rdy, sy)), _mm_mul_ps(rdz, sz)), _mm_mul_ps(rdw, sw)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)), _mm_mul_ps(sw, sw)), one);
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(four, a), c));
+
+        // NOTE: a negative discriminant turns into NaN roots which fail
+        // every compare below, no separate hit mask needed
+        __m128 root = _mm_sqrt_ps(discriminant);
+        __m128 neg_b = _mm_xor_ps(b, sign);
+        __m128 two_a = _mm_mul_ps(two, a);
+        __m128 t1 = _mm_div_ps(_mm_sub_ps(neg_b, root), two_a);
+        __m128 t2 = _mm_div_ps(_mm_add_ps(neg_b, root), two_a);
+
+        __m128 valid1 = _mm_and_ps(_mm_cmpgt_ps(t1, t_min_4), _mm_cmplt_ps(t1, t_max_4));
+        __m128 valid2 = _mm_and_ps(_mm_cmpgt_ps(t2, t_min_4), _mm_cmplt_ps(t2, t_max_4));
+        __m128 nearest = _mm_or_ps(_mm_and_ps(valid1, t1), _mm_andnot_ps(valid1, t2));
+        u32 valid_mask = (u32)_mm_movemask_ps(_mm_or_ps(valid1, valid2));
+
+        if(valid_mask)
+        {
+            f32 roots[4];
+            _mm_storeu_ps(roots, nearest);
+            u32 lane_count = (end - base < 4) ? (end - base) : 4;
+            if(pick_nearest_lane(world, base, lane_count, roots, valid_mask, &t_max, hit))
+            {
+                result = true;
+            }
+        }
+    }
+    return(result);
+}
+
+#define AVX_ROW(m, r, x, y, z, w) \
+    _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps((m)[r*4 + 0] + base), x), \
+                                              _mm256_mul_ps(_mm256_loadu_ps((m)[r*4 + 1] + base), y)), \
+                                _mm256_mul_ps(_mm256_loadu_ps((m)[r*4 + 2] + base), z)), \
+                  _mm256_mul_ps(_mm256_loadu_ps((m)[r*4 + 3] + base), w))
+
+// NOTE: compiled for avx2 regardless of the build flags, only ever called
+// after get_cpu_features() said so
+__attribute__((target("avx2")))
+internal bool sphere_span_avx2(World *world, u32 first, u32 count, Ray *ray, f32 t_min, f32 t_max, X *hit)
+{
+    SphereSoA *soa = &world->soa;
+    __m256 ox = _mm256_set1_ps(ray->origin.x);
+    __m256 oy = _mm256_set1_ps(ray->origin.y);
+    __m256 oz = _mm256_set1_ps(ray->origin.z);
+    __m256 ow = _mm256_set1_ps(ray->origin.w);
+    __m256 dx = _mm256_set1_ps(ray->direction.x);
+    __m256 dy = _mm256_set1_ps(ray->direction.y);
+    __m256 dz = _mm256_set1_ps(ray->direction.z);
+    __m256 dw = _mm256_set1_ps(ray->direction.w);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 two = _mm256_set1_ps(2.0f);
+    __m256 four = _mm256_set1_ps(4.0f);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 t_min_8 = _mm256_set1_ps(t_min);
+
+    bool result = false;
+    u32 end = first + count;
+    for(u32 base = first;
+        base < end;
+        base += 8)
+    {
+        __m256 t_max_8 = _mm256_set1_ps(t_max);
+
+        __m256 rox = AVX_ROW(soa->inverse, 0, ox, oy, oz, ow);
+        __m256 roy = AVX_ROW(soa->inverse, 1, ox, oy, oz, ow);
+        __m256 roz = AVX_ROW(soa->inverse, 2, ox, oy, oz, ow);
+        __m256 row = AVX_ROW(soa->inverse, 3, ox, oy, oz, ow);
+        __m256 rdx = AVX_ROW(soa->inverse, 0, dx, dy, dz, dw);
+        __m256 rdy = AVX_ROW(soa->inverse, 1, dx, dy, dz, dw);
+        __m256 rdz = AVX_ROW(soa->inverse, 2, dx, dy, dz, dw);
+        __m256 rdw = AVX_ROW(soa->inverse, 3, dx, dy, dz, dw);
+
+        __m256 sx = _mm256_sub_ps(rox, _mm256_loadu_ps(soa->center[0] + base));
+        __m256 sy = _mm256_sub_ps(roy, _mm256_loadu_ps(soa->center[1] + base));
+        __m256 sz = _mm256_sub_ps(roz, _mm256_loadu_ps(soa->center[2] + base));
+        __m256 sw = _mm256_sub_ps(row, _mm256_loadu_ps(soa->center[3] + base));
+
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rdx, rdx), _mm256_mul_ps(rdy, rdy)), _mm256_mul_ps(rdz, rdz)), _mm256_mul_ps(rdw, rdw));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rdx, sx), _mm256_mul_ps(rdy, sy)), _mm256_mul_ps(rdz, sz)), _mm256_mul_ps(rdw, sw)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)), _mm256_mul_ps(sw, sw)), one);
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), c));
+
+        __m256 root = _mm256_sqrt_ps(discriminant);
+        __m256 neg_b = _mm256_xor_ps(b, sign);
+        __m256 two_a = _mm256_mul_ps(two, a);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(neg_b, root), two_a);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(neg_b, root), two_a);
+
+        __m256 valid1 = _mm256_and_ps(_mm256_cmp_ps(t1, t_min_8, _CMP_GT_OQ), _mm256_cmp_ps(t1, t_max_8, _CMP_LT_OQ));
+        __m256 valid2 = _mm256_and_ps(_mm256_cmp_ps(t2, t_min_8, _CMP_GT_OQ), _mm256_cmp_ps(t2, t_max_8, _CMP_LT_OQ));
+        __m256 nearest = _mm256_blendv_ps(t2, t1, valid1);
+        u32 valid_mask = (u32)_mm256_movemask_ps(_mm256_or_ps(valid1, valid2));
+
+        if(valid_mask)
+        {
+            f32 roots[8];
+            _mm256_storeu_ps(roots, nearest);
+            u32 lane_count = (end - base < 8) ? (end - base) : 8;
+            if(pick_nearest_lane(world, base, lane_count, roots, valid_mask, &t_max, hit))
+            {
+                result = true;
+            }
+        }
+    }
+    return(result);
+}
+
+internal sphere_span_kernel *sphere_span = sphere_span_scalar;
+
+internal char *sphere_kernel_name(SphereKernelType type)
+{
+    char *names[] = {"auto", "scalar", "sse", "avx2"};
+    return(names[type]);
+}
+
+internal u32 sphere_kernel_width(SphereKernelType type)
+{
+    u32 widths[] = {1, 1, 4, 8};
+    return(widths[type]);
+}
+
+// NOTE: returns what actually got picked, auto resolves via cpuid and a
+// request for something the cpu can't run falls back to the best it can,
+// saying so
+internal SphereKernelType select_sphere_kernel(SphereKernelType type)
+{
+    SphereKernelType requested = type;
+    CPUFeatures cpu = get_cpu_features();
+    if(type == SphereKernel_Auto || (type == SphereKernel_AVX2 && !cpu.avx2))
+    {
+        type = cpu.avx2 ? SphereKernel_AVX2 : (cpu.sse2 ? SphereKernel_SSE : SphereKernel_Scalar);
+    }
+    if(type == SphereKernel_SSE && !cpu.sse2)
+    {
+        type = SphereKernel_Scalar;
+    }
+
+    switch(type)
+    {
+        case SphereKernel_AVX2: sphere_span = sphere_span_avx2; break;
+        case SphereKernel_SSE: sphere_span = sphere_span_sse; break;
+        default: sphere_span = sphere_span_scalar; type = SphereKernel_Scalar; break;
+    }
+    if(requested != SphereKernel_Auto && requested != type)
+    {
+        printf("The %s kernel needs a cpu with %s, using %s\n", sphere_kernel_name(requested),
+               sphere_kernel_name(requested), sphere_kernel_name(type));
+    }
+    return(type);
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include<stdio.h>
 #include<stdint.h>
+#include<string.h>
 
 #define internal static
 
@@ -17,446 +18,2271 @@ typedef  float f32;
 typedef  double f64;
 
 #include "dolus_math.h"
+#include "dolus_memory.h"
 #include "dolus.h"
+#include "dolus_platform.h"
+#include "dolus_simd.h"
+#include "dolus_bvh.h"
+#include "dolus_packet.h"
+#include "dolus_mesh.h"
+#include "dolus_lights.h"
+#include "dolus_shapes.h"
+#include "dolus_scene.h"
+#include "dolus_cache.h"
+#include "dolus_output.h"
 
-#pragma pack(push, 1)
-typedef struct BitMapHeader
+
+internal Computation prepare_computation(World *world, X intersection, Ray *ray)
+{
+    Computation result = {};
+    result.t = intersection.t;
+    result.object_index = intersection.object_index;
+    
+    result.point = ray_position(*ray, result.t);
+    result.eyev = v4_neg(ray->direction);
+    result.normalv = object_normal_at(world, &intersection, result.point);
+    if(v4_dot(result.normalv, result.eyev) < 0)
+    {
+        result.inside = true;
+        result.normalv = v4_neg(result.normalv);
+    }
+    else
+    {
+        result.inside = false;
+    }
+    // NOTE: offsets go along the normal facing the eye, so a hit seen from
+    // inside a sphere keeps its bounce rays inside too
+    result.over_point = v4_add(result.point, v4_scalar_mul(result.normalv, EPSILON));
+    result.under_point = v4_sub(result.point, v4_scalar_mul(result.normalv, EPSILON));
+    return(result);
+}
+
+// NOTE: closest hit in (t_min, t_max). Only the current nearest hit is kept
+// and t_max shrinks as we go, so later objects get rejected early.
+internal bool intersect_world(World *world, Ray *ray, f32 t_min, f32 t_max, X *hit)
 {
-    u16 FileType;     
-    u32 FileSize;     
-    u16 Reserved1;    
-    u16 Reserved2;    
-    u32 BitmapOffset;
-    u32 Size;
-    i32 Width;
-    i32 Height;
-    u16 Planes;
-    u16 BitsPerPixel;
-    u32 Compression;
-	u32 SizeOfBitmap;
-	i32 HorzResolution;
-	i32 VertResolution; 
-	u32 ColorsUsed;
-	u32 ColorsImportant;
+    bool result;
+    if(world->bvh.node_count > 0)
+    {
+        result = bvh_closest_hit(world, ray, t_min, t_max, hit);
+    }
+    else
+    {
+        result = sphere_span(world, 0, world->soa.count, ray, t_min, t_max, hit);
+    }
+
+    // NOTE: Spheres are always first in the world, the other types follow
+    // one batch each behind whatever sphere was hit
+    if(world_has_shapes(world) && intersect_shapes(world, ray, t_min, result ? hit->t : t_max, hit))
+    {
+        result = true;
+    }
+    return(result);
+}
 
-}BitMapHeader;
-#pragma pack(pop)
+//
+// NOTE: Render statistics. Ray counts are always kept; the per phase cycle
+// counters cost two rdtsc per phase and only run when profile_phases is on
+// (--bench). Every worker accumulates into its own thread_stats and folds
+// them into the job at the end of each tile.
+//
 
-typedef struct ImageU32
+typedef enum
 {
-    u32 width, height;
-    u32 *pixels;
-} ImageU32;
+    Phase_RayGen,
+    Phase_Intersect,
+    Phase_Shade,
+
+    Phase_Count,
+} RenderPhase;
 
-internal u32 get_pixel_size(ImageU32 image)
+typedef struct
 {
-    return(sizeof(u32)*image.width*image.height);
-}
+    u64 primary_rays;
+    u64 shadow_rays;
+    u64 secondary_rays;
+    u64 cycles[Phase_Count];
+    // NOTE: heap allocations and arena blocks mapped while tracing, should
+    // stay 0 (see dolus_memory.h)
+    u64 allocations;
+} RenderStats;
+
+internal __thread RenderStats thread_stats;
+internal bool profile_phases;
 
-internal void save_to_bpm(ImageU32 image, char *filename)
+#define BEGIN_PHASE(name) u64 phase_start_##name = profile_phases ? __rdtsc() : 0
+#define END_PHASE(name, phase) if(profile_phases) { thread_stats.cycles[phase] += __rdtsc() - phase_start_##name; }
+
+internal void fold_thread_stats(RenderStats *total)
 {
-    BitMapHeader Header = {};
-    
-    u32 OutputPixelSize = get_pixel_size(image);
-    Header.FileType = 0x4D42;     
-    Header.FileSize = sizeof(Header) + OutputPixelSize;     
-    Header.BitmapOffset = sizeof(Header);
-    Header.Size = sizeof(Header) - 14;
-    Header.Width = image.width;
-    Header.Height = image.height;
-    Header.Planes = 1;
-    Header.BitsPerPixel = 32;
-    Header.Compression = 0;
-    Header.SizeOfBitmap = OutputPixelSize;
-    Header.HorzResolution = 0;
-	Header.VertResolution = 0; 
-    Header.ColorsUsed = 0;
-    Header.ColorsImportant = 0;
-
-    FILE *OutFile;
-    OutFile = fopen(filename, "wb");
-    if(OutFile)
-    {
-        fwrite(&Header, sizeof(Header), 1, OutFile);
-        fwrite(image.pixels, OutputPixelSize, 1, OutFile);
-        fclose(OutFile);
-    }
-    else
+    __atomic_add_fetch(&total->primary_rays, thread_stats.primary_rays, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total->shadow_rays, thread_stats.shadow_rays, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total->secondary_rays, thread_stats.secondary_rays, __ATOMIC_RELAXED);
+    for(u32 phase = 0;
+        phase < Phase_Count;
+        ++phase)
     {
-        fprintf(stderr, "[Error] Unable to wirte to file %s\n", filename);
-        exit(1);
+        __atomic_add_fetch(&total->cycles[phase], thread_stats.cycles[phase], __ATOMIC_RELAXED);
     }
+    __atomic_add_fetch(&total->allocations, take_thread_allocations(), __ATOMIC_RELAXED);
+    thread_stats = (RenderStats){0};
 }
 
-void save_to_ppm(ImageU32 image, const char *filename)
+// NOTE: shadow query, true as soon as anything sits in (EPSILON, max_distance)
+// along the ray. No intersection list, no sorting.
+internal bool is_occluded(World *world, Ray *ray, f32 max_distance)
 {
-    FILE *file;
-    file = fopen(filename, "wb");
-    if(!file)
+    ++thread_stats.shadow_rays;
+    bool result;
+    X occluder;
+    if(world->bvh.node_count > 0)
     {
-        printf("Cannot open file");
-        exit(1);
+        result = bvh_occluded(world, ray, max_distance);
+    }
+    else
+    {
+        result = sphere_span(world, 0, world->soa.count, ray, EPSILON, max_distance, &occluder);
     }
 
-    fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
-    for(int y = 0; 
-            y < image.height; 
-            ++y)
+    if(!result && world_has_shapes(world))
     {
-        for(int x = 0; 
-                x < image.width; 
-                ++x)
-        {
+        result = shapes_occluded(world, ray, max_distance);
+    }
+    return(result);
+}
 
-            // TODO: try alpha blending
-            u32 pixel = image.pixels[y * image.width + x];
-            u8 bytes[3] = 
-            {
-                (pixel & 0x0000ff) >> 8*0,
-                (pixel & 0x00ff00) >> 8*1,
-                (pixel & 0xff0000) >> 8*2,
-            };
-            fwrite(bytes, sizeof(bytes), 1, file);
+//
+// NOTE: Soft shadows. An area light is split into a grid of strata, one
+// jittered shadow ray goes to each. With adaptive_shadows the four corners
+// (the rim for a sphere) go first, and when they agree the point counts as
+// fully lit or fully shadowed without the rest. That misses an occluder
+// small enough to sit between the corners, the usual price of the shortcut.
+// The jitter is seeded from the shade point itself, so the result does not
+// depend on which thread, mode or pass got there.
+//
 
-        }
+internal bool adaptive_shadows = true;
 
-    }
-    fclose(file);
+// NOTE: splitmix64 finalizer over the coordinate bits
+extern inline u64 point_seed(v4 point)
+{
+    u32 bits[3];
+    memcpy(bits, &point, sizeof(bits));
+    u64 result = ((u64)bits[0] << 32) ^ ((u64)bits[1] << 16) ^ (u64)bits[2];
+    result = (result ^ (result >> 30)) * 0xbf58476d1ce4e5b9ull;
+    result = (result ^ (result >> 27)) * 0x94d049bb133111ebull;
+    return(result ^ (result >> 31));
 }
 
-internal Computation prepare_computation(World *world, X intersection, Ray *ray)
+// NOTE: (u, v) in [0, 1]^2 to a point on the light. A sphere is sampled on
+// the disk facing the shade point (its silhouette), u is the squared radius
+// so equal strata cover equal area.
+internal v4 light_sample_point(Light *light, v4 point, f32 u, f32 v)
 {
-    Computation result = {};
-    result.t = intersection.t;
-    result.object_index = intersection.object_index;
-    
-    Sphere sphere = world->spheres[result.object_index];
-    
-    result.point = ray_position(*ray, result.t);
-    result.eyev = v4_neg(ray->direction);
-    result.normalv = normal_at_point(sphere, result.point);
-    result.over_point = v4_add(result.point, (v4_scalar_mul(result.normalv, EPSILON)));    
-    if(v4_dot(result.normalv, result.eyev) < 0)
+    v4 result = light->position;
+    if(light->type == Light_Rect)
     {
-        result.inside = true;
-        result.normalv = v4_neg(result.normalv);
+        result = v4_add(result, v4_add(v4_scalar_mul(light->edge_u, u - 0.5f),
+                                       v4_scalar_mul(light->edge_v, v - 0.5f)));
     }
-    else
+    else if(light->type == Light_Sphere)
     {
-        result.inside = false;
+        v4 to_point = v4_normalize(v4_sub(point, light->position));
+        v3 b1, b2;
+        orthonormal_basis(v4_v3(to_point), &b1, &b2);
+        f32 r = light->radius * square_root(u);
+        f32 phi = 2.0f * PI32 * v;
+        v3 offset = v3_add(v3_scalar_mul(b1, r * COS(phi)), v3_scalar_mul(b2, r * SIN(phi)));
+        result = v4_add(result, Vector(offset.x, offset.y, offset.z));
     }
     return(result);
 }
 
-internal WorldIntersects intersect_world(World *world, Ray *ray)
+internal bool light_sample_occluded(World *world, v4 point, v4 target)
 {
-    WorldIntersects result = {};
-    result.intersect_count = 0;
+    v4 V = v4_sub(target, point);
+    Ray r = {};
+    r.origin = point;
+    r.direction = v4_normalize(V);
+    bool result = is_occluded(world, &r, v4_length(V));
+    return(result);
+}
 
-    // NOTE: Spheres are always first in the world
-    for(int sphere_index = 0;
-        sphere_index < world->sphere_count;
-        ++sphere_index)
+// NOTE: fraction of the light point can see, 0 or 1 for point lights
+internal f32 light_visibility(World *world, Light *light, u32 light_index, v4 point)
+{
+    if(light->type == Light_Point || light->samples <= 1)
     {
-        Sphere sphere = world->spheres[sphere_index];
-        Tvalue t = ray_intersect_sphere(*ray, sphere);
+        return(light_sample_occluded(world, point, light->position) ? 0.0f : 1.0f);
+    }
 
-        if(t.hit)
+    if(adaptive_shadows)
+    {
+        // NOTE: corners of the rect, four points on the rim of a sphere
+        u32 visible = 0;
+        for(u32 corner = 0;
+            corner < 4;
+            ++corner)
         {
-            X t_value = {};
-            if(t.t1 > EPSILON)
+            f32 u = (light->type == Light_Rect) ? (f32)(corner & 1) : 1.0f;
+            f32 v = (light->type == Light_Rect) ? (f32)(corner >> 1) : 0.25f * (f32)corner;
+            if(!light_sample_occluded(world, point, light_sample_point(light, point, u, v)))
             {
-                t_value.t = t.t1;
-                t_value.object_index = sphere_index;
-                result.t_values[result.intersect_count++] = t_value;
-                if(t.t2 > EPSILON)
-                {
-                    t_value.t = t.t2;
-                    t_value.object_index = sphere_index;
-                    result.t_values[result.intersect_count++] = t_value;
-                }
+                ++visible;
             }
-            else if(t.t2 > EPSILON)
+        }
+        if(visible == 0 || visible == 4)
+        {
+            return((f32)visible * 0.25f);
+        }
+    }
+
+    u32 grid = (u32)ceilf(square_root((f32)light->samples));
+    f32 cell = 1.0f / (f32)grid;
+    RandomSeries series = random_seed(point_seed(point), light_index);
+    u32 visible = 0;
+    for(u32 j = 0;
+        j < grid;
+        ++j)
+    {
+        for(u32 i = 0;
+            i < grid;
+            ++i)
+        {
+            f32 u = ((f32)i + random_unilateral(&series)) * cell;
+            f32 v = ((f32)j + random_unilateral(&series)) * cell;
+            if(!light_sample_occluded(world, point, light_sample_point(light, point, u, v)))
             {
-                t_value.t = t.t2;
-                t_value.object_index = sphere_index;
-                result.t_values[result.intersect_count++] = t_value;                
+                ++visible;
             }
         }
     }
-
+    f32 result = (f32)visible / (f32)(grid * grid);
     return(result);
 }
 
-internal v3 lightning(World *world, Material material, v4 point, v4 eyev, v4 normalv)
+//
+// NOTE: Many lights. Only the lights whose range holds the shade point are
+// visited (next_light, see dolus_lights.h), the cutoff that sets the ranges
+// is light_cutoff. With light_samples > 0 the visited lights are not all
+// shaded: light_samples of them are drawn with replacement in proportion to
+// an unshadowed estimate (brightness * falloff * cosine), and only those
+// get shadow rays, weighted by one over their pick probability. That keeps
+// the mean and trades the shadow rays of hundreds of lights for noise,
+// which more --spp averages out. The draw is seeded from the shade point
+// like the soft shadow jitter.
+//
+
+#define LIGHT_SAMPLES_MAX 16
+
+internal f32 light_cutoff = LIGHT_CUTOFF;
+internal u32 light_samples = 0;
+
+// NOTE: diffuse and specular of one light at point times weight, added to
+// *diffuse and *specular. The shadow rays are only traced when the light is
+// in front of the surface.
+extern inline void shade_light(World *world, Material *material, u32 light_index, v3 intensity, f32 weight,
+                               v4 point, v4 eyev, v4 normalv, v3 *diffuse, v3 *specular)
+{
+    Light *light = world->lights + light_index;
+    v4 lightv = v4_normalize(v4_sub(light->position, point));
+    f32 light_dot_normal = v4_dot(lightv, normalv);
+    if(light_dot_normal < 0)
+    {
+        return;
+    }
+
+    /// NOTE: test for shadows, soft ones for area lights
+    f32 visibility = light_visibility(world, light, light_index, point);
+    if(visibility > 0.0f)
+    {
+        v3 effective_color = v3_mul(material->color, intensity);
+        *diffuse = v3_add(*diffuse, v3_scalar_mul(effective_color, (material->diffuse * light_dot_normal * visibility * weight)));
+        v4 reflectv = v4_reflect(v4_neg(lightv), normalv);
+        f32 reflect_dot_eye = v4_dot(reflectv, eyev);
+        if(reflect_dot_eye <= 0)
+        {
+            // do nothing
+        }
+        else
+        {
+            f32 factor = POW(reflect_dot_eye, material->shininess);
+            *specular = v3_add(*specular, v3_scalar_mul(intensity, material->specular * factor * visibility * weight));
+        }
+    }
+}
+
+// NOTE: diffuse + specular from every light that can see point, the ambient
+// term goes to *ambient separately since the path tracer has no use for it
+internal v3 direct_lighting(World *world, Material material, v4 point, v4 eyev, v4 normalv, v3 *ambient_out)
 {
     v3 diffuse = {0.0f, 0.0f, 0.0f};
     v3 specular = {0.0f, 0.0f, 0.0f};
     v3 ambient = {0.0f, 0.0f, 0.0f};
 
-    for(int light_index = 0;
-        light_index < world->light_count;
-        ++light_index)
+    LightCursor cursor;
+    begin_lights(world, &cursor, point);
+    u32 light_index;
+    if(light_samples == 0)
     {
-        PointLight light = world->lights[light_index];
-        
-        /// NOTE: test for shadows
-        v4 V = v4_sub(light.position, point);
-        f32 distance = v4_length(V);
-        v4 direction = v4_normalize(V);
-
-        Ray r = {};
-        r.origin = point;
-        r.direction = direction;
-
-        bool is_shadowed = false;
-        WorldIntersects xs = intersect_world(world, &r);
-        if(xs.intersect_count > 0)
+        while(next_light(world, &cursor, &light_index))
+        {
+            v3 intensity = light_intensity_at(world->lights + light_index, point);
+            ambient = v3_add(ambient, v3_scalar_mul(v3_mul(material.color, intensity), material.ambient));
+            shade_light(world, &material, light_index, intensity, 1.0f, point, eyev, normalv, &diffuse, &specular);
+        }
+    }
+    else
+    {
+        // NOTE: weighted reservoir sampling, every pick keeps the light it
+        // has with probability total_before / total, so it ends up holding
+        // each light with probability estimate / total in one pass
+        u32 pick_light[LIGHT_SAMPLES_MAX];
+        f32 pick_estimate[LIGHT_SAMPLES_MAX];
+        v3 pick_intensity[LIGHT_SAMPLES_MAX];
+        f32 total = 0.0f;
+        RandomSeries series = random_seed(point_seed(point), world->light_count);
+        while(next_light(world, &cursor, &light_index))
         {
-            f32 lowest_so_far = FLT_MAX;
-            for(int intersect_index = 0;
-                intersect_index < xs.intersect_count;
-                ++intersect_index)
+            Light *light = world->lights + light_index;
+            v3 intensity = light_intensity_at(light, point);
+            ambient = v3_add(ambient, v3_scalar_mul(v3_mul(material.color, intensity), material.ambient));
+
+            f32 cosine = v4_dot(v4_normalize(v4_sub(light->position, point)), normalv);
+            f32 estimate = (intensity.x + intensity.y + intensity.z) * cosine;
+            if(estimate > 0.0f)
             {
-                // TODO: when I begin to check for -ve hits, refactor?
-                if(xs.t_values[intersect_index].t < lowest_so_far)
+                total += estimate;
+                for(u32 pick = 0;
+                    pick < light_samples;
+                    ++pick)
                 {
-                    lowest_so_far = xs.t_values[intersect_index].t;
+                    if(random_unilateral(&series) * total < estimate)
+                    {
+                        pick_light[pick] = light_index;
+                        pick_estimate[pick] = estimate;
+                        pick_intensity[pick] = intensity;
+                    }
                 }
             }
-
-            if(lowest_so_far < distance)
-            {
-                is_shadowed = true;
-            }
-            else
-            {
-                is_shadowed = false;
-            }
         }
 
-        v3 effective_color = v3_mul(material.color, light.intensity);
-        ambient = v3_add(ambient, v3_scalar_mul(effective_color, material.ambient));
-        if(!is_shadowed)
+        if(total > 0.0f)
         {
-            v4 lightv = v4_normalize(v4_sub(light.position, point));
-            f32 light_dot_normal = v4_dot(lightv, normalv);
-    
-            if(light_dot_normal < 0)
-            {
-                // do nothing
-            }
-            else
+            for(u32 pick = 0;
+                pick < light_samples;
+                ++pick)
             {
-                diffuse = v3_add(diffuse, v3_scalar_mul(effective_color, (material.diffuse * light_dot_normal)));
-                v4 reflectv = v4_reflect(v4_neg(lightv), normalv);
-                f32 reflect_dot_eye = v4_dot(reflectv, eyev);
-                if(reflect_dot_eye <= 0)
-                {
-                    // do nothing
-                }
-                else
-                {
-                    f32 factor = POW(reflect_dot_eye, material.shininess);
-                    specular = v3_add(specular, v3_scalar_mul(light.intensity, material.specular * factor));
-                }
+                f32 weight = total / (pick_estimate[pick] * (f32)light_samples);
+                shade_light(world, &material, pick_light[pick], pick_intensity[pick], weight,
+                            point, eyev, normalv, &diffuse, &specular);
             }
         }
     }
 
-    v3 result = v3_add(ambient, v3_add(diffuse, specular));
+    *ambient_out = ambient;
+    v3 result = v3_add(diffuse, specular);
     return(result);
 }
 
-int main(int argc, char *argv[])
+internal v3 lightning(World *world, Material material, v4 point, v4 eyev, v4 normalv)
 {
-    // v3 BackgroundColor = V3(0.2f, 0.3f, 0.5f);
-    v3 BackgroundColor = V3(0.0f, 0.0f, 0.0f);
-    v3 color1 = V3(0.9, 0.6, 0.75);
-    v3 color2 = V3(0.7, 0.1, 0.25);
-    v3 color3 = v3_mul(color1, color2);
+    v3 ambient;
+    v3 direct = direct_lighting(world, material, point, eyev, normalv, &ambient);
+    v3 result = v3_add(ambient, direct);
+    return(result);
+}
 
-    ImageU32 image = {};
-    image.width = 1280;
-    image.height = 750;
-    // image.width = 100;
-    // image.height = 50;
+typedef enum
+{
+    RenderMode_Pixel,
+    RenderMode_Packet,
+} RenderMode;
 
-    
-    // scene
-    m4x4 transform = m4x4_scale_matrix(V3(10.0f, 0.01f, 10.0f));
-    
-    Sphere floor = sphere(origin(), 1.0f);
-    set_sphere_transform(&floor, transform);
-    floor.material.color = V3(1.0f, 0.9f, 0.9f);
-    floor.material.specular = 0.0f;
+typedef enum
+{
+    // NOTE: phong with shadow rays, ambient stands in for indirect light
+    Integrator_Direct,
+    // NOTE: monte carlo path tracing, see trace_path
+    Integrator_Path,
+} Integrator;
 
-    Sphere left_wall = sphere(origin(), 1.0f);
-    m4x4 translate = m4x4_translation_matrix(V3(0.0f, 0.0f, 5.0f));
-    m4x4 rotationY = m4x4_rotateY_matrix(-PI32/4);
-    m4x4 rotationX = m4x4_rotateX_matrix(PI32/2);
-    
-    m4x4 scale = m4x4_scale_matrix(V3(10.0f, 0.01f, 10.0f));
+typedef struct
+{
+    World *world;
+    Camera *camera;
+    ImageU32 *image;
+    v3 background_color;
+    RenderMode mode;
+    Integrator integrator;
+    // NOTE: indirect bounces per path at most, russian roulette usually
+    // ends them sooner
+    u32 max_bounces;
+    // NOTE: direct integrator, secondary rays per primary ray chain at most
+    // and the least weight one has to carry to be traced at all
+    u32 max_depth;
+    f32 min_contribution;
+    bool quiet;
 
-    transform = m4x4_mul(translate, m4x4_mul(rotationY, m4x4_mul(rotationX, scale)));
-    set_sphere_transform(&left_wall, transform);
-    left_wall.material = floor.material;
+    // NOTE: filled in by render_image from camera
+    RayGenerator rays;
+    RenderStats stats;
 
-    Sphere right_wall = sphere(origin(), 1.0f);
-    translate = m4x4_translation_matrix(V3(0.0f, 0.0f, 5.0f));
-    rotationY = m4x4_rotateY_matrix(PI32/4);
-    rotationX = m4x4_rotateX_matrix(PI32/2);
-    scale = m4x4_scale_matrix(V3(10.0f, 0.01f, 10.0f));
-    
-    transform = m4x4_mul(translate, m4x4_mul(rotationY, m4x4_mul(rotationX, scale)));
-    set_sphere_transform(&right_wall, transform);
-    right_wall.material = floor.material;
+    // NOTE: image can be a band of the frame (see render_image_streaming),
+    // its row 0 is frame row first_row
+    u32 first_row;
 
-    Sphere middle = sphere(origin(), 1.0f);
-    middle.material.color = V3(1.0f, 0.435f, 0.380f);
-    middle.material.diffuse = 0.7f;
-    middle.material.specular = 0.3f;
-    transform = m4x4_translation_matrix(V3(-0.5f, 1.0f, 0.5f));
-    set_sphere_transform(&middle, transform);
+    // NOTE: more than one sample per pixel switches to render_tile_sampled.
+    // With adaptive_threshold > 0 every pixel gets a quarter of the samples
+    // first and only pixels that differ from a neighbour by more than the
+    // threshold (any channel, 0..1) get the rest.
+    u32 samples_per_pixel;
+    f32 adaptive_threshold;
+    u32 sample_seed;
 
-    Sphere right = sphere(origin(), 1.0f);
-    right.material.color = V3(0.816f, 0.549f, 0.549f);
-    right.material.diffuse = 0.7f;
-    right.material.specular = 0.3f;
-    
-    transform = m4x4_mul(m4x4_translation_matrix(V3(1.5f, 0.5f, 0.5f)), m4x4_scale_matrix(V3(0.5f, 0.5f, 0.5f)));
-    set_sphere_transform(&right, transform);
+    u32 tile_size;
+    u32 tile_count_x;
+    u32 tile_count_y;
+    u32 tiles_done;
 
-    Sphere left = sphere(origin(), 1.0f);
-    left.material.color = V3(0.98f, 0.50f, 0.45f);
-    left.material.diffuse = 0.7f;
-    left.material.specular = 0.3f;
-    
-    transform = m4x4_mul(m4x4_translation_matrix(V3(-1.5f, 0.33f, -0.75f)), m4x4_scale_matrix(V3(0.33f, 0.33f, 0.33f)));
-    set_sphere_transform(&left, transform);    
-    
-    PointLight light1 = {0};
-    light1.position = Point(-10.0f, 10.0f, -10.0f);
-    light1.intensity = V3(1.0f, 1.0f, 1.0f);
-
-    PointLight light2 = {0};
-    light2.position = Point(10.0f, 10.0f, -10.0f);
-    light2.intensity = V3(0.35f, 0.2f, 0.35f);
-
-    Sphere spheres[6] = {};
-    spheres[0] = floor;
-    spheres[1] = left_wall;
-    spheres[2] = right_wall;
-    spheres[3] = middle;
-    spheres[4] = right;
-    spheres[5] = left;
-
-    PointLight lights[2] = {};
-    lights[0] = light1;
-    lights[1] = light2;
+    // NOTE: buffers for one frame (stream band, progressive tile order),
+    // reset by begin_render
+    MemoryArena frame_arena;
+} RenderJob;
 
-    World world = {};
-    world.object_count = 6;
-    world.sphere_count = 6;
-    world.spheres = spheres;
-    world.light_count = 2;
-    world.lights = lights;
-    
-    // scene
-    
-    f32 wall_z = 10.0f;
-    f32 wall_height = 7.0f;
-    f32 wall_width = 7.0f;
+// NOTE: n1 is the index on the eye's side, n2 the one across the surface.
+// Only the hit sphere is looked at, a sphere inside another one refracts as
+// if it sat in air.
+internal void refractive_indices(Computation *comp, Material material, f32 *n1, f32 *n2)
+{
+    *n1 = comp->inside ? material.refractive_index : 1.0f;
+    *n2 = comp->inside ? 1.0f : material.refractive_index;
+}
 
-    v4 ray_origin = Point(0.0f, 0.0f, -20.0f);
+// NOTE: false on total internal reflection
+internal bool refract_direction(Computation *comp, f32 n1, f32 n2, v4 *direction)
+{
+    f32 ratio = n1 / n2;
+    f32 cos_i = v4_dot(comp->eyev, comp->normalv);
+    f32 sin2_t = ratio * ratio * (1.0f - cos_i * cos_i);
+    if(sin2_t > 1.0f)
+    {
+        return(false);
+    }
+    f32 cos_t = square_root(1.0f - sin2_t);
+    *direction = v4_sub(v4_scalar_mul(comp->normalv, ratio * cos_i - cos_t), v4_scalar_mul(comp->eyev, ratio));
+    return(true);
+}
 
-    if(image.width > image.height)
+// NOTE: fraction of the light that reflects, schlick's approximation
+internal f32 schlick(Computation *comp, f32 n1, f32 n2)
+{
+    f32 cos_i = v4_dot(comp->eyev, comp->normalv);
+    if(n1 > n2)
     {
-        wall_height = wall_width * ((f32)image.height / (f32)image.width);
+        f32 ratio = n1 / n2;
+        f32 sin2_t = ratio * ratio * (1.0f - cos_i * cos_i);
+        if(sin2_t > 1.0f)
+        {
+            return(1.0f);
+        }
+        cos_i = square_root(1.0f - sin2_t);
     }
-    else if(image.height > image.width)
+    f32 r0 = square((n1 - n2) / (n1 + n2));
+    f32 x = 1.0f - cos_i;
+    f32 result = r0 + (1.0f - r0) * x * x * x * x * x;
+    return(result);
+}
+
+// NOTE: weights of the mirror and the refracted ray leaving this hit. A
+// surface that is both reflective and transparent splits them by fresnel,
+// total internal reflection leaves nothing for the refracted ray.
+internal void secondary_weights(Computation *comp, Material material, f32 *reflect, f32 *refract, v4 *refracted)
+{
+    *reflect = material.reflective;
+    *refract = 0.0f;
+    if(material.transparency > 0.0f)
     {
-        wall_width = wall_height * ((f32)image.width / (f32)image.height);
+        f32 n1, n2;
+        refractive_indices(comp, material, &n1, &n2);
+        if(refract_direction(comp, n1, n2, refracted))
+        {
+            *refract = material.transparency;
+        }
+        if(material.reflective > 0.0f)
+        {
+            f32 reflectance = schlick(comp, n1, n2);
+            *reflect *= reflectance;
+            *refract *= 1.0f - reflectance;
+        }
     }
+}
 
-    f32 pixel_width = wall_width / image.width;
-    f32 pixel_height = wall_height / image.height;
-    f32 half_wall_width = wall_width * 0.5;
-    f32 half_wall_heigth = wall_height * 0.5;
-    
-    u32 OutputPixelSize = get_pixel_size(image);
-    image.pixels = (u32 *)malloc(OutputPixelSize);
-
-    v4 from = Point(0.0f, 1.5f, -5.0f);
-    v4 to = Point(0.0f, 1.0f, 0.0f);
-    v4 up = Vector(0.0f, 1.0f, 0.0f);
-    m4x4 world_view_transform = view_transform(from, to, up);
-
-    Camera cam = camera(image.width, image.height, PI32/3);
-    cam.transform = world_view_transform;
-
-    // NOTE: The y axis is flipped, that's why I am using top to bottom in y
-    u32 *Out = image.pixels;
-    printf("The rays are casting\n");
-    for( int y = image.height - 1;
-         y > 0;
-         --y)
-    {
-        for( int x = 0;
-             x < image.width;
-             ++x)
-        {
-            f32 x_offset = (x + 0.5) * cam.pixel_size;
-            f32 y_offset = (y + 0.5) * cam.pixel_size;
-
-            f32 worldX = cam.half_width - x_offset;
-            f32 worldY = cam.half_height - y_offset;
-
-            m4x4 invert = {};
-            m4x4_invert(cam.transform, &invert);
-            v4 pixel = m4x4_mul_v4(invert, Point(worldX, worldY, -1));
-            v4 origin = m4x4_mul_v4(invert, Point(0.0f, 0.0f, 0.0f));
-            v4 direction = v4_normalize(v4_sub(pixel, origin));
-            
-            Ray r = {};
-            r.origin = origin;
-            r.direction = direction;
-
-            WorldIntersects xs = intersect_world(&world, &r);
-            if(xs.intersect_count > 0)
-            {
-                f32 lowest_so_far = FLT_MAX;
-                int lowest_index = 0;
-                for(int intersect_index = 0;
-                    intersect_index < xs.intersect_count;
-                    ++intersect_index)
-                {
-                    if(xs.t_values[intersect_index].t < lowest_so_far)
-                    {
-                        lowest_so_far = xs.t_values[intersect_index].t;
-                        lowest_index = intersect_index;
-                    }
-                }
-                Computation comp = prepare_computation(&world, xs.t_values[lowest_index], &r);
+internal v3 shade_hit_color(RenderJob *job, Ray *r, X hit, u32 depth, f32 weight);
+
+// NOTE: weight is how much the result ends up counting in the pixel, the
+// product of every reflect/refract weight on the way here
+internal v3 trace_secondary(RenderJob *job, v4 origin, v4 direction, u32 depth, f32 weight)
+{
+    Ray ray = {};
+    ray.origin = origin;
+    ray.direction = direction;
+    ++thread_stats.secondary_rays;
+
+    v3 result = job->background_color;
+    X hit = {};
+    if(intersect_world(job->world, &ray, EPSILON, F32MAX, &hit))
+    {
+        result = shade_hit_color(job, &ray, hit, depth, weight);
+    }
+    return(result);
+}
+
+// NOTE: phong plus the mirror and refracted rays. depth counts the
+// secondary rays on the way here; at job->max_depth, or once a ray would
+// count for less than job->min_contribution, no more are spawned.
+internal v3 shade_hit_color(RenderJob *job, Ray *r, X hit, u32 depth, f32 weight)
+{
+    World *world = job->world;
+    Computation comp = prepare_computation(world, hit, r);
+    Material material = *object_material(world, comp.object_index);
                     
-                v4 point = comp.over_point;
-                v4 normal = comp.normalv;
-                v4 eye = comp.eyev;
+    v4 point = comp.over_point;
+    v4 normal = comp.normalv;
+    v4 eye = comp.eyev;
 
-                v3 color = lightning(&world, world.spheres[comp.object_index].material, point, eye, normal);
-                *Out++ = pack_color_little(color);
-            }
-            else
+    v3 color = lightning(world, material, point, eye, normal);
+
+    if((material.reflective > 0.0f || material.transparency > 0.0f) && depth < job->max_depth)
+    {
+        f32 reflect, refract;
+        v4 refracted;
+        secondary_weights(&comp, material, &reflect, &refract, &refracted);
+        if(weight * reflect >= job->min_contribution)
+        {
+            v4 reflected = v4_reflect(r->direction, normal);
+            v3 incoming = trace_secondary(job, comp.over_point, reflected, depth + 1, weight * reflect);
+            color = v3_add(color, v3_scalar_mul(incoming, reflect));
+        }
+        if(weight * refract >= job->min_contribution)
+        {
+            v3 incoming = trace_secondary(job, comp.under_point, refracted, depth + 1, weight * refract);
+            color = v3_add(color, v3_scalar_mul(incoming, refract));
+        }
+    }
+    return(color);
+}
+
+#define RUSSIAN_ROULETTE_BOUNCE 3
+
+// NOTE: radiance along ray, which already hit something at hit. Every vertex
+// gets next event estimation to each point light (direct_lighting, same
+// convention as the direct integrator: a light's intensity is what a white
+// surface facing it reflects, divided down only for lights with falloff)
+// and then continues in a cosine distributed direction. Lambert's brdf
+// over that pdf leaves just the albedo (color * diffuse) in the throughput.
+// Reflective and transparent materials can send the path on as a mirror or
+// refracted ray instead, weighted like shade_hit_color weights them. Paths
+// that escape pick up the background, the ambient term is not used since
+// this is what it fakes.
+// From RUSSIAN_ROULETTE_BOUNCE on a path survives with probability of its
+// brightest throughput channel and is scaled up to stay unbiased.
+internal v3 trace_path(RenderJob *job, Ray ray, X hit, RandomSeries *series)
+{
+    World *world = job->world;
+    v3 result = V3(0.0f, 0.0f, 0.0f);
+    v3 throughput = V3(1.0f, 1.0f, 1.0f);
+
+    for(u32 bounce = 0;
+        ;
+        ++bounce)
+    {
+        Computation comp = prepare_computation(world, hit, &ray);
+        Material material = *object_material(world, comp.object_index);
+
+        v3 ambient;
+        v3 direct = direct_lighting(world, material, comp.over_point, comp.eyev, comp.normalv, &ambient);
+        result = v3_add(result, v3_mul(throughput, direct));
+
+        if(bounce >= job->max_bounces)
+        {
+            break;
+        }
+
+        // NOTE: the way on is one of diffuse, mirror or refracted, picked
+        // uniformly among the ones the material has and weighted up by
+        // their count. Plain diffuse materials draw nothing for the choice.
+        f32 reflect = 0.0f;
+        f32 refract = 0.0f;
+        v4 refracted = {};
+        if(material.reflective > 0.0f || material.transparency > 0.0f)
+        {
+            secondary_weights(&comp, material, &reflect, &refract, &refracted);
+        }
+        u32 event_count = 1 + (reflect > 0.0f) + (refract > 0.0f);
+        u32 event = (event_count > 1) ? random_choice(series, event_count) : 0;
+        bool diffuse = (event == 0);
+        bool mirror = (event == 1) && (reflect > 0.0f);
+
+        v3 event_weight;
+        if(diffuse)
+        {
+            event_weight = v3_scalar_mul(material.color, material.diffuse);
+        }
+        else
+        {
+            f32 specular_weight = mirror ? reflect : refract;
+            event_weight = V3(specular_weight, specular_weight, specular_weight);
+        }
+        if(event_count > 1)
+        {
+            event_weight = v3_scalar_mul(event_weight, (f32)event_count);
+        }
+
+        throughput = v3_mul(throughput, event_weight);
+        f32 brightest = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+        if(brightest <= 0.0f)
+        {
+            break;
+        }
+        if(bounce + 1 >= RUSSIAN_ROULETTE_BOUNCE)
+        {
+            f32 survival = clamp(brightest, 0.05f, 0.95f);
+            if(random_unilateral(series) >= survival)
             {
-                *Out++ = pack_color_little(BackgroundColor);
+                break;
             }
+            throughput = v3_scalar_mul(throughput, 1.0f / survival);
+        }
+
+        if(diffuse)
+        {
+            v3 direction = random_cosine_hemisphere(series, v4_v3(comp.normalv));
+            ray.origin = comp.over_point;
+            ray.direction = Vector(direction.x, direction.y, direction.z);
         }
-        printf("\rThe rays are casting: row %d...   ", y);
+        else if(mirror)
+        {
+            ray.origin = comp.over_point;
+            ray.direction = v4_reflect(ray.direction, comp.normalv);
+        }
+        else
+        {
+            ray.origin = comp.under_point;
+            ray.direction = refracted;
+        }
+        ++thread_stats.secondary_rays;
+        if(!intersect_world(world, &ray, EPSILON, F32MAX, &hit))
+        {
+            result = v3_add(result, v3_mul(throughput, job->background_color));
+            break;
+        }
+    }
+    return(result);
+}
+
+// NOTE: series is only drawn from by the path integrator, direct shading
+// takes 0
+internal v3 shade_sample(RenderJob *job, Ray *r, X hit, RandomSeries *series)
+{
+    v3 result;
+    if(job->integrator == Integrator_Path)
+    {
+        result = trace_path(job, *r, hit, series);
+    }
+    else
+    {
+        result = shade_hit_color(job, r, hit, 0, 1.0f);
+    }
+    return(result);
+}
+
+internal v3 trace_color(RenderJob *job, Ray *r, RandomSeries *series)
+{
+    v3 result = job->background_color;
+    X hit = {};
+
+    BEGIN_PHASE(intersect);
+    bool found = intersect_world(job->world, r, EPSILON, F32MAX, &hit);
+    END_PHASE(intersect, Phase_Intersect);
+
+    if(found)
+    {
+        BEGIN_PHASE(shade);
+        result = shade_sample(job, r, hit, series);
+        END_PHASE(shade, Phase_Shade);
+    }
+    return(result);
+}
+
+internal u32 trace_pixel(RenderJob *job, Ray *r)
+{
+    return(pack_color_little(trace_color(job, r, 0)));
+}
+
+// NOTE: up to PACKET_WIDTH rays. The packet only does the visibility part,
+// hits are then shaded one lane after the other, so lanes draw from series
+// in the same order trace_color would one ray after the other.
+internal void trace_packet(RenderJob *job, Ray *rays, u32 count, v3 *colors, RandomSeries *series)
+{
+    RayPacket packet = {};
+    for(u32 lane = 0;
+        lane < count;
+        ++lane)
+    {
+        packet_set_ray(&packet, lane, rays + lane);
+    }
+
+    // NOTE: the triangle of a mesh hit, spheres have none
+    u32 primitive[PACKET_WIDTH] = {};
+    BEGIN_PHASE(intersect);
+    packet_closest_hit(job->world, &packet);
+    if(world_has_shapes(job->world))
+    {
+        // NOTE: the other shape types go lane by lane behind the sphere hits,
+        // t_max is still F32MAX on lanes that missed
+        for(u32 lane = 0;
+            lane < count;
+            ++lane)
+        {
+            X hit = {};
+            if(intersect_shapes(job->world, rays + lane, EPSILON, packet.t_max[lane], &hit))
+            {
+                packet.t_max[lane] = hit.t;
+                packet.object_index[lane] = hit.object_index;
+                primitive[lane] = hit.primitive;
+            }
+        }
+    }
+    END_PHASE(intersect, Phase_Intersect);
+
+    BEGIN_PHASE(shade);
+    for(u32 lane = 0;
+        lane < count;
+        ++lane)
+    {
+        if(packet.object_index[lane] >= 0)
+        {
+            X hit = {};
+            hit.t = packet.t_max[lane];
+            hit.object_index = packet.object_index[lane];
+            hit.primitive = primitive[lane];
+            colors[lane] = shade_sample(job, rays + lane, hit, series);
+        }
+        else
+        {
+            colors[lane] = job->background_color;
+        }
+    }
+    END_PHASE(shade, Phase_Shade);
+}
+
+// NOTE: up to PACKET_WIDTH pixels of one row starting at x
+internal void render_packet(RenderJob *job, u32 x, u32 y, u32 count, u32 *Out)
+{
+    Ray rays[PACKET_WIDTH];
+    BEGIN_PHASE(ray_gen);
+    generate_ray_row(&job->rays, x, y, count, rays);
+    END_PHASE(ray_gen, Phase_RayGen);
+
+    v3 colors[PACKET_WIDTH];
+    trace_packet(job, rays, count, colors, 0);
+    for(u32 lane = 0;
+        lane < count;
+        ++lane)
+    {
+        Out[lane] = pack_color_little(colors[lane]);
+    }
+    thread_stats.primary_rays += count;
+}
+
+internal void finish_tile(RenderJob *job, u32 thread_index)
+{
+    fold_thread_stats(&job->stats);
+
+    u32 tile_count = job->tile_count_x * job->tile_count_y;
+    u32 done = __atomic_add_fetch(&job->tiles_done, 1, __ATOMIC_RELAXED);
+    if(thread_index == 0 && !job->quiet)
+    {
+        printf("\rThe rays are casting: tile %u/%u...   ", done, tile_count);
+        fflush(stdout);
+    }
+}
+
+// NOTE: The y axis is flipped, image row 0 is camera row (height - 1), which
+// is also what bmp wants since it stores rows bottom-up.
+internal void render_tile(void *data, u32 tile_index, u32 thread_index)
+{
+    RenderJob *job = (RenderJob *)data;
+    ImageU32 *image = job->image;
+
+    u32 min_x = (tile_index % job->tile_count_x) * job->tile_size;
+    u32 min_row = (tile_index / job->tile_count_x) * job->tile_size;
+    u32 max_x = min_x + job->tile_size;
+    u32 max_row = min_row + job->tile_size;
+    if(max_x > image->width)
+    {
+        max_x = image->width;
+    }
+    if(max_row > image->height)
+    {
+        max_row = image->height;
+    }
+
+    for(u32 row = min_row;
+        row < max_row;
+        ++row)
+    {
+        u32 y = job->rays.v_size - 1 - (job->first_row + row);
+        u32 *Out = image->pixels + row * image->width + min_x;
+        if(job->mode == RenderMode_Packet)
+        {
+            for(u32 x = min_x;
+                x < max_x;
+                x += PACKET_WIDTH)
+            {
+                u32 count = (max_x - x < PACKET_WIDTH) ? (max_x - x) : PACKET_WIDTH;
+                render_packet(job, x, y, count, Out);
+                Out += count;
+            }
+        }
+        else
+        {
+            // NOTE: same row chunks as the packet path so both trace
+            // exactly the same rays
+            for(u32 x = min_x;
+                x < max_x;
+                x += PACKET_WIDTH)
+            {
+                u32 count = (max_x - x < PACKET_WIDTH) ? (max_x - x) : PACKET_WIDTH;
+                Ray rays[PACKET_WIDTH];
+                BEGIN_PHASE(ray_gen);
+                generate_ray_row(&job->rays, x, y, count, rays);
+                END_PHASE(ray_gen, Phase_RayGen);
+                thread_stats.primary_rays += count;
+                for(u32 i = 0;
+                    i < count;
+                    ++i)
+                {
+                    *Out++ = trace_pixel(job, rays + i);
+                }
+            }
+        }
+    }
+
+    finish_tile(job, thread_index);
+}
+
+#define MAX_SAMPLES_PER_PIXEL 256
+
+// NOTE: path tracing needs a random series per sample, so it always goes
+// through sample_pixel even at one sample per pixel
+extern inline bool uses_sample_pixel(RenderJob *job)
+{
+    bool result = (job->samples_per_pixel > 1) || (job->integrator == Integrator_Path);
+    return(result);
+}
+
+// NOTE: count samples of pixel (x, y), summed. The pattern is n-rooks:
+// sample i sits in column stratum i and row stratum permutation[i], jittered
+// inside both, so every row and column of the pixel gets exactly one. The
+// series is seeded from the pixel and pass alone, so whichever thread (or
+// neighbouring tile, see render_tile_sampled) asks gets the same samples,
+// paths included since they keep drawing from the same series.
+internal v3 sample_pixel(RenderJob *job, u32 x, u32 y, u32 pass, u32 count)
+{
+    RandomSeries series = random_seed(((u64)y << 32) | x, ((u64)job->sample_seed << 1) | pass);
+
+    u8 permutation[MAX_SAMPLES_PER_PIXEL];
+    for(u32 i = 0; i < count; ++i)
+    {
+        permutation[i] = (u8)i;
+    }
+    for(u32 i = count - 1; i > 0; --i)
+    {
+        u32 j = random_choice(&series, i + 1);
+        u8 swap = permutation[i];
+        permutation[i] = permutation[j];
+        permutation[j] = swap;
+    }
+
+    Ray rays[MAX_SAMPLES_PER_PIXEL];
+    BEGIN_PHASE(ray_gen);
+    f32 stratum = 1.0f / (f32)count;
+    for(u32 i = 0; i < count; ++i)
+    {
+        f32 dx = ((f32)i + random_unilateral(&series)) * stratum - 0.5f;
+        f32 dy = ((f32)permutation[i] + random_unilateral(&series)) * stratum - 0.5f;
+        rays[i] = generate_ray_offset(&job->rays, x, y, dx, dy);
+    }
+    END_PHASE(ray_gen, Phase_RayGen);
+    thread_stats.primary_rays += count;
+
+    v3 result = V3(0.0f, 0.0f, 0.0f);
+    if(job->mode == RenderMode_Packet)
+    {
+        // NOTE: the samples of one pixel make about the most coherent packet
+        // there is
+        for(u32 first = 0; first < count; first += PACKET_WIDTH)
+        {
+            u32 lane_count = (count - first < PACKET_WIDTH) ? (count - first) : PACKET_WIDTH;
+            v3 colors[PACKET_WIDTH];
+            trace_packet(job, rays + first, lane_count, colors, &series);
+            for(u32 lane = 0; lane < lane_count; ++lane)
+            {
+                result = v3_add(result, colors[lane]);
+            }
+        }
+    }
+    else
+    {
+        for(u32 i = 0; i < count; ++i)
+        {
+            result = v3_add(result, trace_color(job, rays + i, &series));
+        }
+    }
+    return(result);
+}
+
+extern inline f32 max_channel_difference(v3 a, v3 b)
+{
+    f32 result = fabsf(a.x - b.x);
+    result = (fabsf(a.y - b.y) > result) ? fabsf(a.y - b.y) : result;
+    result = (fabsf(a.z - b.z) > result) ? fabsf(a.z - b.z) : result;
+    return(result);
+}
+
+internal void render_tile_sampled(void *data, u32 tile_index, u32 thread_index)
+{
+    RenderJob *job = (RenderJob *)data;
+    ImageU32 *image = job->image;
+
+    u32 min_x = (tile_index % job->tile_count_x) * job->tile_size;
+    u32 min_row = (tile_index / job->tile_count_x) * job->tile_size;
+    u32 max_x = min_x + job->tile_size;
+    u32 max_row = min_row + job->tile_size;
+    if(max_x > image->width)
+    {
+        max_x = image->width;
+    }
+    if(max_row > image->height)
+    {
+        max_row = image->height;
+    }
+
+    u32 samples = job->samples_per_pixel;
+    if(job->adaptive_threshold <= 0.0f)
+    {
+        f32 inv_samples = 1.0f / (f32)samples;
+        for(u32 row = min_row;
+            row < max_row;
+            ++row)
+        {
+            u32 y = job->rays.v_size - 1 - (job->first_row + row);
+            u32 *Out = image->pixels + row * image->width;
+            for(u32 x = min_x;
+                x < max_x;
+                ++x)
+            {
+                Out[x] = pack_color_little(v3_scalar_mul(sample_pixel(job, x, y, 0, samples), inv_samples));
+            }
+        }
+    }
+    else
+    {
+        // NOTE: the base pass also covers a one pixel apron around the tile
+        // (in frame coordinates, so across band edges too) and pixels on the
+        // tile edge get compared with the tile next door. The apron is
+        // traced twice, once per tile, with identical samples.
+        u32 base_samples = (samples >= 4) ? (samples / 4) : 1;
+        f32 inv_base = 1.0f / (f32)base_samples;
+        u32 min_y = job->rays.v_size - 1 - (job->first_row + max_row - 1);
+        u32 max_y = job->rays.v_size - (job->first_row + min_row);
+        u32 apron_min_x = (min_x > 0) ? (min_x - 1) : 0;
+        u32 apron_max_x = (max_x < job->rays.h_size) ? (max_x + 1) : max_x;
+        u32 apron_min_y = (min_y > 0) ? (min_y - 1) : 0;
+        u32 apron_max_y = (max_y < job->rays.v_size) ? (max_y + 1) : max_y;
+        u32 apron_width = apron_max_x - apron_min_x;
+        u32 apron_height = apron_max_y - apron_min_y;
+
+        TemporaryMemory temp = begin_temporary_memory(&scratch_arena);
+        v3 *base = PUSH_ARRAY(&scratch_arena, apron_width * apron_height, v3);
+        for(u32 y = apron_min_y; y < apron_max_y; ++y)
+        {
+            for(u32 x = apron_min_x; x < apron_max_x; ++x)
+            {
+                base[(y - apron_min_y) * apron_width + (x - apron_min_x)] = sample_pixel(job, x, y, 0, base_samples);
+            }
+        }
+
+        f32 inv_samples = 1.0f / (f32)samples;
+        for(u32 y = min_y; y < max_y; ++y)
+        {
+            u32 row = (job->rays.v_size - 1 - y) - job->first_row;
+            u32 *Out = image->pixels + row * image->width;
+            for(u32 x = min_x; x < max_x; ++x)
+            {
+                v3 *center = base + (y - apron_min_y) * apron_width + (x - apron_min_x);
+                v3 mean = v3_scalar_mul(*center, inv_base);
+                f32 contrast = 0.0f;
+                if(x > apron_min_x)
+                {
+                    contrast = fmaxf(contrast, max_channel_difference(mean, v3_scalar_mul(center[-1], inv_base)));
+                }
+                if(x + 1 < apron_max_x)
+                {
+                    contrast = fmaxf(contrast, max_channel_difference(mean, v3_scalar_mul(center[1], inv_base)));
+                }
+                if(y > apron_min_y)
+                {
+                    contrast = fmaxf(contrast, max_channel_difference(mean, v3_scalar_mul(center[-(i32)apron_width], inv_base)));
+                }
+                if(y + 1 < apron_max_y)
+                {
+                    contrast = fmaxf(contrast, max_channel_difference(mean, v3_scalar_mul(center[apron_width], inv_base)));
+                }
+
+                v3 color = mean;
+                if(contrast > job->adaptive_threshold && samples > base_samples)
+                {
+                    v3 sum = v3_add(*center, sample_pixel(job, x, y, 1, samples - base_samples));
+                    color = v3_scalar_mul(sum, inv_samples);
+                }
+                Out[x] = pack_color_little(color);
+            }
+        }
+        end_temporary_memory(temp);
+    }
+
+    finish_tile(job, thread_index);
+}
+
+// NOTE: everything a render pass over a width x height frame needs before
+// tiles go out, shared by the whole frame, streaming and progressive paths
+internal void begin_render(RenderJob *job, u32 width, u32 height)
+{
+    if(job->tile_size == 0)
+    {
+        job->tile_size = 32;
+    }
+    if(job->samples_per_pixel == 0)
+    {
+        job->samples_per_pixel = 1;
+    }
+    job->tile_count_x = (width + job->tile_size - 1) / job->tile_size;
+    job->tile_count_y = (height + job->tile_size - 1) / job->tile_size;
+    job->tiles_done = 0;
+    job->first_row = 0;
+    job->rays = ray_generator(job->camera);
+    job->stats = (RenderStats){0};
+    reset_arena(&job->frame_arena);
+}
+
+// NOTE: with --threads 1 the calling thread traces the tiles too. Whatever
+// it allocated since the last dispatch (the frame arena, the image writer)
+// is not counted against them.
+internal void dispatch_tiles(ThreadPool *pool, u32 task_count, thread_task *task, void *data)
+{
+    take_thread_allocations();
+    thread_pool_dispatch(pool, task_count, task, data);
+}
+
+internal thread_task *tile_task(RenderJob *job)
+{
+    thread_task *result = uses_sample_pixel(job) ? render_tile_sampled : render_tile;
+    return(result);
+}
+
+internal void render_image(ThreadPool *pool, RenderJob *job)
+{
+    begin_render(job, job->image->width, job->image->height);
+    dispatch_tiles(pool, job->tile_count_x * job->tile_count_y, tile_task(job), job);
+}
+
+// NOTE: --stream. Renders the frame one band of tile_size rows at a time into
+// a band sized buffer and hands each band to the image writer right away.
+// Bands go in the order the format stores rows (bmp bottom up, the others
+// top down) so memory stays at width * tile_size pixels however tall the
+// frame is.
+internal void render_image_streaming(ThreadPool *pool, RenderJob *job, u32 width, u32 height, char *filename)
+{
+    begin_render(job, width, height);
+
+    ImageWriter writer;
+    if(!begin_image(&writer, filename, width, height))
+    {
+        exit(1);
+    }
+    bool bottom_up = writer.format->bottom_up;
+
+    ImageU32 band = {};
+    band.width = width;
+    band.height = job->tile_size;
+    band.pixels = (u32 *)push_size(&job->frame_arena, get_pixel_size(band), 64);
+
+    bool quiet = job->quiet;
+    job->quiet = true;
+    job->image = &band;
+    job->tile_count_y = 1;
+
+    u32 band_count = (height + job->tile_size - 1) / job->tile_size;
+    for(u32 band_step = 0;
+        band_step < band_count;
+        ++band_step)
+    {
+        u32 band_index = bottom_up ? band_step : (band_count - 1 - band_step);
+        job->first_row = band_index * job->tile_size;
+        band.height = (height - job->first_row < job->tile_size) ? (height - job->first_row) : job->tile_size;
+        job->tiles_done = 0;
+        dispatch_tiles(pool, job->tile_count_x, tile_task(job), job);
+
+        for(u32 index = 0;
+            index < band.height;
+            ++index)
+        {
+            u32 row = bottom_up ? index : (band.height - 1 - index);
+            write_image_row(&writer, band.pixels + row * width);
+        }
+
+        if(!quiet)
+        {
+            printf("\rThe rays are casting: band %u/%u...   ", band_step + 1, band_count);
+            fflush(stdout);
+        }
+    }
+
+    if(!end_image(&writer))
+    {
+        fprintf(stderr, "[Error] Unable to wirte to file %s\n", filename);
+        exit(1);
+    }
+    job->quiet = quiet;
+    job->image = 0;
+    job->first_row = 0;
+}
+
+internal void build_demo_scene(World *world)
+{
+    // NOTE: the three planes share the wall
+    Material *materials = PUSH_ARRAY(&world->arena, 5, Material);
+    materials[DEFAULT_MATERIAL] = material();
+    u32 wall = 1;
+    materials[wall] = material();
+    materials[wall].color = V3(1.0f, 0.9f, 0.9f);
+    materials[wall].specular = 0.0f;
+    for(u32 material_index = 2;
+        material_index < 5;
+        ++material_index)
+    {
+        materials[material_index] = material();
+        materials[material_index].diffuse = 0.7f;
+        materials[material_index].specular = 0.3f;
+    }
+    materials[2].color = V3(1.0f, 0.435f, 0.380f);
+    materials[3].color = V3(0.816f, 0.549f, 0.549f);
+    materials[4].color = V3(0.98f, 0.50f, 0.45f);
+
+    Plane floor = plane(m4x4_identity());
+    floor.material_index = wall;
+
+    m4x4 translate = m4x4_translation_matrix(V3(0.0f, 0.0f, 5.0f));
+    m4x4 rotationY = m4x4_rotateY_matrix(-PI32/4);
+    m4x4 rotationX = m4x4_rotateX_matrix(PI32/2);
+    Plane left_wall = plane(m4x4_mul(translate, m4x4_mul(rotationY, rotationX)));
+    left_wall.material_index = wall;
+
+    rotationY = m4x4_rotateY_matrix(PI32/4);
+    Plane right_wall = plane(m4x4_mul(translate, m4x4_mul(rotationY, rotationX)));
+    right_wall.material_index = wall;
+
+    Sphere middle = sphere(origin(), 1.0f);
+    middle.material_index = 2;
+    m4x4 transform = m4x4_translation_matrix(V3(-0.5f, 1.0f, 0.5f));
+    set_sphere_transform(&middle, transform);
+
+    Sphere right = sphere(origin(), 1.0f);
+    right.material_index = 3;
+    
+    transform = m4x4_mul(m4x4_translation_matrix(V3(1.5f, 0.5f, 0.5f)), m4x4_scale_matrix(V3(0.5f, 0.5f, 0.5f)));
+    set_sphere_transform(&right, transform);
+
+    Sphere left = sphere(origin(), 1.0f);
+    left.material_index = 4;
+    
+    transform = m4x4_mul(m4x4_translation_matrix(V3(-1.5f, 0.33f, -0.75f)), m4x4_scale_matrix(V3(0.33f, 0.33f, 0.33f)));
+    set_sphere_transform(&left, transform);    
+    
+    Light light1 = point_light(Point(-10.0f, 10.0f, -10.0f), V3(1.0f, 1.0f, 1.0f));
+    Light light2 = point_light(Point(10.0f, 10.0f, -10.0f), V3(0.35f, 0.2f, 0.35f));
+
+    Sphere *spheres = PUSH_ARRAY(&world->arena, 3, Sphere);
+    spheres[0] = middle;
+    spheres[1] = right;
+    spheres[2] = left;
+
+    Plane *planes = PUSH_ARRAY(&world->arena, 3, Plane);
+    planes[0] = floor;
+    planes[1] = left_wall;
+    planes[2] = right_wall;
+
+    Light *lights = PUSH_ARRAY(&world->arena, 2, Light);
+    lights[0] = light1;
+    lights[1] = light2;
+
+    world->sphere_count = 3;
+    world->spheres = spheres;
+    world->plane_count = 3;
+    world->planes = planes;
+    world->material_count = 5;
+    world->materials = materials;
+    world->light_count = 2;
+    world->lights = lights;
+    count_objects(world);
+}
+
+// NOTE: the demo floor, the demo lights and sphere_count small spheres
+// scattered through a box in front of the camera. Used to show how
+// intersect_world scales, not to look nice.
+internal void build_stress_scene(World *world, u32 sphere_count, u32 seed)
+{
+    thread_random = random_seed(seed, 0);
+
+    Sphere *spheres = PUSH_ARRAY(&world->arena, sphere_count, Sphere);
+
+    // NOTE: the default, the floor and one per sphere
+    u32 material_count = sphere_count + 2;
+    Material *materials = PUSH_ARRAY(&world->arena, material_count, Material);
+    materials[DEFAULT_MATERIAL] = material();
+    materials[1] = material();
+    materials[1].color = V3(1.0f, 0.9f, 0.9f);
+    materials[1].specular = 0.0f;
+
+    Plane *floor = PUSH_STRUCT(&world->arena, Plane);
+    *floor = plane(m4x4_identity());
+    floor->material_index = 1;
+
+    v3 box_min = V3(-6.0f, 0.0f, 0.0f);
+    v3 box_max = V3(6.0f, 4.0f, 12.0f);
+    v3 box_size = v3_sub(box_max, box_min);
+    f32 cell = cbrtf((box_size.x * box_size.y * box_size.z) / (f32)sphere_count);
+    f32 max_radius = 0.45f * cell;
+
+    for(u32 sphere_index = 0;
+        sphere_index < sphere_count;
+        ++sphere_index)
+    {
+        v3 center = V3(f32_random_within(box_min.x, box_max.x),
+                       f32_random_within(box_min.y, box_max.y),
+                       f32_random_within(box_min.z, box_max.z));
+        f32 radius = f32_random_within(0.25f * max_radius, max_radius);
+
+        Material *m = materials + 2 + sphere_index;
+        *m = material();
+        m->color = V3(f32_random_within(0.2f, 1.0f), f32_random_within(0.2f, 1.0f), f32_random_within(0.2f, 1.0f));
+        m->diffuse = 0.7f;
+        m->specular = 0.3f;
+
+        Sphere s = sphere(origin(), 1.0f);
+        s.material_index = 2 + sphere_index;
+        set_sphere_transform(&s, m4x4_mul(m4x4_translation_matrix(center), m4x4_scale_matrix(V3(radius, radius, radius))));
+        spheres[sphere_index] = s;
+    }
+
+    Light *lights = PUSH_ARRAY(&world->arena, 2, Light);
+    lights[0] = point_light(Point(-10.0f, 10.0f, -10.0f), V3(1.0f, 1.0f, 1.0f));
+    lights[1] = point_light(Point(10.0f, 10.0f, -10.0f), V3(0.35f, 0.2f, 0.35f));
+
+    world->sphere_count = sphere_count;
+    world->spheres = spheres;
+    world->plane_count = 1;
+    world->planes = floor;
+    world->material_count = material_count;
+    world->materials = materials;
+    world->light_count = 2;
+    world->lights = lights;
+    count_objects(world);
+}
+
+// NOTE: the demo floor and lights with one bumpy sphere mesh of about
+// triangle_count triangles placed five times, so the triangles are stored
+// once and the tlas has something to sort. Rings of the lat/long grid run
+// pole to pole, the poles are single vertices.
+internal void build_mesh_stress_scene(World *world, u32 triangle_count)
+{
+    u32 rings = (u32)square_root((f32)triangle_count / 4.0f);
+    if(rings < 3)
+    {
+        rings = 3;
+    }
+    u32 segments = 2 * rings;
+
+    MeshBuffer buffer = {};
+    begin_mesh(&buffer, "bumpy", 5);
+    for(u32 ring = 1;
+        ring < rings;
+        ++ring)
+    {
+        f32 theta = PI32 * (f32)ring / (f32)rings;
+        for(u32 segment = 0;
+            segment < segments;
+            ++segment)
+        {
+            f32 phi = 2.0f * PI32 * (f32)segment / (f32)segments;
+            f32 radius = 1.0f + 0.04f * SIN(12.0f * theta) * SIN(12.0f * phi);
+            add_mesh_vertex(&buffer, V3(radius * SIN(theta) * COS(phi), radius * COS(theta), radius * SIN(theta) * SIN(phi)));
+        }
+    }
+    u32 north = buffer.vertex_count;
+    add_mesh_vertex(&buffer, V3(0.0f, 1.0f, 0.0f));
+    u32 south = buffer.vertex_count;
+    add_mesh_vertex(&buffer, V3(0.0f, -1.0f, 0.0f));
+
+    for(u32 segment = 0;
+        segment < segments;
+        ++segment)
+    {
+        u32 next = (segment + 1) % segments;
+        add_mesh_triangle(&buffer, north, next, segment);
+        u32 last_ring = (rings - 2) * segments;
+        add_mesh_triangle(&buffer, south, last_ring + segment, last_ring + next);
+        for(u32 ring = 0;
+            ring + 2 < rings;
+            ++ring)
+        {
+            u32 a = ring * segments + segment;
+            u32 b = ring * segments + next;
+            add_mesh_triangle(&buffer, a, b, a + segments);
+            add_mesh_triangle(&buffer, b, b + segments, a + segments);
+        }
+    }
+    finish_mesh(&buffer);
+    mesh_buffer_to_world(&buffer, world);
+
+    v3 placements[5][2] =
+    {
+        {V3(0.0f, 1.0f, 0.5f), V3(1.0f, 1.0f, 1.0f)},
+        {V3(-2.2f, 0.6f, 1.5f), V3(0.6f, 0.6f, 0.6f)},
+        {V3(2.2f, 0.6f, 1.5f), V3(0.6f, 0.6f, 0.6f)},
+        {V3(-1.2f, 0.35f, -1.0f), V3(0.35f, 0.35f, 0.35f)},
+        {V3(1.2f, 0.35f, -1.0f), V3(0.35f, 0.35f, 0.35f)},
+    };
+    v3 colors[5] =
+    {
+        V3(0.1f, 1.0f, 0.5f), V3(1.0f, 0.8f, 0.1f), V3(0.5f, 0.5f, 1.0f),
+        V3(1.0f, 0.3f, 0.3f), V3(0.9f, 0.9f, 0.9f),
+    };
+    // NOTE: the default, the floor and one per instance
+    Material *materials = PUSH_ARRAY(&world->arena, 7, Material);
+    materials[DEFAULT_MATERIAL] = material();
+    materials[1] = material();
+    materials[1].color = V3(1.0f, 0.9f, 0.9f);
+    materials[1].specular = 0.0f;
+
+    MeshInstance *instances = PUSH_ARRAY(&world->arena, 5, MeshInstance);
+    for(u32 instance_index = 0;
+        instance_index < 5;
+        ++instance_index)
+    {
+        Material *m = materials + 2 + instance_index;
+        *m = material();
+        m->color = colors[instance_index];
+        m->diffuse = 0.7f;
+        m->specular = 0.3f;
+
+        m4x4 transform = m4x4_mul(m4x4_translation_matrix(placements[instance_index][0]),
+                                  m4x4_scale_matrix(placements[instance_index][1]));
+        instances[instance_index] = mesh_instance(0, transform);
+        instances[instance_index].material_index = 2 + instance_index;
+    }
+
+    Plane *floor = PUSH_STRUCT(&world->arena, Plane);
+    *floor = plane(m4x4_identity());
+    floor->material_index = 1;
+
+    Light *lights = PUSH_ARRAY(&world->arena, 2, Light);
+    lights[0] = point_light(Point(-10.0f, 10.0f, -10.0f), V3(1.0f, 1.0f, 1.0f));
+    lights[1] = point_light(Point(10.0f, 10.0f, -10.0f), V3(0.35f, 0.2f, 0.35f));
+
+    world->instance_count = 5;
+    world->instances = instances;
+    world->plane_count = 1;
+    world->planes = floor;
+    world->material_count = 7;
+    world->materials = materials;
+    world->light_count = 2;
+    world->lights = lights;
+    count_objects(world);
+}
+
+// NOTE: a night scene for the light culling: light_count dim lights with
+// falloff on a square grid 3 units apart, 2 units up, over a floor with
+// small spheres scattered between them. With the default cutoff each light
+// reaches about 14 units, so a shade point sees a few dozen of them however
+// big the grid gets.
+internal void build_light_stress_scene(World *world, u32 light_count, u32 seed)
+{
+    thread_random = random_seed(seed, 0);
+
+    u32 side = (u32)ceilf(square_root((f32)light_count));
+    f32 spacing = 3.0f;
+    f32 half_width = 0.5f * spacing * (f32)(side - 1);
+    f32 depth = spacing * (f32)(side - 1);
+
+    Light *lights = PUSH_ARRAY(&world->arena, light_count, Light);
+    for(u32 light_index = 0;
+        light_index < light_count;
+        ++light_index)
+    {
+        f32 x = -half_width + spacing * (f32)(light_index % side);
+        f32 z = spacing * (f32)(light_index / side);
+        v3 color = V3(f32_random_within(0.3f, 1.0f), f32_random_within(0.3f, 1.0f), f32_random_within(0.3f, 1.0f));
+        f32 brightest = f32_max(color.x, f32_max(color.y, color.z));
+        lights[light_index] = point_light(Point(x, 2.0f, z), v3_scalar_mul(color, 0.8f / brightest));
+        lights[light_index].falloff = 1;
+    }
+
+    // NOTE: the default, the floor and one per sphere
+    u32 sphere_count = 2 * light_count;
+    u32 material_count = sphere_count + 2;
+    Material *materials = PUSH_ARRAY(&world->arena, material_count, Material);
+    materials[DEFAULT_MATERIAL] = material();
+    materials[1] = material();
+    materials[1].color = V3(0.6f, 0.6f, 0.6f);
+    materials[1].specular = 0.0f;
+
+    Sphere *spheres = PUSH_ARRAY(&world->arena, sphere_count, Sphere);
+    for(u32 sphere_index = 0;
+        sphere_index < sphere_count;
+        ++sphere_index)
+    {
+        f32 radius = f32_random_within(0.2f, 0.6f);
+        v3 center = V3(f32_random_within(-half_width - spacing, half_width + spacing), radius,
+                       f32_random_within(0.0f, depth + spacing));
+        Material *m = materials + 2 + sphere_index;
+        *m = material();
+        m->color = V3(f32_random_within(0.2f, 1.0f), f32_random_within(0.2f, 1.0f), f32_random_within(0.2f, 1.0f));
+        m->diffuse = 0.7f;
+        m->specular = 0.3f;
+
+        Sphere s = sphere(origin(), 1.0f);
+        s.material_index = 2 + sphere_index;
+        set_sphere_transform(&s, m4x4_mul(m4x4_translation_matrix(center), m4x4_scale_matrix(V3(radius, radius, radius))));
+        spheres[sphere_index] = s;
+    }
+
+    Plane *floor = PUSH_STRUCT(&world->arena, Plane);
+    *floor = plane(m4x4_identity());
+    floor->material_index = 1;
+
+    world->sphere_count = sphere_count;
+    world->spheres = spheres;
+    world->plane_count = 1;
+    world->planes = floor;
+    world->material_count = material_count;
+    world->materials = materials;
+    world->light_count = light_count;
+    world->lights = lights;
+    count_objects(world);
+}
+
+// NOTE: scene_filename (text or binary cache) wins over stress_count, which
+// wins over stress_triangles and then stress_lights, with none of them it is
+// the demo. The light tree is built for light_cutoff on every path.
+// view comes back with the image size, camera and background to render with.
+internal bool setup_world(World *world, SceneView *view, char *scene_filename, u32 stress_count,
+                          u32 stress_triangles, u32 stress_lights, bool use_bvh, SphereKernelType kernel,
+                          bool verbose)
+{
+    *view = default_view();
+    if(scene_filename && is_scene_cache(scene_filename))
+    {
+        f64 map_start = get_wall_clock();
+        u32 leaf_width;
+        if(!map_scene_cache(scene_filename, world, view, &leaf_width))
+        {
+            return(false);
+        }
+        if(!use_bvh)
+        {
+            world->bvh = (BVH){0};
+        }
+        if(verbose)
+        {
+            printf("Scene cache: %s, %u objects (%u spheres), %u lights, %u bvh nodes, mapped in %.3fs\n",
+                   scene_filename, world->object_count, world->sphere_count, world->light_count, world->bvh.node_count,
+                   get_wall_clock() - map_start);
+            if(use_bvh && leaf_width != sphere_kernel_width(kernel))
+            {
+                printf("Scene cache bvh was built for %u wide leaves, reconvert for the %s kernel\n",
+                       leaf_width, sphere_kernel_name(kernel));
+            }
+        }
+        build_light_tree(world, light_cutoff);
+        return(true);
+    }
+    else if(scene_filename)
+    {
+        f64 load_start = get_wall_clock();
+        if(!load_scene(scene_filename, world, view))
+        {
+            return(false);
+        }
+        if(verbose)
+        {
+            printf("Scene: %s, %u objects (%u spheres), %u lights, loaded in %.3fs\n",
+                   scene_filename, world->object_count, world->sphere_count, world->light_count, get_wall_clock() - load_start);
+        }
+    }
+    else if(stress_count > 0)
+    {
+        build_stress_scene(world, stress_count, 1234);
+    }
+    else if(stress_triangles > 0)
+    {
+        f64 build_start = get_wall_clock();
+        build_mesh_stress_scene(world, stress_triangles);
+        if(verbose)
+        {
+            printf("Mesh: %u triangles, %u vertices, %u blas nodes, built in %.3fs\n",
+                   world->mesh_triangle_count, world->mesh_vertex_count, world->mesh_node_count,
+                   get_wall_clock() - build_start);
+        }
+    }
+    else if(stress_lights > 0)
+    {
+        build_light_stress_scene(world, stress_lights, 1234);
+    }
+    else
+    {
+        build_demo_scene(world);
+    }
+
+    if(world->instance_count > 0)
+    {
+        build_instance_bvh(world);
+        if(verbose)
+        {
+            printf("TLAS: %u instances of %u meshes (%u triangles), %u nodes\n",
+                   world->instance_count, world->mesh_count, world->mesh_triangle_count, world->tlas.node_count);
+        }
+    }
+
+    if(use_bvh)
+    {
+        f64 build_start = get_wall_clock();
+        build_world_bvh(world, sphere_kernel_width(kernel));
+        if(verbose)
+        {
+            printf("BVH: %u spheres, %u nodes, built in %.3fs\n",
+                   world->sphere_count, world->bvh.node_count, get_wall_clock() - build_start);
+        }
+    }
+    build_world_soa(world);
+
+    build_light_tree(world, light_cutoff);
+    if(verbose && world->light_tree.bvh.node_count > 0)
+    {
+        printf("Light tree: %u lights, %u with falloff, %u nodes, cutoff %g\n",
+               world->light_count, world->light_count - world->light_tree.global_count,
+               world->light_tree.bvh.node_count, light_cutoff);
+    }
+    return(true);
+}
+
+internal void free_world(World *world)
+{
+    if(world->mapped_memory)
+    {
+        unmap_file(world->mapped_memory, world->mapped_size);
+    }
+    free_arena(&world->arena);
+    *world = (World){0};
+}
+
+// NOTE: the benchmark, progressive mode and sequences drive the render code
+// above, so they come in here
+#include "dolus_bench.h"
+#include "dolus_progressive.h"
+#include "dolus_sequence.h"
+
+// NOTE: previews go through the async writer, the copy is quick and the
+// encode overlaps the next batch of tiles
+typedef struct
+{
+    char *filename;
+    f64 start_time;
+    AsyncImageWriter writer;
+} PreviewOutput;
+
+internal void write_preview(ImageU32 *image, u32 step, f32 done, void *data)
+{
+    PreviewOutput *preview = (PreviewOutput *)data;
+    async_writer_submit(&preview->writer, image, preview->filename);
+    printf("Preview: step %u, %5.1f%% traced, %.3fs\n", step, done * 100.0f, get_wall_clock() - preview->start_time);
+    fflush(stdout);
+}
+
+internal void usage(char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --threads N    worker threads, 1 renders serially (default: cpu count)\n"
+            "  --tile N       tile size in pixels (default: 32)\n"
+            "  --output FILE  output image, .bmp, .ppm or .png (default: output.bmp)\n"
+            "  --png-store    write png without compression (faster, bigger)\n"
+            "  --scene FILE   render a scene file or scene cache instead of the demo\n"
+            "  --write-scene FILE  save the scene (demo, --stress or --scene) as a\n"
+            "                 scene file and exit\n"
+            "  --convert FILE save the scene with its bvh as a binary scene cache\n"
+            "                 (loads with --scene, no parsing or building) and exit\n"
+            "  --bench-startup  time loading --scene as text against its scene cache\n"
+            "  --stress N     replace the demo scene with N random spheres\n"
+            "  --stress-mesh N          replace the demo scene with five instances of\n"
+            "                 one N triangle mesh\n"
+            "  --stress-lights N        replace the demo scene with a night scene lit by\n"
+            "                 N point lights with falloff\n"
+            "  --size WxH     image size, overrides the scene's (default: 1280x750)\n"
+            "  --stream       write finished bands of tiles straight to the output\n"
+            "                 instead of keeping the whole frame in memory\n"
+            "  --progressive  trace a coarse grid first and refine it, writing the\n"
+            "                 output as a preview along the way; the final image is\n"
+            "                 the same as a normal render\n"
+            "  --progressive-step N      first pass block size (default: 8)\n"
+            "  --progressive-interval S  seconds between previews (default: 0.5)\n"
+            "  --frames N     render an N frame sequence from one setup, frame i goes\n"
+            "                 to the output name with _000i before the extension\n"
+            "  --orbit DEG    turn the camera around its look at point by DEG degrees\n"
+            "                 over the sequence\n"
+            "  --fly X,Y,Z    move the camera by X,Y,Z over the sequence\n"
+            "  --sphere-motion D        move every sphere D units over the sequence,\n"
+            "                 each in its own random direction\n"
+            "  --rebuild-ratio R        refit the bvh between frames until its sah cost\n"
+            "                 is R times the last build's, then rebuild (default: 1.5)\n"
+            "  --no-refit     rebuild the bvh for every frame instead of refitting it\n"
+            "  --spp N        samples per pixel, stratified and jittered (default: 1,\n"
+            "                 at most 256)\n"
+            "  --adaptive     trace a quarter of the samples everywhere and the rest\n"
+            "                 only where a pixel differs from its neighbours\n"
+            "  --adaptive-threshold T   per channel difference (0..1) that counts as\n"
+            "                 differing (default: 0.05)\n"
+            "  --integrator I shading: direct (phong, shadow rays) or path (path tracing\n"
+            "                 with next event estimation to the lights) (default: direct)\n"
+            "  --max-bounces N          indirect bounces per path at most (default: 8)\n"
+            "  --max-depth N  reflection/refraction rays per chain at most (default: 5)\n"
+            "  --min-contribution W     skip reflection/refraction rays that count for\n"
+            "                 less than W of their pixel (default: 1/255)\n"
+            "  --shadow-samples N       shadow rays per area light (1..1024), overrides the\n"
+            "                 scene. Rounded up to a square grid, 5 traces 9 rays\n"
+            "  --no-adaptive-shadows    trace every area light sample instead of probing\n"
+            "                 the corners first\n"
+            "  --light-cutoff C         lights with falloff stop where they get dimmer\n"
+            "                 than C, C > 0 (default: 1/256)\n"
+            "  --no-light-culling       shade every light everywhere, no cutoff\n"
+            "  --light-samples N        shade N lights per point picked by estimated\n"
+            "                 contribution instead of all of them (1..16, default: all)\n"
+            "  --no-bvh       intersect every sphere linearly instead of using the bvh\n"
+            "  --kernel K     sphere kernel: auto, scalar, sse, avx2 (default: auto)\n"
+            "  --mode M       primary rays: pixel, packet (8 wide, avx2) or both to\n"
+            "                 benchmark one against the other (default: pixel)\n"
+            "  --bench        render the reference scenes, report rays/sec and phase\n"
+            "                 timings, compare against the baseline (exit 2 on regression)\n"
+            "  --bench-iterations N     renders per scene (default: 5)\n"
+            "  --bench-json FILE        results (default: bench.json)\n"
+            "  --bench-baseline FILE    baseline to compare with (default: bench_baseline.json)\n"
+            "  --bench-update-baseline  write the results as the new baseline\n"
+            "  --bench-require-baseline fail when there is no baseline to compare with\n"
+            "  --bench-tolerance PCT    allowed slowdown in percent (default: 10)\n",
+            program);
+}
+
+internal void print_render_summary(RenderJob *job, u32 width, u32 height, f64 elapsed, u32 thread_count)
+{
+    f64 samples = (f64)job->stats.primary_rays / ((f64)width * (f64)height);
+    printf("Rendered %ux%u in %.3fs on %u thread(s), %.2f Mrays/s primary",
+           width, height, elapsed, thread_count, job->stats.primary_rays / elapsed * 1e-6);
+    if(job->samples_per_pixel > 1)
+    {
+        printf(", %.2f samples per pixel", samples);
+    }
+    if(job->integrator == Integrator_Path)
+    {
+        printf(", %.2f bounces per path", (f64)job->stats.secondary_rays / (f64)job->stats.primary_rays);
+    }
+    else if(job->stats.secondary_rays)
+    {
+        printf(", %.2f secondary rays per primary", (f64)job->stats.secondary_rays / (f64)job->stats.primary_rays);
+    }
+    for(u32 light_index = 0;
+        light_index < job->world->light_count;
+        ++light_index)
+    {
+        if(job->world->lights[light_index].type != Light_Point)
+        {
+            printf(", %.2f shadow rays per primary", (f64)job->stats.shadow_rays / (f64)job->stats.primary_rays);
+            break;
+        }
+    }
+    printf("\n");
+    printf("Allocations while tracing: %llu\n", (unsigned long long)job->stats.allocations);
+}
+
+int main(int argc, char *argv[])
+{
+    u32 thread_count = get_cpu_count();
+    u32 tile_size = 32;
+    char *output_filename = "output.bmp";
+    u32 stress_count = 0;
+    u32 stress_triangles = 0;
+    u32 stress_lights = 0;
+    char *scene_filename = 0;
+    char *write_scene_filename = 0;
+    char *convert_filename = 0;
+    bool bench_startup = false;
+    bool progressive = false;
+    bool stream = false;
+    u32 size_width = 0;
+    u32 size_height = 0;
+    u32 progressive_step = 8;
+    f64 progressive_interval = 0.5;
+    u32 samples_per_pixel = 1;
+    bool adaptive = false;
+    f32 adaptive_threshold = 0.05f;
+    Integrator integrator = Integrator_Direct;
+    u32 max_bounces = 8;
+    u32 max_depth = 5;
+    f32 min_contribution = 1.0f / 255.0f;
+    u32 shadow_samples = 0;
+    bool use_bvh = true;
+    SphereKernelType kernel = SphereKernel_Auto;
+    RenderMode mode = RenderMode_Pixel;
+    // NOTE: --mode both, the frame is rendered in both modes and compared
+    bool compare_modes = false;
+    bool bench = false;
+    SequenceSettings sequence = {};
+    sequence.rebuild_ratio = SEQUENCE_REBUILD_RATIO;
+    sequence.refit = true;
+    BenchSettings bench_settings = {};
+    bench_settings.iterations = 5;
+    bench_settings.json_filename = "bench.json";
+    bench_settings.baseline_filename = "bench_baseline.json";
+    bench_settings.tolerance = 0.10;
+
+    for(int arg_index = 1;
+        arg_index < argc;
+        ++arg_index)
+    {
+        char *arg = argv[arg_index];
+        bool has_value = (arg_index + 1) < argc;
+        if(strcmp(arg, "--threads") == 0 && has_value)
+        {
+            thread_count = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--tile") == 0 && has_value)
+        {
+            tile_size = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--output") == 0 && has_value)
+        {
+            output_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--stress") == 0 && has_value)
+        {
+            stress_count = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--stress-mesh") == 0 && has_value)
+        {
+            stress_triangles = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--stress-lights") == 0 && has_value)
+        {
+            stress_lights = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--scene") == 0 && has_value)
+        {
+            scene_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--write-scene") == 0 && has_value)
+        {
+            write_scene_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--convert") == 0 && has_value)
+        {
+            convert_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--bench-startup") == 0)
+        {
+            bench_startup = true;
+        }
+        else if(strcmp(arg, "--png-store") == 0)
+        {
+            png_compression = PNGCompression_Store;
+        }
+        else if(strcmp(arg, "--stream") == 0)
+        {
+            stream = true;
+        }
+        else if(strcmp(arg, "--size") == 0 && has_value)
+        {
+            if(sscanf(argv[++arg_index], "%ux%u", &size_width, &size_height) != 2 || !size_width || !size_height)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--progressive") == 0)
+        {
+            progressive = true;
+        }
+        else if(strcmp(arg, "--progressive-step") == 0 && has_value)
+        {
+            progressive_step = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--progressive-interval") == 0 && has_value)
+        {
+            progressive_interval = atof(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--frames") == 0 && has_value)
+        {
+            sequence.frame_count = (u32)atoi(argv[++arg_index]);
+            if(sequence.frame_count == 0)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--orbit") == 0 && has_value)
+        {
+            sequence.orbit = (f32)atof(argv[++arg_index]) * PI32 / 180.0f;
+        }
+        else if(strcmp(arg, "--fly") == 0 && has_value)
+        {
+            if(sscanf(argv[++arg_index], "%f,%f,%f", &sequence.fly.x, &sequence.fly.y, &sequence.fly.z) != 3)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--sphere-motion") == 0 && has_value)
+        {
+            sequence.sphere_motion = (f32)atof(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--rebuild-ratio") == 0 && has_value)
+        {
+            sequence.rebuild_ratio = (f32)atof(argv[++arg_index]);
+            if(sequence.rebuild_ratio < 1.0f)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--no-refit") == 0)
+        {
+            sequence.refit = false;
+        }
+        else if(strcmp(arg, "--spp") == 0 && has_value)
+        {
+            samples_per_pixel = (u32)atoi(argv[++arg_index]);
+            if(samples_per_pixel < 1)
+            {
+                samples_per_pixel = 1;
+            }
+            if(samples_per_pixel > MAX_SAMPLES_PER_PIXEL)
+            {
+                samples_per_pixel = MAX_SAMPLES_PER_PIXEL;
+            }
+        }
+        else if(strcmp(arg, "--adaptive") == 0)
+        {
+            adaptive = true;
+        }
+        else if(strcmp(arg, "--adaptive-threshold") == 0 && has_value)
+        {
+            adaptive_threshold = (f32)atof(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--integrator") == 0 && has_value)
+        {
+            char *name = argv[++arg_index];
+            if(strcmp(name, "direct") == 0)
+            {
+                integrator = Integrator_Direct;
+            }
+            else if(strcmp(name, "path") == 0)
+            {
+                integrator = Integrator_Path;
+            }
+            else
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--max-bounces") == 0 && has_value)
+        {
+            max_bounces = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--max-depth") == 0 && has_value)
+        {
+            max_depth = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--min-contribution") == 0 && has_value)
+        {
+            min_contribution = (f32)atof(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--shadow-samples") == 0 && has_value)
+        {
+            shadow_samples = (u32)atoi(argv[++arg_index]);
+            if(shadow_samples == 0 || shadow_samples > AREA_LIGHT_MAX_SAMPLES)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--no-adaptive-shadows") == 0)
+        {
+            adaptive_shadows = false;
+        }
+        else if(strcmp(arg, "--light-cutoff") == 0 && has_value)
+        {
+            light_cutoff = (f32)atof(argv[++arg_index]);
+            if(!(light_cutoff > 0.0f) || !isfinite(light_cutoff))
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--no-light-culling") == 0)
+        {
+            light_cutoff = 0.0f;
+        }
+        else if(strcmp(arg, "--light-samples") == 0 && has_value)
+        {
+            light_samples = (u32)atoi(argv[++arg_index]);
+            if(light_samples == 0 || light_samples > LIGHT_SAMPLES_MAX)
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--no-bvh") == 0)
+        {
+            use_bvh = false;
+        }
+        else if(strcmp(arg, "--bench") == 0)
+        {
+            bench = true;
+        }
+        else if(strcmp(arg, "--bench-iterations") == 0 && has_value)
+        {
+            bench_settings.iterations = (u32)atoi(argv[++arg_index]);
+        }
+        else if(strcmp(arg, "--bench-json") == 0 && has_value)
+        {
+            bench_settings.json_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--bench-baseline") == 0 && has_value)
+        {
+            bench_settings.baseline_filename = argv[++arg_index];
+        }
+        else if(strcmp(arg, "--bench-update-baseline") == 0)
+        {
+            bench_settings.update_baseline = true;
+        }
+        else if(strcmp(arg, "--bench-require-baseline") == 0)
+        {
+            bench_settings.require_baseline = true;
+        }
+        else if(strcmp(arg, "--bench-tolerance") == 0 && has_value)
+        {
+            bench_settings.tolerance = atof(argv[++arg_index]) / 100.0;
+        }
+        else if(strcmp(arg, "--mode") == 0 && has_value)
+        {
+            char *name = argv[++arg_index];
+            if(strcmp(name, "pixel") == 0)
+            {
+                mode = RenderMode_Pixel;
+            }
+            else if(strcmp(name, "packet") == 0)
+            {
+                mode = RenderMode_Packet;
+            }
+            else if(strcmp(name, "both") == 0)
+            {
+                compare_modes = true;
+            }
+            else
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else if(strcmp(arg, "--kernel") == 0 && has_value)
+        {
+            char *name = argv[++arg_index];
+            if(strcmp(name, "scalar") == 0)
+            {
+                kernel = SphereKernel_Scalar;
+            }
+            else if(strcmp(name, "sse") == 0)
+            {
+                kernel = SphereKernel_SSE;
+            }
+            else if(strcmp(name, "avx2") == 0)
+            {
+                kernel = SphereKernel_AVX2;
+            }
+            else if(strcmp(name, "auto") == 0)
+            {
+                kernel = SphereKernel_Auto;
+            }
+            else
+            {
+                usage(argv[0]);
+                return(1);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return(1);
+        }
+    }
+
+    v3 color1 = V3(0.9, 0.6, 0.75);
+    v3 color2 = V3(0.7, 0.1, 0.25);
+    v3 color3 = v3_mul(color1, color2);
+
+    ImageU32 image = {};
+    image.width = 1280;
+    image.height = 750;
+    // image.width = 100;
+    // image.height = 50;
+
+    
+    kernel = select_sphere_kernel(kernel);
+    select_output_kernels();
+    if(!image_format_for(output_filename))
+    {
+        fprintf(stderr, "[Error] No image writer for %s, use .bmp, .ppm or .png\n", output_filename);
+        return(1);
+    }
+    printf("Sphere kernel: %s\n", sphere_kernel_name(kernel));
+
+    if((mode == RenderMode_Packet || compare_modes) && !get_cpu_features().avx2)
+    {
+        printf("Packet tracing needs avx2, rendering per pixel\n");
+        mode = RenderMode_Pixel;
+        compare_modes = false;
+    }
+
+    if(bench)
+    {
+        ThreadPool pool;
+        thread_pool_init(&pool, thread_count);
+
+        bench_settings.mode = mode;
+        bench_settings.use_bvh = use_bvh;
+        bench_settings.kernel = kernel;
+        bench_settings.tile_size = tile_size;
+        bench_settings.width = size_width ? size_width : image.width;
+        bench_settings.height = size_width ? size_height : image.height;
+        int exit_code = run_benchmark(&pool, &bench_settings);
+
+        thread_pool_shutdown(&pool);
+        return(exit_code);
+    }
+
+    if(bench_startup)
+    {
+        return(run_startup_benchmark(scene_filename, kernel, bench_settings.iterations));
+    }
+
+    World world = {};
+    SceneView view;
+    if(convert_filename)
+    {
+        use_bvh = true;
+    }
+    if(!setup_world(&world, &view, scene_filename, stress_count, stress_triangles, stress_lights,
+                    use_bvh && !write_scene_filename, kernel, true))
+    {
+        return(1);
+    }
+
+    if(convert_filename)
+    {
+        f64 write_start = get_wall_clock();
+        if(!write_scene_cache(convert_filename, &world, &view, sphere_kernel_width(kernel)))
+        {
+            return(1);
+        }
+        printf("Wrote scene cache %s in %.3fs\n", convert_filename, get_wall_clock() - write_start);
+        free_world(&world);
+        return(0);
+    }
+
+    if(write_scene_filename)
+    {
+        f64 write_start = get_wall_clock();
+        if(!write_scene(write_scene_filename, &world, &view))
+        {
+            return(1);
+        }
+        printf("Wrote %u objects to %s in %.3fs\n", world.object_count, write_scene_filename, get_wall_clock() - write_start);
+        free_world(&world);
+        return(0);
+    }
+
+    if(shadow_samples)
+    {
+        for(u32 light_index = 0;
+            light_index < world.light_count;
+            ++light_index)
+        {
+            if(world.lights[light_index].type != Light_Point)
+            {
+                world.lights[light_index].samples = shadow_samples;
+            }
+        }
+    }
+
+    if(size_width)
+    {
+        view.width = size_width;
+        view.height = size_height;
+    }
+    image.width = view.width;
+    image.height = view.height;
+    u32 OutputPixelSize = get_pixel_size(image);
+    if(stream && (progressive || compare_modes))
+    {
+        printf("--stream renders the frame once band by band, ignoring --progressive and --mode both\n");
+        progressive = false;
+        compare_modes = false;
+    }
+    if(sequence.frame_count && (stream || progressive || compare_modes))
+    {
+        printf("--frames renders whole frames, ignoring --stream, --progressive and --mode both\n");
+        stream = false;
+        progressive = false;
+        compare_modes = false;
+    }
+    if(!stream)
+    {
+        image.pixels = (u32 *)heap_alloc(OutputPixelSize);
+    }
+
+    Camera cam = view_camera(&view);
+
+    ThreadPool pool;
+    thread_pool_init(&pool, thread_count);
+
+    RenderJob job = {};
+    job.world = &world;
+    job.camera = &cam;
+    job.image = &image;
+    job.background_color = view.background;
+    job.tile_size = tile_size;
+    job.samples_per_pixel = samples_per_pixel;
+    job.adaptive_threshold = adaptive ? adaptive_threshold : 0.0f;
+    job.integrator = integrator;
+    job.max_bounces = max_bounces;
+    job.max_depth = max_depth;
+    job.min_contribution = min_contribution;
+    if(progressive && adaptive && samples_per_pixel > 1)
+    {
+        printf("--progressive traces every sample of every pixel, ignoring --adaptive\n");
+    }
+    if(progressive && (mode == RenderMode_Packet || compare_modes))
+    {
+        printf("--progressive traces per pixel, ignoring --mode %s\n", compare_modes ? "both" : "packet");
+        mode = RenderMode_Pixel;
+        compare_modes = false;
+    }
+    if(sequence.frame_count)
+    {
+        job.mode = mode;
+        sequence.leaf_width = sphere_kernel_width(kernel);
+        printf("The rays are casting (%u frames)\n", sequence.frame_count);
+        run_sequence(&pool, &job, &view, &sequence, output_filename);
+    }
+    else if(compare_modes)
+    {
+        // NOTE: render the same frame both ways, report rays/sec for each and
+        // make sure the packet path did not change a single pixel
+        ImageU32 packet_image = image;
+        packet_image.pixels = (u32 *)heap_alloc(OutputPixelSize);
+
+        printf("The rays are casting (pixel)\n");
+        job.mode = RenderMode_Pixel;
+        f64 start_time = get_wall_clock();
+        render_image(&pool, &job);
+        f64 pixel_elapsed = get_wall_clock() - start_time;
+        u64 primary_rays = job.stats.primary_rays;
+
+        printf("\nThe rays are casting (packet)\n");
+        job.mode = RenderMode_Packet;
+        job.image = &packet_image;
+        start_time = get_wall_clock();
+        render_image(&pool, &job);
+        f64 packet_elapsed = get_wall_clock() - start_time;
+        job.image = &image;
+
+        bool identical = memcmp(image.pixels, packet_image.pixels, OutputPixelSize) == 0;
+        printf("\npixel:  %.3fs, %.2f Mrays/s\n", pixel_elapsed, primary_rays / pixel_elapsed * 1e-6);
+        printf("packet: %.3fs, %.2f Mrays/s (%.2fx)\n", packet_elapsed, primary_rays / packet_elapsed * 1e-6, pixel_elapsed / packet_elapsed);
+        printf("images %s\n", identical ? "identical" : "DIFFER");
+        heap_free(packet_image.pixels);
+    }
+    else if(stream)
+    {
+        job.mode = mode;
+        printf("The rays are casting (streaming to %s)\n", output_filename);
+        f64 start_time = get_wall_clock();
+        render_image_streaming(&pool, &job, image.width, image.height, output_filename);
+        f64 elapsed = get_wall_clock() - start_time;
+        printf("\n");
+        print_render_summary(&job, image.width, image.height, elapsed, pool.thread_count);
+    }
+    else if(progressive)
+    {
+        PreviewOutput preview = {};
+        preview.filename = output_filename;
+        preview.start_time = get_wall_clock();
+        async_writer_start(&preview.writer);
+        job.mode = mode;
+        printf("The rays are casting (progressive)\n");
+        render_progressive(&pool, &job, progressive_step, progressive_interval, write_preview, &preview);
+        async_writer_stop(&preview.writer);
+        f64 elapsed = get_wall_clock() - preview.start_time;
+        print_render_summary(&job, image.width, image.height, elapsed, pool.thread_count);
+    }
+    else
+    {
+        job.mode = mode;
+        printf("The rays are casting\n");
+        f64 start_time = get_wall_clock();
+        render_image(&pool, &job);
+        f64 elapsed = get_wall_clock() - start_time;
+        printf("\n");
+        print_render_summary(&job, image.width, image.height, elapsed, pool.thread_count);
+    }
+
+    thread_pool_shutdown(&pool);
+    free_arena(&job.frame_arena);
+
+    if(!stream && !sequence.frame_count)
+    {
+        f64 save_start = get_wall_clock();
+        save_image(image, output_filename);
+        printf("Saved %s in %.3fs\n", output_filename, get_wall_clock() - save_start);
     }
 
-    save_to_bpm(image, "output.bmp");
-    // save_to_ppm(image, "output.ppm");
+    printf("Peak memory: %.1f MB resident (frame %.1f MB%s), %.1f MB in arenas (%llu huge page blocks)\n",
+           get_peak_resident_bytes() / (1024.0 * 1024.0), OutputPixelSize / (1024.0 * 1024.0),
+           stream ? ", streamed" : "", memory_stats.mapped_bytes / (1024.0 * 1024.0),
+           (unsigned long long)memory_stats.huge_blocks_mapped);
     
-    printf("\nHello Dolus\n");
+    printf("Hello Dolus\n");
     return(0);
 }